@@ -18,6 +18,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 error_struct _errors[] = {
     {-1,"CL_DEVICE_NOT_FOUND","clGetDeviceIDs","if no OpenCL devices that matched device_type were found."},
@@ -103,6 +109,18 @@ void print_err_msg(cl_int err_code) {
 //	}
 //}
 
+void waitForEvent(cl_event event) {
+    check_error(clWaitForEvents(1, &event));
+    check_error(clReleaseEvent(event));
+}
+
+cl_ulong getEventDuration(cl_event event) {
+    cl_ulong start = 0, end = 0;
+    check_error(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL));
+    check_error(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL));
+    return end - start;
+}
+
 void CL_CALLBACK error_callback_func (const char *errinfo,
     const void *private_info, size_t cb,
     void *user_data) {
@@ -237,6 +255,17 @@ std::string OpenCLDevice::getName() {
     return rtn;
 }
 
+std::string OpenCLDevice::getDriverVersion() {
+    size_t param_value_size_ret;
+    check_error(clGetDeviceInfo(my_id, CL_DRIVER_VERSION, 0, NULL, &param_value_size_ret));
+    char *version = new char[param_value_size_ret + 1];
+    check_error(clGetDeviceInfo(my_id, CL_DRIVER_VERSION, param_value_size_ret, version, NULL));
+
+    std::string rtn(version);
+    delete[] version;
+    return rtn;
+}
+
 std::string OpenCLDevice::getVendor() {
     size_t param_value_size_ret;
     check_error(clGetDeviceInfo(my_id, CL_DEVICE_VENDOR, 0, NULL, &param_value_size_ret));
@@ -259,6 +288,51 @@ std::string OpenCLDevice::getSupportedExtensions() {
     return rtn;
 }
 
+// Vendor specific queries, defined here since older headers lack them
+#define XPT_CL_DEVICE_PCI_BUS_INFO_KHR  0x410F
+#define XPT_CL_DEVICE_TOPOLOGY_AMD      0x4037
+#define XPT_CL_DEVICE_PCI_BUS_ID_NV     0x4008
+#define XPT_CL_DEVICE_PCI_SLOT_ID_NV    0x4009
+#define XPT_CL_DEVICE_PCI_DOMAIN_ID_NV  0x400A
+
+std::string OpenCLDevice::getPciAddress() {
+    // No check_error() here, unsupported queries just fail
+    cl_uint domain = 0, bus = 0, dev = 0, function = 0;
+    bool found = false;
+
+    cl_uint khr[4];
+    if (!found && clGetDeviceInfo(my_id, XPT_CL_DEVICE_PCI_BUS_INFO_KHR, sizeof(khr), khr, NULL) == CL_SUCCESS) {
+        domain = khr[0]; bus = khr[1]; dev = khr[2]; function = khr[3];
+        found = true;
+    }
+
+    // cl_device_topology_amd, type 1 = PCIe with bus, device and function in the last three bytes
+    cl_uint amd[6];
+    if (!found && clGetDeviceInfo(my_id, XPT_CL_DEVICE_TOPOLOGY_AMD, sizeof(amd), amd, NULL) == CL_SUCCESS && amd[0] == 1) {
+        cl_uchar* bytes = (cl_uchar*)amd;
+        bus = bytes[21]; dev = bytes[22]; function = bytes[23];
+        found = true;
+    }
+
+    cl_uint nv_bus, nv_slot;
+    if (!found && clGetDeviceInfo(my_id, XPT_CL_DEVICE_PCI_BUS_ID_NV, sizeof(nv_bus), &nv_bus, NULL) == CL_SUCCESS &&
+        clGetDeviceInfo(my_id, XPT_CL_DEVICE_PCI_SLOT_ID_NV, sizeof(nv_slot), &nv_slot, NULL) == CL_SUCCESS) {
+        if (clGetDeviceInfo(my_id, XPT_CL_DEVICE_PCI_DOMAIN_ID_NV, sizeof(domain), &domain, NULL) != CL_SUCCESS) {
+            domain = 0;
+        }
+        bus = nv_bus; dev = nv_slot >> 3; function = nv_slot & 7;
+        found = true;
+    }
+
+    if (!found) {
+        return std::string();
+    }
+
+    char address[32];
+    sprintf(address, "%04x:%02x:%02x.%x", domain, bus, dev, function);
+    return std::string(address);
+}
+
 cl_ulong OpenCLDevice::getMaxWorkGroupSize() {
     cl_ulong value;
     check_error(clGetDeviceInfo(my_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, (sizeof(cl_ulong)), &value, NULL));
@@ -359,6 +433,12 @@ OpenCLProgram* OpenCLContext::loadProgramFromFiles(std::vector<std::string> file
 }
 
 OpenCLProgram* OpenCLContext::loadProgramFromStrings(std::vector<std::string> file_strs, std::string params) {
+    OpenCLProgram* ret = new OpenCLProgram(buildProgramFromStrings(file_strs, params), this);
+    programs.push_back(ret);
+    return ret;
+}
+
+cl_program OpenCLContext::buildProgramFromStrings(std::vector<std::string> file_strs, std::string params) {
     // Unsure about this
     const char **str_ptr = new const char*[file_strs.size()];
     size_t *size_ptr = new size_t[file_strs.size()];
@@ -384,14 +464,144 @@ OpenCLProgram* OpenCLContext::loadProgramFromStrings(std::vector<std::string> fi
         assert(!error);
     }
 
-    OpenCLProgram* ret = new OpenCLProgram(program, this);
-    programs.push_back(ret);
-
     delete[] str_ptr;
     delete[] size_ptr;
+    return program;
+}
+
+// 64 bit FNV-1a, only used to name and validate cache files
+static unsigned long long fnv1a_hash(const std::string& data, unsigned long long hash = 0xcbf29ce484222325ULL) {
+    for (size_t i = 0; i < data.size(); i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+OpenCLProgram* OpenCLContext::loadProgramFromStrings(std::vector<std::string> file_strs, std::string params, std::string cache_dir) {
+    // Binaries are only cached for single device contexts
+    if (cache_dir.empty() || devices.size() != 1) {
+        printf("Compiling OpenCL code... this may take 3-5 minutes\n");
+        return loadProgramFromStrings(file_strs, params);
+    }
+
+    unsigned long long source_hash = fnv1a_hash("");
+    for (size_t i = 0; i < file_strs.size(); i++) {
+        source_hash = fnv1a_hash(file_strs[i], source_hash);
+    }
+
+    // Everything that changes the binary, stored in the file and compared on load
+    char source_text[32];
+    sprintf(source_text, "%016llx", source_hash);
+    std::string key = devices[0]->getName() + "\n" + devices[0]->getDriverVersion() + "\n" + source_text + "\n" + params;
+
+    char file_name[64];
+    sprintf(file_name, "/program-%016llx.bin", fnv1a_hash(key));
+    std::string path = cache_dir + file_name;
+
+    cl_program program = loadCachedBinary(path, key, params);
+    if (program != NULL) {
+        printf("Loaded OpenCL binary from %s\n", path.c_str());
+    } else {
+        printf("Compiling OpenCL code... this may take 3-5 minutes\n");
+        program = buildProgramFromStrings(file_strs, params);
+        saveCachedBinary(program, path, key);
+    }
+
+    OpenCLProgram* ret = new OpenCLProgram(program, this);
+    programs.push_back(ret);
     return ret;
 }
 
+// Returns NULL if there's no usable binary, the caller builds from source then
+cl_program OpenCLContext::loadCachedBinary(std::string path, std::string key, std::string params) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file.good()) {
+        return NULL;
+    }
+
+    // File layout: key length (uint32), key, binary
+    unsigned int key_size = 0;
+    file.read((char*)&key_size, sizeof(key_size));
+    if (!file.good() || key_size != key.size()) {
+        return NULL;
+    }
+
+    std::string file_key(key_size, '\0');
+    file.read(&file_key[0], key_size);
+    if (!file.good() || file_key != key) {
+        return NULL;
+    }
+
+    std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (binary.empty()) {
+        return NULL;
+    }
+
+    const unsigned char* binary_ptr = &binary[0];
+    size_t binary_size = binary.size();
+    cl_device_id device_id = devices[0]->getDeviceId();
+    cl_int binary_status, error;
+
+    cl_program program = clCreateProgramWithBinary(context, 1, &device_id, &binary_size, &binary_ptr, &binary_status, &error);
+    if (error == CL_SUCCESS && binary_status == CL_SUCCESS) {
+        error = clBuildProgram(program, 1, &device_id, params.c_str(), NULL, NULL);
+        if (error == CL_SUCCESS) {
+            return program;
+        }
+    }
+
+    printf("Cached OpenCL binary %s was rejected (error %d), rebuilding\n", path.c_str(), error);
+    if (program != NULL) {
+        clReleaseProgram(program);
+    }
+    return NULL;
+}
+
+// Failing to write the cache is not an error, the next start just compiles again
+void OpenCLContext::saveCachedBinary(cl_program program, std::string path, std::string key) {
+    size_t binary_size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL) != CL_SUCCESS || binary_size == 0) {
+        return;
+    }
+
+    std::vector<unsigned char> binary(binary_size);
+    unsigned char* binary_ptr = &binary[0];
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary_ptr, NULL) != CL_SUCCESS) {
+        return;
+    }
+
+    std::string cache_dir = path.substr(0, path.rfind('/'));
+#ifdef _WIN32
+    _mkdir(cache_dir.c_str());
+#else
+    mkdir(cache_dir.c_str(), 0755);
+#endif
+
+    // Written under a temporary name, so a crash never leaves a truncated binary behind
+    std::string temp_path = path + ".tmp";
+    std::ofstream file(temp_path.c_str(), std::ios::binary | std::ios::trunc);
+    unsigned int key_size = key.size();
+    file.write((const char*)&key_size, sizeof(key_size));
+    file.write(key.data(), key.size());
+    file.write((const char*)&binary[0], binary.size());
+    file.close();
+
+    if (!file.good()) {
+        printf("Cannot write OpenCL binary cache %s: %s\n", temp_path.c_str(), strerror(errno));
+        remove(temp_path.c_str());
+        return;
+    }
+
+    remove(path.c_str());
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        remove(temp_path.c_str());
+        return;
+    }
+
+    printf("Saved OpenCL binary to %s\n", path.c_str());
+}
+
 OpenCLContext* OpenCLDevice::getContext() {
 
     if (context == NULL) {
@@ -429,9 +639,9 @@ OpenCLKernel::~OpenCLKernel() {
 //	return createCommandQueue(device);
 //}
 
-OpenCLCommandQueue* OpenCLContext::createCommandQueue(OpenCLDevice* device) {
+OpenCLCommandQueue* OpenCLContext::createCommandQueue(OpenCLDevice* device, cl_command_queue_properties properties) {
     cl_int error;
-    cl_command_queue ret = clCreateCommandQueue (context, device->getDeviceId(), 0, &error);
+    cl_command_queue ret = clCreateCommandQueue (context, device->getDeviceId(), properties, &error);
     check_error(error);
     return new OpenCLCommandQueue(ret);
 }
@@ -516,14 +726,31 @@ void OpenCLCommandQueue::enqueueKernel1D(OpenCLKernel *kernel, size_t worksize,
     check_error(clEnqueueNDRangeKernel (this->queue, kernel->getKernel(), 1, NULL, &worksize, &work_items, 0, NULL, NULL));
 }
 
+void OpenCLCommandQueue::enqueueKernel1D(OpenCLKernel *kernel, size_t worksize, size_t work_items, cl_event* event) {
+    check_error(clEnqueueNDRangeKernel (this->queue, kernel->getKernel(), 1, NULL, &worksize, &work_items, 0, NULL, event));
+}
+
+// Runs global ids offset .. offset + worksize - 1
+void OpenCLCommandQueue::enqueueKernel1DRange(OpenCLKernel *kernel, size_t offset, size_t worksize, size_t work_items, cl_event* event) {
+    check_error(clEnqueueNDRangeKernel (this->queue, kernel->getKernel(), 1, &offset, &worksize, &work_items, 0, NULL, event));
+}
+
 void OpenCLCommandQueue::enqueueReadBuffer(OpenCLBuffer* origin, void* dest, size_t size) {
     check_error(clEnqueueReadBuffer(this->queue, origin->buffer, CL_FALSE, 0, size, dest, 0, NULL, NULL));
 }
 
+void OpenCLCommandQueue::enqueueReadBuffer(OpenCLBuffer* origin, void* dest, size_t size, cl_event* event) {
+    check_error(clEnqueueReadBuffer(this->queue, origin->buffer, CL_FALSE, 0, size, dest, 0, NULL, event));
+}
+
 void OpenCLCommandQueue::enqueueReadBufferBlocking(OpenCLBuffer* origin, void* dest, size_t size) {
     check_error(clEnqueueReadBuffer(this->queue, origin->buffer, CL_TRUE, 0, size, dest, 0, NULL, NULL));
 }
 
+void OpenCLCommandQueue::flush() {
+    check_error(clFlush(this->queue));
+}
+
 void OpenCLCommandQueue::finish() {
     check_error(clFinish(this->queue));
 }
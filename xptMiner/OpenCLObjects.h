@@ -27,6 +27,11 @@
 
 void check_error(int err_code);
 
+// Blocks until the event completed, then releases it
+void waitForEvent(cl_event event);
+// Execution time of a completed command in nanoseconds, the queue needs CL_QUEUE_PROFILING_ENABLE
+cl_ulong getEventDuration(cl_event event);
+
 // forward declarations so i can point to parents;
 class OpenCLProgram;
 class OpenCLContext;
@@ -49,9 +54,13 @@ public:
 	void enqueueWriteBuffer(OpenCLBuffer* dest, void* origin, size_t size);
 	void enqueueWriteBufferBlocking(OpenCLBuffer* dest, void* origin, size_t size);
 	void enqueueKernel1D(OpenCLKernel *kernel,	size_t worksize, size_t work_items);
+	void enqueueKernel1D(OpenCLKernel *kernel,	size_t worksize, size_t work_items, cl_event* event);
+	void enqueueKernel1DRange(OpenCLKernel *kernel, size_t offset, size_t worksize, size_t work_items, cl_event* event);
 	void enqueueReadBuffer(OpenCLBuffer* origin, void* dest, size_t size);
+	void enqueueReadBuffer(OpenCLBuffer* origin, void* dest, size_t size, cl_event* event);
 	void enqueueReadBufferBlocking(OpenCLBuffer* origin, void* dest, size_t size);
 
+	void flush();
 	void finish();
 private:
 	cl_command_queue queue;
@@ -101,7 +110,10 @@ public:
     void dumpDeviceInfo();
 	std::string getName();
     std::string getVendor();
+    std::string getDriverVersion();
     std::string getSupportedExtensions();
+    // PCI address as "dddd:bb:dd.f" from the KHR, AMD or NVIDIA extension, empty if the driver doesn't tell
+    std::string getPciAddress();
 	cl_ulong getMaxWorkGroupSize();
 	cl_ulong getMaxMemAllocSize();
 	cl_ulong getMaxParamSize();
@@ -127,9 +139,11 @@ public:
 
 	OpenCLProgram * loadProgramFromFiles(std::vector<std::string> filename, std::string params);
 	OpenCLProgram * loadProgramFromStrings(std::vector<std::string> program, std::string params);
+	// Same as above, but keeps the built binary in cache_dir and reuses it if device, driver, source and params match
+	OpenCLProgram * loadProgramFromStrings(std::vector<std::string> program, std::string params, std::string cache_dir);
 
 	OpenCLCommandQueue* createCommandQueue(int deviceIndex=0);
-	OpenCLCommandQueue* createCommandQueue(OpenCLDevice* device);
+	OpenCLCommandQueue* createCommandQueue(OpenCLDevice* device, cl_command_queue_properties properties=0);
 
 	// buffers are not stored in the context. Algos have the responsibility to dealocate them;
 	OpenCLBuffer* createBuffer(size_t size, cl_mem_flags flags=CL_MEM_READ_WRITE, void* original=NULL);
@@ -137,6 +151,10 @@ public:
 
 	OpenCLProgram* getProgram(int pos);
 private:
+	cl_program buildProgramFromStrings(std::vector<std::string> file_strs, std::string params);
+	cl_program loadCachedBinary(std::string path, std::string key, std::string params);
+	void saveCachedBinary(cl_program program, std::string path, std::string key);
+
 	cl_context context;
 	std::vector<OpenCLProgram*> programs;
 	std::vector<OpenCLDevice*> devices;
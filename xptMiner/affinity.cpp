@@ -0,0 +1,122 @@
+#include "global.h"
+#include "affinity.h"
+
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+
+// Parses a Linux CPU list ("0-3,8,10-11")
+static std::vector<uint32> parse_cpu_list(const char* text)
+{
+    std::vector<uint32> cpus;
+
+    while (*text != '\0' && *text != '\n') {
+        char* end;
+        uint32 first = (uint32)strtoul(text, &end, 10);
+        uint32 last = first;
+
+        if (end == text) { break; }
+
+        if (*end == '-') {
+            text = end + 1;
+            last = (uint32)strtoul(text, &end, 10);
+        }
+
+        for (uint32 cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+
+        text = (*end == ',') ? end + 1 : end;
+    }
+
+    return cpus;
+}
+
+
+std::vector<uint32> affinity_getAllCpus()
+{
+    std::vector<uint32> cpus;
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+
+    for (uint32 i = 0; i < (uint32)sysinfo.dwNumberOfProcessors; i++) {
+        cpus.push_back(i);
+    }
+
+    return cpus;
+}
+
+
+std::vector<uint32> affinity_getPciDeviceCpus(const std::string& pci_address)
+{
+    std::vector<uint32> cpus;
+
+#ifndef _WIN32
+    if (pci_address.empty()) { return cpus; }
+
+    // local_cpulist covers the NUMA node of the PCIe root the device hangs off
+    std::string path = "/sys/bus/pci/devices/" + pci_address + "/local_cpulist";
+    FILE* file = fopen(path.c_str(), "r");
+
+    if (file != NULL) {
+        char line[1024];
+
+        if (fgets(line, sizeof(line), file) != NULL) {
+            cpus = parse_cpu_list(line);
+        }
+
+        fclose(file);
+    }
+#endif
+
+    return cpus;
+}
+
+
+bool affinity_pinCurrentThread(const std::vector<uint32>& cpus)
+{
+    if (cpus.empty()) { return false; }
+
+#ifdef _WIN32
+    DWORD_PTR mask = 0;
+
+    for (uint32 i = 0; i < cpus.size(); i++) {
+        if (cpus[i] < sizeof(DWORD_PTR) * 8) { mask |= (DWORD_PTR)1 << cpus[i]; }
+    }
+
+    return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (uint32 i = 0; i < cpus.size(); i++) {
+        if (cpus[i] < CPU_SETSIZE) { CPU_SET(cpus[i], &set); }
+    }
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+
+std::string affinity_formatCpuList(const std::vector<uint32>& cpus)
+{
+    std::string text;
+    char range[32];
+
+    for (uint32 i = 0; i < cpus.size(); ) {
+        uint32 last = i;
+        while (last + 1 < cpus.size() && cpus[last + 1] == cpus[last] + 1) { last++; }
+
+        if (last == i) {
+            sprintf(range, "%s%d", text.empty() ? "" : ",", cpus[i]);
+        } else {
+            sprintf(range, "%s%d-%d", text.empty() ? "" : ",", cpus[i], cpus[last]);
+        }
+
+        text += range;
+        i = last + 1;
+    }
+
+    return text;
+}
@@ -0,0 +1,20 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+#include "global.h"
+
+// Thread placement for -affinity. CPUs are logical processor indices as used by the OS.
+// PCI locality is read from sysfs and only known on Linux, pinning works on Linux and Windows (first 64 CPUs).
+
+// All online CPUs
+std::vector<uint32> affinity_getAllCpus();
+
+// CPUs local to the PCI device at "dddd:bb:dd.f", empty if unknown
+std::vector<uint32> affinity_getPciDeviceCpus(const std::string& pci_address);
+
+// Pins the calling thread to the given CPUs, returns false if they are empty or pinning failed
+bool affinity_pinCurrentThread(const std::vector<uint32>& cpus);
+
+// Formats a CPU list the way Linux does, e.g. "0-7,16-23"
+std::string affinity_formatCpuList(const std::vector<uint32>& cpus);
+
+#endif
@@ -72,6 +72,7 @@ typedef struct
     float donationPercent;
 }generalRequestTarget_t;
 
+#include "metrics.h"
 #include "xptServer.h"
 #include "xptClient.h"
 
@@ -95,6 +96,16 @@ extern minerSettings_t minerSettings;
 #define PROTOSHARE_MEM_32		(3)
 #define PROTOSHARE_MEM_8		(4)
 
+// momentum engines
+#define PROTOSHARE_ENGINE_OPENCL	(0)
+#define PROTOSHARE_ENGINE_CPU		(1)
+#define PROTOSHARE_ENGINE_PARTITION	(2)
+
+// collision strategies of the CPU engine
+#define PROTOSHARE_CPU_BUCKET		(0)
+#define PROTOSHARE_CPU_SORT			(1)
+#define PROTOSHARE_CPU_FILTER		(2)
+
 // block data struct
 
 typedef struct  
@@ -115,6 +126,10 @@ typedef struct
     uint8	merkleRootOriginal[32]; // used to identify work
     uint8	target[32];
     uint8	targetShare[32];
+    uint32	epoch; // workEpoch the block was built from
+    uint32	poolEpoch; // poolSwitchEpoch the block was built from, selects the pool its shares go to
+    uint64	workTime; // getTimeHighRes() when the work arrived
+    sha256_ctx	headerMidstate; // first 64 header bytes hashed, set by protoshares_calculateMidHash()
 }minerProtosharesBlock_t;
 
 typedef struct  
@@ -168,18 +183,45 @@ typedef struct
     uint8	targetShare[32];
 }minerMetiscoinBlock_t; // identical to scryptBlock
 
+// pool given on the command line
+typedef struct
+{
+    char* host;
+    sint32 port;
+} poolTarget_t;
+
 typedef struct  
 {
     char* workername;
     char* workerpass;
     char* host;
     sint32 port;
+    std::vector<poolTarget_t> pools; // every -o option in priority order, the first one is preferred
+    uint32 failback_seconds; // how long a failed preferred pool has to stay up before mining switches back
     sint32 numThreads;
     uint32 ptsMemoryMode;
     // GPU / OpenCL options
     uint32 deviceNum;
     bool listDevices;
     std::vector<int> deviceList;
+    uint32 opencl_pipeline; // overlap consecutive tables, see ProtoshareOpenCL
+    std::string cl_cache_dir; // compiled OpenCL programs, empty = always compile
+    uint32 affinity; // pin miner and worker threads, see affinity.h
+
+    // engine used for the momentum search
+    uint32 engine;
+    uint32 cpu_strategy;
+    uint32 partition_bits;
+    uint32 entry_size;      // bytes per hash table entry, ENTRY_SIZE_FULL or ENTRY_SIZE_COMPACT (CPU only)
+
+    // number of tables to run offline, 0 = mine normally
+    uint32 benchmark_tables;
+
+    // per-device timings on the status line, 0 = off, 1 = main phases, 2 = all phases and every table
+    uint32 verbosity;
+
+    // localhost port of the stats listener, 0 = disabled
+    uint32 stats_port;
 
     // mode option
     uint32 mode;
@@ -206,6 +248,10 @@ void xptMiner_submitShare(minerScryptBlock_t* block);
 void xptMiner_submitShare(minerPrimecoinBlock_t* block);
 void xptMiner_submitShare(minerMetiscoinBlock_t* block);
 
+// Connections of all configured pools, the list doesn't change after startup
+uint32 xptMiner_getPoolCount();
+xptClient_t* xptMiner_getPoolClient(uint32 index);
+
 // stats
 extern volatile uint32 totalCollisionCount;
 extern volatile uint32 totalTableCount;
@@ -213,6 +259,7 @@ extern volatile uint32 totalShareCount;
 extern volatile uint32 curShareCount;
 extern volatile uint32 invalidShareCount;
 extern volatile uint32 monitorCurrentBlockHeight;
+extern volatile uint32 workEpoch; // incremented whenever work for a new block is installed
 
 extern std::vector<payout_t> payout_list;
 
@@ -0,0 +1,122 @@
+#include "global.h"
+#include "hugePages.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#endif
+
+#define HUGE_PAGE_2MB   ( (size_t)2 << 20 )
+#define HUGE_PAGE_1GB   ( (size_t)1 << 30 )
+
+static bool huge_pages_enabled = true;
+
+
+void hugePages_disable()
+{
+    huge_pages_enabled = false;
+}
+
+
+#ifdef _WIN32
+
+void* hugePages_alloc(size_t size, const char** page_size)
+{
+    // Needs the "Lock pages in memory" privilege, without it VirtualAlloc just fails
+    size_t large_page = GetLargePageMinimum();
+
+    if (huge_pages_enabled && large_page > 0) {
+        size_t rounded = (size + large_page - 1) & ~(large_page - 1);
+        void* ptr = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+
+        if (ptr != NULL) {
+            *page_size = (large_page >= HUGE_PAGE_1GB ? "1g" : "2m");
+            return ptr;
+        }
+    }
+
+    *page_size = "4k";
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+#else
+
+static void* map_huge(size_t size, size_t page, int page_shift)
+{
+#ifdef MAP_HUGETLB
+    size_t rounded = (size + page - 1) & ~(page - 1);
+    void* ptr = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT), -1, 0);
+
+    if (ptr != MAP_FAILED) {
+        return ptr;
+    }
+#endif
+
+    return NULL;
+}
+
+
+// True unless transparent huge pages are switched off ("[never]")
+static bool transparent_huge_pages_available()
+{
+    FILE* file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (file == NULL) { return false; }
+
+    char line[128] = {0};
+    bool available = (fgets(line, sizeof(line), file) != NULL && strstr(line, "[never]") == NULL);
+    fclose(file);
+
+    return available;
+}
+
+
+void* hugePages_alloc(size_t size, const char** page_size)
+{
+    void* ptr = NULL;
+
+    if (huge_pages_enabled) {
+        // Explicit pages come from the pool reserved in /proc/sys/vm/nr_hugepages (or the 1 GB equivalent)
+        if (size >= HUGE_PAGE_1GB && (ptr = map_huge(size, HUGE_PAGE_1GB, 30)) != NULL) {
+            *page_size = "1g";
+            return ptr;
+        }
+
+        if ((ptr = map_huge(size, HUGE_PAGE_2MB, 21)) != NULL) {
+            *page_size = "2m";
+            return ptr;
+        }
+    }
+
+    // Over-allocate by one huge page so the table can start on a 2 MB boundary, THP only backs aligned ranges
+    size = (size + 4095) & ~(size_t)4095;
+    size_t mapped = size + HUGE_PAGE_2MB;
+    uint8* base = (uint8*)mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base == (uint8*)MAP_FAILED) {
+        return NULL;
+    }
+
+    uint8* aligned = (uint8*)(((size_t)base + HUGE_PAGE_2MB - 1) & ~(HUGE_PAGE_2MB - 1));
+    size_t head = aligned - base;
+    size_t tail = mapped - head - size;
+    if (head > 0) { munmap(base, head); }
+    if (tail > 0) { munmap(aligned + size, tail); }
+
+    *page_size = "4k";
+
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+    if (!huge_pages_enabled) {
+        // Keeps "always" mode from backing it anyway, so -hugepages off is a fair comparison
+        madvise(aligned, size, MADV_NOHUGEPAGE);
+    } else if (transparent_huge_pages_available() && madvise(aligned, size, MADV_HUGEPAGE) == 0) {
+        *page_size = "thp";
+    }
+#endif
+
+    return aligned;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef __HUGE_PAGES_H__
+#define __HUGE_PAGES_H__
+#include "global.h"
+
+// Allocator for the large, randomly accessed tables of the CPU engines. With 4 KB pages nearly every
+// access of a table of several hundred MB misses the TLB, huge pages cover it with a few entries.
+// Tries in order: 1 GB pages (only for allocations of at least 1 GB), 2 MB pages, transparent huge pages,
+// normal pages. The memory is zeroed and lives as long as the engine, so there is no matching free.
+// page_size receives the kind that was used ("1g", "2m", "thp" or "4k"), returns NULL if nothing worked.
+void* hugePages_alloc(size_t size, const char** page_size);
+
+// Disables huge pages for all following allocations (-hugepages off)
+void hugePages_disable();
+
+#endif
@@ -2,6 +2,9 @@
 #include "ticker.h"
 #include "OpenCLObjects.h"
 #include "protoshareMiner.h"
+#include "statsServer.h"
+#include "affinity.h"
+#include "hugePages.h"
 #include <csignal>
 #include <cstdio>
 #include <cstring>
@@ -18,19 +21,54 @@ volatile uint32 totalShareCount;
 volatile uint32 curShareCount;
 volatile uint32 invalidShareCount;
 volatile uint32 monitorCurrentBlockHeight;
+volatile uint32 workEpoch;
+volatile uint32 lastWorkUpdateTime; // getTimeMilliseconds() of the last work update, 0 = none yet
 
 minerSettings_t minerSettings = {0};
 
-xptClient_t* xptClient = NULL;
+xptClient_t* xptClient = NULL; // connection of the active pool, or of the last active one while no pool is up
 CRITICAL_SECTION cs_xptClient;
 
-struct {
-    CRITICAL_SECTION cs_work;
+// Each pool has its own connection. The active pool supplies the work, the next reachable pool is kept
+// logged in as hot standby so a failing pool is replaced at once instead of after a reconnect.
+#define POOL_RETRY_DELAY_MIN    ( 1000 )    // milliseconds, doubled after every failed attempt
+#define POOL_RETRY_DELAY_MAX    ( 15000 )
+#define POOL_LOGIN_TIMEOUT      ( 120000 )  // connected but still no login response
+
+typedef struct {
+    char* host;
+    generalRequestTarget_t requestTarget;
+    xptClient_t* client;    // created once and reused for every connection
+    uint32 retryTime;       // getTimeMilliseconds() of the next connection attempt
+    uint32 retryDelay;
+    bool loggedIn;
+    uint32 loginTime;       // getTimeMilliseconds() of the login
+    bool failed;            // lost while logged in, mining only switches back after failback_seconds
+} xptPool_t;
+
+std::vector<xptPool_t> pools; // in priority order
+volatile sint32 activePool = -1; // index into pools, -1 = no pool is up
+volatile uint32 poolFailoverCount = 0;
+bool poolOutage = true; // no pool was up, the mining statistics restart with the next one
+
+// Shares of work from before the last pool switch still go to the previous pool. The switch doesn't
+// touch workEpoch, tables of the same block keep running and their shares are routed by poolEpoch.
+xptClient_t* volatile previousPoolClient = NULL;
+volatile uint32 poolSwitchEpoch = 0; // incremented on every pool switch
+
+// Immutable snapshot of the work received from the pool. The connection thread builds a new one for
+// every work update and publishes it by swapping currentWork, the miner threads hold a reference to
+// the snapshot they are mining on. Nothing on the per-table path takes a lock.
+typedef struct _workSnapshot_t {
+    volatile LONG refCount;
 
     uint32  algorithm;
     // block data
     uint32  version;
     uint32  height;
+    uint32  epoch; // workEpoch at the time of publication
+    uint32  poolEpoch; // poolSwitchEpoch at the time of publication
+    uint64  receivedTime; // getTimeHighRes() when the work arrived, used to trace stale shares
     uint32  nBits;
     uint32  timeBias;
     uint8   merkleRootOriginal[32]; // used to identify work
@@ -42,12 +80,17 @@ struct {
     uint8   coinBase2[1024];
     uint16  coinBase1Size;
     uint16  coinBase2Size;
-    // transaction hashes
-    uint8   txHash[32 * MAX_TRANSACTIONS];
-    uint32  txHashCount;
-} workDataSource;
+    sha256_ctx coinBaseMidstate; // coinBase1 already hashed, only the extra nonce and coinBase2 are left
+    // merkle branch of the coinbase, the root of each extra nonce only costs branch length hashes
+    uint8   merkleBranch[32 * MERKLE_BRANCH_MAX_LENGTH];
+    uint32  merkleBranchLength;
+} workSnapshot_t;
 
-uint32 uniqueMerkleSeedGenerator = 0;
+workSnapshot_t* volatile currentWork = NULL; // NULL = no valid work
+volatile LONG workAcquiresInProgress = 0; // miner threads between loading currentWork and taking their reference
+std::vector<workSnapshot_t*> retiredWork; // replaced snapshots, their published reference is dropped once no acquire is in progress
+
+volatile uint32 uniqueMerkleSeedGenerator = 0;
 uint32 miningStartTime = 0;
 
 // GPU watchdog to detect Windows TDR or hangs.
@@ -55,11 +98,61 @@ uint32 miningStartTime = 0;
 uint32 gpu_watchdog_max_wait = 10;
 uint32 gpu_watchdog_timer = 0;
 
-std::vector<ProtoshareOpenCL *> gpu_processors;
+std::vector<ProtoshareProcessor *> processors;
 std::vector<payout_t> payout_list;
 
 commandlineInput_t commandlineInput;
 
+uint32 xptMiner_getPoolCount()
+{
+    return (uint32)pools.size();
+}
+
+xptClient_t* xptMiner_getPoolClient(uint32 index)
+{
+    return pools[index].client;
+}
+
+void workSnapshot_release(workSnapshot_t* work)
+{
+    if ( work != NULL && InterlockedDecrement(&work->refCount) == 0 ) {
+        free(work);
+    }
+}
+
+/*
+* Returns a reference to the current work snapshot (or NULL if there is none) without blocking
+* A snapshot replaced between the load and the increment stays alive until no acquire is in progress
+*/
+workSnapshot_t* workSnapshot_acquire()
+{
+    InterlockedIncrement(&workAcquiresInProgress);
+    workSnapshot_t* work = currentWork;
+    if ( work != NULL ) {
+        InterlockedIncrement(&work->refCount);
+    }
+    InterlockedDecrement(&workAcquiresInProgress);
+    return work;
+}
+
+/*
+* Publishes a new snapshot (or NULL to invalidate the work), only called by the connection thread
+*/
+void workSnapshot_publish(workSnapshot_t* work)
+{
+    workSnapshot_t* previous = (workSnapshot_t*)InterlockedExchangePointer((void* volatile*)&currentWork, work);
+    if ( previous != NULL ) {
+        retiredWork.push_back(previous);
+    }
+
+    // Acquires that started after the swap can't see the retired snapshots, once none is in progress
+    // every miner still on them holds its own reference. Otherwise they wait for the next update.
+    if ( workAcquiresInProgress == 0 ) {
+        for (uint32 i = 0; i < retiredWork.size(); i++) { workSnapshot_release(retiredWork[i]); }
+        retiredWork.clear();
+    }
+}
+
 uint32 nearest_pow2(uint32 n)
 {
     uint32 temp = 1;
@@ -76,16 +169,36 @@ uint32 nearest_pow2(uint32 n)
 void xptMiner_submitShare(minerProtosharesBlock_t* block)
 {
     printf("Share found! (NonceA: %#010x, NonceB: %#010x, Blockheight: %d)\n", block->birthdayA, block->birthdayB, block->height);
-    EnterCriticalSection(&cs_xptClient);
 
-    if ( xptClient == NULL || xptClient_isDisconnected(xptClient, NULL) == true ) {
+    // The client objects are created once per pool and never freed. Queueing only takes the short queue lock,
+    // cs_xptClient is held by the connection loop during network calls and must not stall the miner threads.
+    // The active client is read before the epoch, activatePool() bumps the epoch before replacing it
+    xptClient_t* xptClient = ::xptClient;
+    MemoryBarrier();
+    uint32 currentPoolEpoch = poolSwitchEpoch;
+
+    // Work from before the last pool switch is only valid on the previous pool
+    if ( block->poolEpoch != currentPoolEpoch ) {
+        xptClient = (block->poolEpoch + 1 == currentPoolEpoch ? previousPoolClient : NULL);
+
+        if ( xptClient == NULL || xptClient_isDisconnected(xptClient, NULL) == true ) {
+            printf("Share dropped - It was found on work of a pool that is no longer used\n");
+            return;
+        }
+    }
+
+    if ( xptClient == NULL ) {
         printf("Share submission failed - No connection to server\n");
-        LeaveCriticalSection(&cs_xptClient);
         return;
     }
 
+    if ( xptClient_isDisconnected(xptClient, NULL) == true ) {
+        printf("No connection to server - Share is sent after reconnecting\n");
+    }
+
     // submit block
-    xptShareToSubmit_t* xptShare = (xptShareToSubmit_t*)malloc(sizeof(xptShareToSubmit_t));
+    xptShareToSubmit_t share;
+    xptShareToSubmit_t* xptShare = &share;
     memset(xptShare, 0x00, sizeof(xptShareToSubmit_t));
     xptShare->algorithm = ALGORITHM_PROTOSHARES;
     xptShare->version = block->version;
@@ -94,6 +207,8 @@ void xptMiner_submitShare(minerProtosharesBlock_t* block)
     xptShare->nBits = block->nBits;
     xptShare->nBirthdayA = block->birthdayA;
     xptShare->nBirthdayB = block->birthdayB;
+    xptShare->blockHeight = block->height;
+    xptShare->workTime = block->workTime;
     memcpy(xptShare->prevBlockHash, block->prevBlockHash, 32);
     memcpy(xptShare->merkleRoot, block->merkleRoot, 32);
     memcpy(xptShare->merkleRootOriginal, block->merkleRootOriginal, 32);
@@ -103,12 +218,11 @@ void xptMiner_submitShare(minerProtosharesBlock_t* block)
     xptShare->userExtraNonceLength = userExtraNonceLength;
     memcpy(xptShare->userExtraNonceData, userExtraNonceData, userExtraNonceLength);
     xptClient_foundShare(xptClient, xptShare);
-    LeaveCriticalSection(&cs_xptClient);
 }
 
 
 #ifdef _WIN32
-int xptMiner_minerThread(int threadIndex)
+int xptMiner_minerThread(LPVOID arg)
 #else
 void *xptMiner_minerThread(void *arg)
 #endif
@@ -118,95 +232,144 @@ void *xptMiner_minerThread(void *arg)
     minerScryptBlock_t minerScryptBlock = {0};
     minerMetiscoinBlock_t minerMetiscoinBlock = {0};
     minerPrimecoinBlock_t minerPrimecoinBlock = {0};
-    ProtoshareOpenCL *processor = gpu_processors.back();
-    gpu_processors.pop_back();
+    // Each thread drives the processor it was started for
+    ProtoshareProcessor *processor = (ProtoshareProcessor *)arg;
+
+    if ( commandlineInput.affinity && !processor->thread_cpus.empty() ) {
+        if ( affinity_pinCurrentThread(processor->thread_cpus) ) {
+            printf("%s: miner thread pinned to CPU %s\n", processor->metrics->name, affinity_formatCpuList(processor->thread_cpus).c_str());
+        } else {
+            printf("%s: cannot pin miner thread to CPU %s\n", processor->metrics->name, affinity_formatCpuList(processor->thread_cpus).c_str());
+        }
+    }
+
+    // Snapshot being mined on
+    workSnapshot_t* work = NULL;
+
+    // Time spent outside of protoshare_process(), waiting for and preparing work
+    uint64 queue_start = getTimeHighRes();
 
     // todo: Eventually move all block structures into a union to save stack size
     while ( true ) {
         // has work?
         bool hasValidWork = false;
-        EnterCriticalSection(&workDataSource.cs_work);
 
-        if ( workDataSource.height > 0 ) {
-            if ( workDataSource.algorithm == ALGORITHM_PROTOSHARES ) {
+        if ( work != currentWork ) {
+            workSnapshot_release(work);
+            work = workSnapshot_acquire();
+        }
+
+        if ( work != NULL && work->height > 0 ) {
+            if ( work->algorithm == ALGORITHM_PROTOSHARES ) {
                 // get protoshares work data
-                minerProtosharesBlock.version = workDataSource.version;
-                minerProtosharesBlock.nTime = (uint32)time(NULL) + workDataSource.timeBias;
-                minerProtosharesBlock.nBits = workDataSource.nBits;
+                minerProtosharesBlock.version = work->version;
+                minerProtosharesBlock.nTime = (uint32)time(NULL) + work->timeBias;
+                minerProtosharesBlock.nBits = work->nBits;
                 minerProtosharesBlock.nonce = 0;
-                minerProtosharesBlock.height = workDataSource.height;
-                memcpy(minerProtosharesBlock.merkleRootOriginal, workDataSource.merkleRootOriginal, 32);
-                memcpy(minerProtosharesBlock.prevBlockHash, workDataSource.prevBlockHash, 32);
-                memcpy(minerProtosharesBlock.targetShare, workDataSource.targetShare, 32);
-                minerProtosharesBlock.uniqueMerkleSeed = uniqueMerkleSeedGenerator;
-                uniqueMerkleSeedGenerator++;
+                minerProtosharesBlock.height = work->height;
+                minerProtosharesBlock.epoch = work->epoch;
+                minerProtosharesBlock.poolEpoch = work->poolEpoch;
+                minerProtosharesBlock.workTime = work->receivedTime;
+                memcpy(minerProtosharesBlock.merkleRootOriginal, work->merkleRootOriginal, 32);
+                memcpy(minerProtosharesBlock.prevBlockHash, work->prevBlockHash, 32);
+                memcpy(minerProtosharesBlock.targetShare, work->targetShare, 32);
+                minerProtosharesBlock.uniqueMerkleSeed = InterlockedIncrement(&uniqueMerkleSeedGenerator);
                 // generate merkle root transaction
-                bitclient_generateTxHash(sizeof(uint32), (uint8*)&minerProtosharesBlock.uniqueMerkleSeed, workDataSource.coinBase1Size, workDataSource.coinBase1, workDataSource.coinBase2Size, workDataSource.coinBase2, workDataSource.txHash);
-                bitclient_calculateMerkleRoot(workDataSource.txHash, workDataSource.txHashCount + 1, minerProtosharesBlock.merkleRoot);
+                uint8 coinbaseTxHash[32];
+                bitclient_generateTxHashFromMidstate(&work->coinBaseMidstate, sizeof(uint32), (uint8*)&minerProtosharesBlock.uniqueMerkleSeed, work->coinBase2Size, work->coinBase2, coinbaseTxHash);
+                bitclient_calculateMerkleRootFromBranch(coinbaseTxHash, work->merkleBranch, work->merkleBranchLength, minerProtosharesBlock.merkleRoot);
                 hasValidWork = true;
             }
         }
 
-        LeaveCriticalSection(&workDataSource.cs_work);
-
         if ( hasValidWork == false ) {
             Sleep(1);
             continue;
         }
 
         // valid work data present, start processing workload
-        if ( workDataSource.algorithm == ALGORITHM_PROTOSHARES ) {
+        if ( work->algorithm == ALGORITHM_PROTOSHARES ) {
+            metrics_record(&processor->metrics->phase[METRICS_PHASE_QUEUE_WAIT], metrics_elapsedMicroseconds(queue_start));
+
             gpu_watchdog_timer = getTimeMilliseconds();
+            uint64 table_start = getTimeHighRes();
             processor->protoshare_process(&minerProtosharesBlock);
+            uint32 table_us = metrics_elapsedMicroseconds(table_start);
             gpu_watchdog_timer = 0;
+
+            protoshares_recordTableMetrics(processor, table_us);
+            queue_start = getTimeHighRes();
+
+            if ( commandlineInput.verbosity >= 2 ) {
+                protoshareTableStats_t* stats = &processor->stats;
+                printf("%s: table %.1f ms (hash %.1f, seek %.1f, revalidate %.2f, overhead %.2f), %d collisions%s\n",
+                       processor->metrics->name, table_us / 1000.0, stats->hash_us / 1000.0, stats->seek_us / 1000.0,
+                       stats->revalidate_us / 1000.0, stats->overhead_us / 1000.0, stats->collisions,
+                       (stats->aborted ? ", abandoned (stale work)" : ""));
+            }
         } else {
             printf("xptMiner_minerThread(): Unknown algorithm\n");
             Sleep(5000); // dont spam the console
         }
     }
 
+    workSnapshot_release(work);
     delete processor;
     return 0;
 }
 
 
 /*
-* Reads data from the xpt connection state and writes it to the universal workDataSource struct
+* Reads data from the xpt connection state and publishes it as a new work snapshot
 */
 void xptMiner_getWorkFromXPTConnection(xptClient_t* xptClient)
 {
-    EnterCriticalSection(&workDataSource.cs_work);
-    workDataSource.algorithm = xptClient->algorithm;
-    workDataSource.version = xptClient->blockWorkInfo.version;
-    workDataSource.timeBias = xptClient->blockWorkInfo.timeBias;
-    workDataSource.nBits = xptClient->blockWorkInfo.nBits;
-    memcpy(workDataSource.merkleRootOriginal, xptClient->blockWorkInfo.merkleRoot, 32);
-    memcpy(workDataSource.prevBlockHash, xptClient->blockWorkInfo.prevBlockHash, 32);
-    memcpy(workDataSource.target, xptClient->blockWorkInfo.target, 32);
-    memcpy(workDataSource.targetShare, xptClient->blockWorkInfo.targetShare, 32);
-
-    workDataSource.coinBase1Size = xptClient->blockWorkInfo.coinBase1Size;
-    workDataSource.coinBase2Size = xptClient->blockWorkInfo.coinBase2Size;
-    memcpy(workDataSource.coinBase1, xptClient->blockWorkInfo.coinBase1, xptClient->blockWorkInfo.coinBase1Size);
-    memcpy(workDataSource.coinBase2, xptClient->blockWorkInfo.coinBase2, xptClient->blockWorkInfo.coinBase2Size);
-
-    // get hashes
-    if ( xptClient->blockWorkInfo.txHashCount > MAX_TRANSACTIONS ) {
-        printf("Too many transaction hashes\n");
-        workDataSource.txHashCount = 0;
-    } else {
-        workDataSource.txHashCount = xptClient->blockWorkInfo.txHashCount;
+    workSnapshot_t* work = (workSnapshot_t*)malloc(sizeof(workSnapshot_t));
+    memset(work, 0x00, sizeof(workSnapshot_t));
+    work->refCount = 1; // the published reference
+
+    // Tables of the previous block are worthless now, the engines abandon them. Work of another pool
+    // for the same block is not, shares of those tables still go to that pool.
+    if ( currentWork == NULL || xptClient->blockWorkInfo.height != currentWork->height || memcmp(xptClient->blockWorkInfo.prevBlockHash, currentWork->prevBlockHash, 32) != 0 ) {
+        workEpoch++;
     }
 
-    for (uint32 i = 0; i < xptClient->blockWorkInfo.txHashCount; i++) {
-        memcpy(workDataSource.txHash + 32 * (i + 1), xptClient->blockWorkInfo.txHashes + 32 * i, 32);
+    work->epoch = workEpoch;
+    work->poolEpoch = poolSwitchEpoch;
+    work->receivedTime = getTimeHighRes();
+    work->algorithm = xptClient->algorithm;
+    work->version = xptClient->blockWorkInfo.version;
+    work->height = xptClient->blockWorkInfo.height;
+    work->timeBias = xptClient->blockWorkInfo.timeBias;
+    work->nBits = xptClient->blockWorkInfo.nBits;
+    memcpy(work->merkleRootOriginal, xptClient->blockWorkInfo.merkleRoot, 32);
+    memcpy(work->prevBlockHash, xptClient->blockWorkInfo.prevBlockHash, 32);
+    memcpy(work->target, xptClient->blockWorkInfo.target, 32);
+    memcpy(work->targetShare, xptClient->blockWorkInfo.targetShare, 32);
+
+    work->coinBase1Size = xptClient->blockWorkInfo.coinBase1Size;
+    work->coinBase2Size = xptClient->blockWorkInfo.coinBase2Size;
+    memcpy(work->coinBase1, xptClient->blockWorkInfo.coinBase1, xptClient->blockWorkInfo.coinBase1Size);
+    memcpy(work->coinBase2, xptClient->blockWorkInfo.coinBase2, xptClient->blockWorkInfo.coinBase2Size);
+    bitclient_generateCoinbaseMidstate(work->coinBase1Size, work->coinBase1, &work->coinBaseMidstate);
+
+    // get hashes, slot 0 is the coinbase which doesn't affect its own branch
+    uint32 txHashCount = xptClient->blockWorkInfo.txHashCount;
+
+    if ( txHashCount > MAX_TRANSACTIONS ) {
+        printf("Too many transaction hashes\n");
+        txHashCount = 0;
     }
 
-    // set blockheight last since it triggers reload of work
-    workDataSource.height = xptClient->blockWorkInfo.height;
+    uint8* txHash = (uint8*)malloc(32 * (txHashCount + 1));
+    memset(txHash, 0x00, 32);
+    memcpy(txHash + 32, xptClient->blockWorkInfo.txHashes, 32 * txHashCount);
+    work->merkleBranchLength = bitclient_calculateMerkleBranch(txHash, txHashCount + 1, work->merkleBranch);
+    free(txHash);
 
-    LeaveCriticalSection(&workDataSource.cs_work);
-    monitorCurrentBlockHeight = workDataSource.height;
+    workSnapshot_publish(work);
+    monitorCurrentBlockHeight = work->height;
+    lastWorkUpdateTime = (uint32)getTimeMilliseconds();
 }
 
 #define getFeeFromDouble(_x) ((uint16)((double)(_x)/0.002f)) // integer 1 = 0.002%
@@ -226,10 +389,150 @@ xptClient_t* xptMiner_initateNewXptConnectionObject()
     return xptClient;
 }
 
+/*
+* Schedules the next connection attempt of a pool, the delay doubles with every failure
+*/
+void xptMiner_retryPoolLater(xptPool_t* pool, uint32 currentTick)
+{
+    xptClient_forceDisconnect(pool->client);
+    pool->loggedIn = false;
+    pool->retryTime = currentTick + pool->retryDelay;
+    pool->retryDelay = std::min<uint32>(pool->retryDelay * 2, POOL_RETRY_DELAY_MAX);
+}
+
+/*
+* Returns true if the pool is logged in and has work to mine on
+*/
+bool xptMiner_isPoolUsable(xptPool_t* pool)
+{
+    xptClient_t* client = pool->client;
+    return client->disconnected == false && pool->loggedIn && client->hasWorkData && client->algorithm == ALGORITHM_PROTOSHARES;
+}
+
+/*
+* Makes the given pool the source of work, tables of the previous pool only keep running if it's the same block
+*/
+void xptMiner_activatePool(sint32 index)
+{
+    xptPool_t* pool = &pools[index];
+
+    if ( poolOutage ) {
+        // Mining starts (again) after no pool was up
+        poolOutage = false;
+        miningStartTime = (uint32)time(NULL);
+        totalCollisionCount = 0;
+        totalTableCount = 0;
+        curShareCount = 0;
+    }
+
+    printf("Mining on %s:%d%s\n", pool->host, pool->requestTarget.port, (index > 0 ? " (failover pool)" : ""));
+
+    previousPoolClient = xptClient;
+    activePool = index;
+    MemoryBarrier();
+    poolSwitchEpoch++;
+    MemoryBarrier();
+    xptClient = pool->client;
+    xptMiner_getWorkFromXPTConnection(pool->client);
+}
+
+/*
+* Fails over to the best usable pool at once. A pool preferred over the active one takes over
+* as soon as it's usable, unless it failed before. Then it has to stay up for failback_seconds first.
+*/
+void xptMiner_selectPool()
+{
+    uint32 currentTick = getTimeMilliseconds();
+
+    for (sint32 i = 0; i < (sint32)pools.size() && i != activePool; i++) {
+        xptPool_t* pool = &pools[i];
+
+        if ( xptMiner_isPoolUsable(pool) == false ) {
+            continue;
+        }
+
+        if ( activePool >= 0 && pool->failed && currentTick - pool->loginTime < commandlineInput.failback_seconds * 1000 ) {
+            continue;
+        }
+
+        if ( activePool >= 0 ) {
+            printf("%s:%d is up again, switching back\n", pool->host, pool->requestTarget.port);
+        }
+
+        pool->failed = false;
+        xptMiner_activatePool(i);
+        return;
+    }
+}
+
+/*
+* Keeps the connections to the active pool, to every pool preferred over it and to the best
+* reachable pool behind it as hot standby. Further pools are only connected until a standby is logged in.
+*/
+void xptMiner_connectPools(uint32 currentTick)
+{
+    uint32 standbyNeeded = (activePool >= 0 ? 1 : 2);
+
+    for (sint32 i = 0; i < (sint32)pools.size(); i++) {
+        xptPool_t* pool = &pools[i];
+        bool connected = (pool->client->disconnected == false);
+        bool wanted = (i <= activePool);
+
+        if ( wanted == false && standbyNeeded > 0 && (connected || currentTick >= pool->retryTime) ) {
+            wanted = true;
+
+            if ( xptMiner_isPoolUsable(pool) ) {
+                standbyNeeded--;
+            }
+        }
+
+        if ( connected && wanted == false ) {
+            // a better standby is logged in
+            xptClient_forceDisconnect(pool->client);
+            pool->loggedIn = false;
+        }
+
+        if ( connected || wanted == false || currentTick < pool->retryTime ) {
+            continue;
+        }
+
+        pool->requestTarget.authUser = minerSettings.requestTarget.authUser;
+        pool->requestTarget.authPass = minerSettings.requestTarget.authPass;
+
+        if ( xptClient_connect(pool->client, &pool->requestTarget) == false ) {
+            printf("Connection attempt to %s:%d failed, retry in %d seconds\n", pool->host, pool->requestTarget.port, (pool->retryDelay + 999) / 1000);
+            xptMiner_retryPoolLater(pool, currentTick);
+        }
+    }
+}
+
+/*
+* Prints what the developers need to know when one of their payout logins doesn't work
+*/
+void xptMiner_printDeveloperError(payout_t* payout_info, xptPool_t* pool, const char* error)
+{
+    Sleep(1000); // Allow server time to print messages
+    printf("\n\n");
+    printf("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
+    printf("Whoa nelly!  Contact the developers and let them know they screwed up.\n");
+    printf("Send them this info:\n");
+    printf("    V - %s\n", minerVersionString);
+    printf("    L - %s:%s + %f\n", payout_info->workername, payout_info->workerpass, payout_info->payout_pct);
+    printf("    U - %s:%d\n", pool->host, pool->requestTarget.port);
+    printf("    P - %d,%d,%d,%d\n", commandlineInput.buckets_log2, commandlineInput.bucket_size, commandlineInput.target_mem, commandlineInput.wgs);
+    printf("    E - %s\n", error);
+    printf("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
+    printf("\n\n");
+}
+
 void xptMiner_xptQueryWorkLoop()
 {
-    // init xpt connection object once
-    xptClient = xptMiner_initateNewXptConnectionObject();
+    // init one xpt connection object per pool, they are reused for every reconnect
+    for (uint32 i = 0; i < pools.size(); i++) {
+        pools[i].client = xptMiner_initateNewXptConnectionObject();
+    }
+
+    xptClient = pools[0].client;
 
     uint32 timerPrintDetails = getTimeMilliseconds() + 8000;
 
@@ -238,6 +541,7 @@ void xptMiner_xptQueryWorkLoop()
 
     payout_t cur_payout_info = payout_list.back();
     bool load_next_user = true;
+    bool cur_user_removed = false;
     uint32 cur_payout_round_length = 0;
 
     while ( true ) {
@@ -252,13 +556,13 @@ void xptMiner_xptQueryWorkLoop()
 
         if ( currentTick >= timerPrintDetails ) {
             // print details only when connected
-            if ( xptClient_isDisconnected(xptClient, NULL) == false ) {
+            if ( activePool >= 0 ) {
                 uint32 passedSeconds = (uint32)time(NULL) - miningStartTime;
                 double speedRate = 0.0;
                 double tableRate = 0.0;
                 double sharesPerHour = 0.0;
 
-                if ( workDataSource.algorithm == ALGORITHM_PROTOSHARES ) {
+                if ( currentWork != NULL && currentWork->algorithm == ALGORITHM_PROTOSHARES ) {
                     // speed is represented as khash/s (in steps of 0x8000)
                     if ( passedSeconds > 5 ) {
                         speedRate = (double)totalCollisionCount / (double)passedSeconds * 60.0;
@@ -272,6 +576,37 @@ void xptMiner_xptQueryWorkLoop()
                         }
 
                         printf(")\n");
+                        metrics_printStatus(commandlineInput.verbosity);
+
+                        if ( commandlineInput.verbosity > 0 && metrics_getCount(&xptClient->shareSendLatency) > 0 ) {
+                            printf("    shares: send p50/p99 %.2f/%.2f ms, queued %d (max %d)",
+                                   metrics_getPercentile(&xptClient->shareSendLatency, 50) / 1000.0, metrics_getPercentile(&xptClient->shareSendLatency, 99) / 1000.0,
+                                   xptClient_getSendQueueDepth(xptClient), xptClient->sendQueueDepthMax);
+                            if ( xptClient->sendOverflowCount > 0 ) { printf(", %d overflowed", xptClient->sendOverflowCount); }
+                            printf("\n");
+                        }
+
+                        if ( commandlineInput.verbosity > 0 && metrics_getCount(&xptClient->shareAckLatency) > 0 ) {
+                            printf("    acks: %d accepted, %d rejected, rtt p50/p99 %.2f/%.2f ms",
+                                   xptClient->sharesAccepted, xptClient->sharesRejected,
+                                   metrics_getPercentile(&xptClient->shareAckLatency, 50) / 1000.0, metrics_getPercentile(&xptClient->shareAckLatency, 99) / 1000.0);
+                            if ( xptClient->staleRejects > 0 ) {
+                                printf(", stale %d (work age p50 %.1f s", xptClient->staleRejects, metrics_getPercentile(&xptClient->staleWorkAge, 50) / 1000000.0);
+                                if ( xptClient->lateRejects > 0 ) {
+                                    printf(", %d after a block change, late by p50 %.0f ms", xptClient->lateRejects, metrics_getPercentile(&xptClient->staleLateBy, 50) / 1000.0);
+                                }
+                                printf(")");
+                            }
+                            if ( xptClient->sharesUnacknowledged > 0 ) { printf(", %d unacknowledged", xptClient->sharesUnacknowledged); }
+                            printf("\n");
+
+                            if ( commandlineInput.verbosity > 1 ) {
+                                for ( uint32 i = 0; i < xptClient->rejectReasonCount; i++ ) {
+                                    printf("        rejected %d x \"%s\"\n", xptClient->rejectReasons[i].count, xptClient->rejectReasons[i].reason);
+                                }
+                                if ( xptClient->rejectOtherCount > 0 ) { printf("        rejected %d x other reasons\n", xptClient->rejectOtherCount); }
+                            }
+                        }
                     }
 
 
@@ -282,195 +617,233 @@ void xptMiner_xptQueryWorkLoop()
             timerPrintDetails = currentTick + 8000;
         }
 
-        // check stats
-        if ( xptClient_isDisconnected(xptClient, NULL) == false ) {
-            EnterCriticalSection(&cs_xptClient);
+        EnterCriticalSection(&cs_xptClient);
+
+        // We've reached the time limit for the current user, switch to the next one
+        if (cur_payout_round_length > payout_len * cur_payout_info.payout_pct) { load_next_user = true; }
 
-            // We've reached the time limit for the current user, switch to the next one
-            if (cur_payout_round_length > payout_len * cur_payout_info.payout_pct) { load_next_user = true; }
+        // Do we need to load the next user?
+        if (load_next_user == true) {
+            load_next_user = false;
+
+            // This should never happen, but just in case...
+            if (payout_list.size() == 0) {
+                printf("No valid user accounts to login with!\n");
+                printf("Please check your run log for more details.\n");
+                exit(-1);
+            }
 
-            // Do we need to load the next user?
-            if (load_next_user == true) {
-                load_next_user = false;
+            bool prev_user_was_dev = cur_payout_info.is_developer;
+            payout_pos = (payout_pos + 1) % payout_list.size();
+            cur_payout_info = payout_list[payout_pos];
+            cur_user_removed = false;
 
-                // This should never happen, but just in case...
-                if (payout_list.size() == 0) {
-                    printf("No valid user accounts to login with!\n");
-                    printf("Please check your run log for more details.\n");
-                    exit(-1);
+            minerSettings.requestTarget.authUser = cur_payout_info.workername;
+            minerSettings.requestTarget.authPass = cur_payout_info.workerpass;
+
+            // Log in again everywhere, pools waiting for a retry keep waiting
+            for (uint32 i = 0; i < pools.size(); i++) {
+                if ( pools[i].client->disconnected == false ) {
+                    xptClient_forceDisconnect(pools[i].client);
+                    pools[i].retryTime = currentTick;
                 }
 
-                bool prev_user_was_dev = cur_payout_info.is_developer;
-                payout_pos = (payout_pos + 1) % payout_list.size();
-                cur_payout_info = payout_list[payout_pos];
+                pools[i].loggedIn = false;
+                pools[i].failed = false;
+            }
 
-                xptClient_forceDisconnect(xptClient);
-                minerSettings.requestTarget.authUser = cur_payout_info.workername;
-                minerSettings.requestTarget.authPass = cur_payout_info.workerpass;
-                strncpy(xptClient->username, minerSettings.requestTarget.authUser, 127);
-                strncpy(xptClient->password, minerSettings.requestTarget.authPass, 127);
-                memset(&xptClient->blockWorkInfo, 0x00, sizeof(xptBlockWorkInfo_t));
-                xptClient_connect(xptClient, &minerSettings.requestTarget);
+            // Shares of the work of the previous login are dropped instead of being submitted for the next one
+            activePool = -1;
+            previousPoolClient = NULL;
+            poolSwitchEpoch++;
+            workSnapshot_publish(NULL);
+            xptMiner_connectPools(currentTick);
 
-                double mining_length = (cur_payout_info.payout_pct * (double)payout_len) / 1000.0;
+            double mining_length = (cur_payout_info.payout_pct * (double)payout_len) / 1000.0;
 
-                if (cur_payout_info.is_developer) {
-                    if (!prev_user_was_dev) {
-                        printf("\nMining for a few moments to support future development\n", mining_length);
-                    }
-                } else {
-                    printf("\nMining shiny coins for the user!\n");
+            if (cur_payout_info.is_developer) {
+                if (!prev_user_was_dev) {
+                    printf("\nMining for a few moments to support future development\n", mining_length);
                 }
-
-                cur_payout_round_length = 0;
+            } else {
+                printf("\nMining shiny coins for the user!\n");
             }
 
+            cur_payout_round_length = 0;
+        }
 
-            xptClient_process(xptClient);
+        for (sint32 i = 0; i < (sint32)pools.size(); i++) {
+            xptPool_t* pool = &pools[i];
+            xptClient_t* client = pool->client;
 
-            if ( xptClient->disconnected ) {
-                // mark work as invalid
-                EnterCriticalSection(&workDataSource.cs_work);
-                workDataSource.height = 0;
-                monitorCurrentBlockHeight = 0;
-                LeaveCriticalSection(&workDataSource.cs_work);
-                // we lost connection :(
-                printf("Connection to server lost - Reconnect in 15 seconds\n");
-                xptClient_forceDisconnect(xptClient);
-                LeaveCriticalSection(&cs_xptClient);
+            if ( client->disconnected ) {
+                continue;
+            }
 
-                // If we lost connection something login related
-                if ( xptClient->gotLoginResponse == false ) {
-                    // Load the next user, maybe this account is messed up?
-                    load_next_user = true;
+            xptClient_process(client);
 
-                } else {
-                    if ( xptClient->loginRejected ) {
-                        if (cur_payout_info.is_developer) {
-                            Sleep(1000); // Allow server time to print messages
-                            printf("\n\n");
-                            printf("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
-                            printf("Whoa nelly!  Contact the developers and let them know they screwed up.\n");
-                            printf("Send them this info:\n");
-                            printf("    V - %s\n", minerVersionString);
-                            printf("    L - %s:%s + %f\n", cur_payout_info.workername, cur_payout_info.workerpass, cur_payout_info.payout_pct);
-                            printf("    U - %s:%d\n", commandlineInput.host, commandlineInput.port);
-                            printf("    P - %d,%d,%d,%d\n", commandlineInput.buckets_log2, commandlineInput.bucket_size, commandlineInput.target_mem, commandlineInput.wgs);
-                            printf("    E - INVALIDUSER\n");
-                            printf("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
-                            printf("\n\n");
-                        }
+            if ( client->disconnected ) {
+                bool wasConnecting = client->connecting;
+                bool wasLoggedIn = pool->loggedIn;
+                xptMiner_retryPoolLater(pool, currentTick);
 
-                        // Delete the info from the list, it's invalid
-                        payout_list.erase(payout_list.begin() + payout_pos);
-                        payout_pos--;
-                        load_next_user = true;
+                if ( wasConnecting ) {
+                    printf("Connection attempt to %s:%d failed, retry in %d seconds\n", pool->host, pool->requestTarget.port, (pool->retryTime - currentTick + 999) / 1000);
+                    continue;
+                }
+
+                printf("Connection to %s:%d lost - Reconnect in %d seconds\n", pool->host, pool->requestTarget.port, (pool->retryTime - currentTick + 999) / 1000);
+                pool->failed = wasLoggedIn;
+
+                if ( i == activePool ) {
+                    // fail over right away, the work is only invalid if no other pool is up
+                    activePool = -1;
+                    poolFailoverCount++;
+                    xptMiner_selectPool();
 
-                    } else {
-                        // We had a correct login but still disconnected.
-                        // It probably means the mining pool is down or there are connection issues
-                        // Nothing we can do
+                    if ( activePool < 0 ) {
+                        printf("No pool is available\n");
+                        poolOutage = true;
+                        workSnapshot_publish(NULL);
+                        monitorCurrentBlockHeight = 0;
                     }
                 }
 
-                Sleep(15000);
-            } else {
-                // is known algorithm?
-                if ( xptClient->clientState == XPT_CLIENT_STATE_LOGGED_IN && (xptClient->algorithm != ALGORITHM_PROTOSHARES) ) {
-                    // force disconnect
-                    xptClient_forceDisconnect(xptClient);
-                    LeaveCriticalSection(&cs_xptClient);
+                // If we lost connection something login related
+                if ( client->gotLoginResponse == false ) {
+                    // Load the next user, maybe this account is messed up? Not while another pool accepts it.
+                    if ( activePool < 0 ) {
+                        load_next_user = true;
+                    }
 
+                } else if ( client->loginRejected ) {
                     if (cur_payout_info.is_developer) {
-                        Sleep(1000); // Allow server time to print messages
-                        printf("\n\n");
-                        printf("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
-                        printf("Whoa nelly!  Contact the developers and let them know they screwed up.\n");
-                        printf("Send them this info:\n");
-                        printf("    V - %s\n", minerVersionString);
-                        printf("    L - %s:%s + %f\n", cur_payout_info.workername, cur_payout_info.workerpass, cur_payout_info.payout_pct);
-                        printf("    U - %s:%d\n", commandlineInput.host, commandlineInput.port);
-                        printf("    P - %d,%d,%d,%d\n", commandlineInput.buckets_log2, commandlineInput.bucket_size, commandlineInput.target_mem, commandlineInput.wgs);
-                        printf("\tE - BADALGO\n");
-                        printf("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
-                        printf("\n\n");
-
-                    } else {
-                        printf("The login '%s' is configured for an unsupported algorithm.\n", xptClient->username);
-                        printf("Make sure you miner login details are correct\n");
+                        xptMiner_printDeveloperError(&cur_payout_info, pool, "INVALIDUSER");
                     }
 
                     // Delete the info from the list, it's invalid
-                    payout_list.erase(payout_list.begin() + payout_pos);
-                    payout_pos--;
-                    load_next_user = true;
-
-                    // Pause so the user can see the message
-                    if (!cur_payout_info.is_developer) {
-                        Sleep(45000);
-                    } else {
-                        Sleep(5000);
+                    if ( cur_user_removed == false ) {
+                        payout_list.erase(payout_list.begin() + payout_pos);
+                        payout_pos--;
+                        cur_user_removed = true;
                     }
 
-                } else if ( xptClient->blockWorkInfo.height != workDataSource.height || memcmp(xptClient->blockWorkInfo.merkleRoot, workDataSource.merkleRootOriginal, 32) != 0  ) {
-                    // update work
-                    xptMiner_getWorkFromXPTConnection(xptClient);
-                    LeaveCriticalSection(&cs_xptClient);
-                } else if ( xptClient->clientState != XPT_CLIENT_STATE_LOGGED_IN && (uint32)time(NULL) - miningStartTime > 120 ) {
-                    // There's a super annoying bug where a login response is never received from the yPool servers.
-                    // To prevent permanently being stuck in limbo, force a disconnect and reconnect by swapping users.
-                    printf("Network issues detected, attempting to reconnect.\n");
                     load_next_user = true;
-                    LeaveCriticalSection(&cs_xptClient);
+
                 } else {
-                    LeaveCriticalSection(&cs_xptClient);
+                    // We had a correct login but still disconnected.
+                    // It probably means the mining pool is down or there are connection issues
+                    // The standby pool takes over until it's back
                 }
 
-                Sleep(1);
+            } else if ( xptClient_isAuthenticated(client) && client->algorithm != ALGORITHM_PROTOSHARES ) {
+                // unknown algorithm, force disconnect
+                xptMiner_retryPoolLater(pool, currentTick);
 
-                // The time only counts if we're actually logged in
-                cur_payout_round_length += (xptClient->gotLoginResponse ? getTimeMilliseconds() - currentTick : 0);
-            }
-        } else {
-            // initiate new connection
-            EnterCriticalSection(&cs_xptClient);
+                if (cur_payout_info.is_developer) {
+                    xptMiner_printDeveloperError(&cur_payout_info, pool, "BADALGO");
+                } else {
+                    printf("The login '%s' is configured for an unsupported algorithm.\n", client->username);
+                    printf("Make sure you miner login details are correct\n");
+                }
 
-            if ( xptClient_connect(xptClient, &minerSettings.requestTarget) == false ) {
-                LeaveCriticalSection(&cs_xptClient);
-                printf("Connection attempt failed, retry in 15 seconds\n");
-                Sleep(15000);
-            } else {
-                LeaveCriticalSection(&cs_xptClient);
-                printf("Connected to server using x.pushthrough(xpt) protocol\n");
-                miningStartTime = (uint32)time(NULL);
-                totalCollisionCount = 0;
-                totalTableCount = 0;
-                curShareCount = 0;
+                // Delete the info from the list, it's invalid
+                if ( cur_user_removed == false ) {
+                    payout_list.erase(payout_list.begin() + payout_pos);
+                    payout_pos--;
+                    cur_user_removed = true;
+                }
+
+                load_next_user = true;
+
+                // Pause so the user can see the message
+                if (!cur_payout_info.is_developer) {
+                    Sleep(45000);
+                } else {
+                    Sleep(5000);
+                }
+
+            } else if ( xptClient_isAuthenticated(client) && pool->loggedIn == false ) {
+                pool->loggedIn = true;
+                pool->loginTime = getTimeMilliseconds();
+                pool->retryDelay = POOL_RETRY_DELAY_MIN;
+                printf("Connected to %s:%d using x.pushthrough(xpt) protocol%s\n", pool->host, pool->requestTarget.port, (i > activePool && activePool >= 0 ? ", standing by" : ""));
+
+            } else if ( xptClient_isAuthenticated(client) == false && client->connecting == false && getTimeMilliseconds() - client->connectTime > POOL_LOGIN_TIMEOUT ) {
+                // There's a super annoying bug where a login response is never received from the yPool servers.
+                // To prevent permanently being stuck in limbo, force a disconnect and reconnect.
+                printf("Network issues detected, attempting to reconnect.\n");
+                xptClient_forceDisconnect(client);
+                pool->retryTime = currentTick;
             }
+        }
 
-            Sleep(1);
+        xptMiner_selectPool();
+        xptMiner_connectPools(currentTick);
+
+        if ( activePool >= 0 ) {
+            xptClient_t* client = pools[activePool].client;
+
+            if ( currentWork == NULL || client->blockWorkInfo.height != currentWork->height || memcmp(client->blockWorkInfo.merkleRoot, currentWork->merkleRootOriginal, 32) != 0 ) {
+                // update work
+                xptMiner_getWorkFromXPTConnection(client);
+            }
         }
+
+        LeaveCriticalSection(&cs_xptClient);
+
+        Sleep(1);
+
+        // The time only counts if we're actually logged in
+        cur_payout_round_length += (activePool >= 0 ? getTimeMilliseconds() - currentTick : 0);
     }
 }
 
-
 void xptMiner_printHelp()
 {
     printf("Usage: xptMiner.exe [options]                                                          \n");
     printf("General options:                                                                       \n");
     printf("   -o, -O               The miner will connect to this url                             \n");
     printf("                        You can specify a port after the url using -o url:port         \n");
+    printf("                        Repeat it to add failover pools, earlier pools are preferred   \n");
+    printf("   -failback <sec>      Time a failed pool has to stay up before mining switches back  \n");
+    printf("                        to it (default is 60)                                          \n");
     printf("   -u                   The username (workername) used for login                       \n");
     printf("   -p                   The password used for login                                    \n");
-    printf("   -t <num>             The number of threads for mining (default is 1)                \n");
+    printf("   -t <num>             The number of threads for mining                               \n");
+    printf("                        (default is 1 per GPU, or all cores with the CPU engines)     \n");
     printf("   -f <num>             Donation amount for dev (default donates 3.0% to dev)          \n");
+    printf("   --benchmark <num>    Runs <num> tables on a fixed block without connecting to a     \n");
+    printf("                        pool, then prints timings and a BENCHMARK summary line         \n");
+    printf("   -verbose <num>       Per-device timings (0 = none, 1 = p50/p99 of the main phases   \n");
+    printf("                        every 8 seconds, 2 = all phases and every table; default is 1)\n");
+    printf("   -stats-port <port>   Serves JSON stats on http://127.0.0.1:<port>/ and Prometheus   \n");
+    printf("                        metrics on /metrics (default is 0 = disabled)                  \n");
     printf("                                                                                       \n");
     printf("Mining options:                                                                        \n");
+    printf("   -e <engine>          Momentum engine (values = opencl, cpu, partition;              \n");
+    printf("                        default is opencl)                                             \n");
+    printf("   -c <strategy>        CPU engine collision search (values = bucket, sort, filter;    \n");
+    printf("                        default is bucket, sort never drops elements, filter needs     \n");
+    printf("                        the least memory but hashes every nonce several times)         \n");
+    printf("   -entry <format>      CPU engine bucket table entries (values = full, compact;       \n");
+    printf("                        default is full, compact halves the memory per entry)          \n");
+    printf("   -k <num>             Partition engine: uses 2^N partitions                          \n");
+    printf("                        (range = 12 to 16, default is 0 = sized from the L2 cache)     \n");
     printf("   -d <num>,<num>,...   List of GPU devices to use (default is 0).                     \n");
     printf("   -w <num>             GPU work group size (0 = MAX, default is 0, must be power of 2)\n");
     printf("   -v <num>             Vector size (values = 1, 2, 4; default is 1)                   \n");
+    printf("   -cl-cache <dir>      Directory for compiled OpenCL programs, \"off\" always compiles \n");
+    printf("                        (default is clcache)                                           \n");
+    printf("   -pipeline            Overlaps each GPU table with the host work of the next one,   \n");
+    printf("                        collisions are reported one table later                        \n");
+    printf("   -affinity            Pins each GPU thread to the CPUs next to its device and every  \n");
+    printf("                        CPU engine thread to its own core                              \n");
+    printf("   -hugepages <on|off>  Backs the CPU engine tables with 1 GB, 2 MB or transparent     \n");
+    printf("                        huge pages where available (default is on)                     \n");
     printf("   -b <num>             Number of buckets to use in hashing step                       \n");
-    printf("                        Uses 2^N buckets (range = 12 to 99, default is 23)             \n");
+    printf("                        Uses 2^N buckets (range = 12 to 99, default is 23, compact     \n");
+    printf("                        entries pick the count that suits the memory target)           \n");
     printf("   -s <num>             Size of buckets to use (0 = MAX, default is 0)                 \n");
     printf("   -m <num>             Target memory usage in Megabytes, overrides \"-s\"             \n");
     printf("                        (Leave unset if using \"-s\" option)                           \n");
@@ -487,9 +860,10 @@ void xptMiner_parseCommandline(int argc, char **argv)
     commandlineInput.donationPercent = 3.0f;
     uint32 wgs          =  0;
     uint32 vect_type    =  1;
-    uint32 buckets_log2 = 23;
+    uint32 buckets_log2 =  0; // 0 = default, depends on the entry format
     uint32 bucket_size  =  0;
     uint32 target_mem   =  0;
+    uint32 partition_bits = 0;
 
     while ( cIdx < argc ) {
         char* argument = argv[cIdx];
@@ -502,19 +876,32 @@ void xptMiner_parseCommandline(int argc, char **argv)
                 exit(0);
             }
 
+            poolTarget_t pool;
+            pool.port = commandlineInput.port;
+
             if ( strstr(argv[cIdx], "http://") ) {
-                commandlineInput.host = _strdup(strstr(argv[cIdx], "http://") + 7);
+                pool.host = _strdup(strstr(argv[cIdx], "http://") + 7);
             } else {
-                commandlineInput.host = _strdup(argv[cIdx]);
+                pool.host = _strdup(argv[cIdx]);
             }
 
-            char* portStr = strstr(commandlineInput.host, ":");
+            char* portStr = strstr(pool.host, ":");
 
             if ( portStr ) {
                 *portStr = '\0';
-                commandlineInput.port = atoi(portStr + 1);
+                pool.port = atoi(portStr + 1);
             }
 
+            // Every further -o adds a failover pool
+            commandlineInput.pools.push_back(pool);
+            cIdx++;
+        } else if ( memcmp(argument, "-failback", 10) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing seconds after -failback option\n");
+                exit(0);
+            }
+
+            commandlineInput.failback_seconds = atoi(argv[cIdx]);
             cIdx++;
         } else if ( memcmp(argument, "-u", 3) == 0 ) {
             // -u
@@ -562,6 +949,98 @@ void xptMiner_parseCommandline(int argc, char **argv)
 
             commandlineInput.donationPercent = pct;
 
+            cIdx++;
+        } else if ( memcmp(argument, "-e", 3) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing engine name after %s option\n", argument);
+                exit(0);
+            }
+
+            if ( strcmp(argv[cIdx], "opencl") == 0 ) {
+                commandlineInput.engine = PROTOSHARE_ENGINE_OPENCL;
+            } else if ( strcmp(argv[cIdx], "cpu") == 0 ) {
+                commandlineInput.engine = PROTOSHARE_ENGINE_CPU;
+            } else if ( strcmp(argv[cIdx], "partition") == 0 ) {
+                commandlineInput.engine = PROTOSHARE_ENGINE_PARTITION;
+            } else {
+                printf("Engine '%s' is invalid.  Valid values are opencl, cpu or partition.\n", argv[cIdx]);
+                exit(0);
+            }
+
+            cIdx++;
+        } else if ( memcmp(argument, "-c", 3) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing strategy name after %s option\n", argument);
+                exit(0);
+            }
+
+            if ( strcmp(argv[cIdx], "bucket") == 0 ) {
+                commandlineInput.cpu_strategy = PROTOSHARE_CPU_BUCKET;
+            } else if ( strcmp(argv[cIdx], "sort") == 0 ) {
+                commandlineInput.cpu_strategy = PROTOSHARE_CPU_SORT;
+            } else if ( strcmp(argv[cIdx], "filter") == 0 ) {
+                commandlineInput.cpu_strategy = PROTOSHARE_CPU_FILTER;
+            } else {
+                printf("Strategy '%s' is invalid.  Valid values are bucket, sort or filter.\n", argv[cIdx]);
+                exit(0);
+            }
+
+            cIdx++;
+        } else if ( memcmp(argument, "-entry", 7) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing entry format after %s option\n", argument);
+                exit(0);
+            }
+
+            if ( strcmp(argv[cIdx], "full") == 0 ) {
+                commandlineInput.entry_size = ENTRY_SIZE_FULL;
+            } else if ( strcmp(argv[cIdx], "compact") == 0 ) {
+                commandlineInput.entry_size = ENTRY_SIZE_COMPACT;
+            } else {
+                printf("Entry format '%s' is invalid.  Valid values are full or compact.\n", argv[cIdx]);
+                exit(0);
+            }
+
+            cIdx++;
+        } else if ( memcmp(argument, "-k", 3) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing partition quantity after %s option\n", argument);
+                exit(0);
+            }
+
+            partition_bits = atoi(argv[cIdx]);
+
+            if (partition_bits != 0 && (partition_bits < 12 || partition_bits > 16)) {
+                printf("Partition quantity '%d' is invalid.  Valid values are 0 or between 12 and 16.\n", partition_bits);
+                exit(0);
+            }
+
+            cIdx++;
+        } else if ( memcmp(argument, "-cl-cache", 10) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing directory after %s option\n", argument);
+                exit(0);
+            }
+
+            commandlineInput.cl_cache_dir = (strcmp(argv[cIdx], "off") == 0 ? "" : argv[cIdx]);
+            cIdx++;
+        } else if ( memcmp(argument, "-pipeline", 10) == 0 ) {
+            commandlineInput.opencl_pipeline = 1;
+        } else if ( memcmp(argument, "-affinity", 10) == 0 ) {
+            commandlineInput.affinity = 1;
+        } else if ( memcmp(argument, "-hugepages", 11) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing on or off after %s option\n", argument);
+                exit(0);
+            }
+
+            if ( strcmp(argv[cIdx], "off") == 0 ) {
+                hugePages_disable();
+            } else if ( strcmp(argv[cIdx], "on") != 0 ) {
+                printf("Huge page setting '%s' is invalid.  Valid values are on or off.\n", argv[cIdx]);
+                exit(0);
+            }
+
             cIdx++;
         } else if ( memcmp(argument, "-list-devices", 14) == 0 ) {
             commandlineInput.listDevices = true;
@@ -583,6 +1062,20 @@ void xptMiner_parseCommandline(int argc, char **argv)
             }
 
             commandlineInput.deviceList.push_back(atoi(list.c_str()));
+            cIdx++;
+        } else if ( memcmp(argument, "-verbose", 9) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing verbosity after %s option\n", argument);
+                exit(0);
+            }
+
+            commandlineInput.verbosity = atoi(argv[cIdx]);
+
+            if ( commandlineInput.verbosity > 2 ) {
+                printf("Verbosity '%d' is invalid.  Valid values are 0, 1 or 2.\n", commandlineInput.verbosity);
+                exit(0);
+            }
+
             cIdx++;
         } else if ( memcmp(argument, "-w", 2) == 0 ) {
             if ( cIdx >= argc ) {
@@ -629,6 +1122,20 @@ void xptMiner_parseCommandline(int argc, char **argv)
                 exit(0);
             }
 
+            cIdx++;
+        } else if ( memcmp(argument, "-stats-port", 12) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing port after %s option\n", argument);
+                exit(0);
+            }
+
+            commandlineInput.stats_port = atoi(argv[cIdx]);
+
+            if ( commandlineInput.stats_port > 65535 ) {
+                printf("Stats port '%d' is invalid.  Valid values are between 1 and 65535, or 0 to disable.\n", commandlineInput.stats_port);
+                exit(0);
+            }
+
             cIdx++;
         } else if ( memcmp(argument, "-s", 2) == 0 ) {
             if ( cIdx >= argc ) {
@@ -645,6 +1152,20 @@ void xptMiner_parseCommandline(int argc, char **argv)
             }
 
             target_mem = atoi(argv[cIdx]);
+            cIdx++;
+        } else if ( memcmp(argument, "--benchmark", 12) == 0 ) {
+            if ( cIdx >= argc ) {
+                printf("Missing table count after %s option\n", argument);
+                exit(0);
+            }
+
+            commandlineInput.benchmark_tables = atoi(argv[cIdx]);
+
+            if ( commandlineInput.benchmark_tables < 1 ) {
+                printf("Table count '%s' is invalid.  Please use 1 or more tables.\n", argv[cIdx]);
+                exit(0);
+            }
+
             cIdx++;
         } else if ( memcmp(argument, "-help", 6) == 0 || memcmp(argument, "--help", 7) == 0 ) {
             xptMiner_printHelp();
@@ -662,9 +1183,15 @@ void xptMiner_parseCommandline(int argc, char **argv)
 
     commandlineInput.wgs = wgs;
     commandlineInput.vect_type = vect_type;
+    // Compact entries pick the bucket count that suits the memory target, see ProtoshareCPU::init_bucket()
+    if ( buckets_log2 == 0 && commandlineInput.entry_size != ENTRY_SIZE_COMPACT ) {
+        buckets_log2 = 23;
+    }
+
     commandlineInput.buckets_log2 = buckets_log2;
     commandlineInput.bucket_size = bucket_size;
     commandlineInput.target_mem = target_mem;
+    commandlineInput.partition_bits = partition_bits;
 }
 
 
@@ -709,10 +1236,37 @@ int main(int argc, char** argv)
     numcpu = sysinfo.dwNumberOfProcessors;
 #endif
 
-    //commandlineInput.numThreads = numcpu;
-    commandlineInput.numThreads = 1;
-    commandlineInput.numThreads = std::min(std::max(commandlineInput.numThreads, 1), 4);
+    commandlineInput.numThreads = 0; // 0 = pick default after parsing the engine
+    commandlineInput.engine = PROTOSHARE_ENGINE_OPENCL;
+    commandlineInput.cpu_strategy = PROTOSHARE_CPU_BUCKET;
+    commandlineInput.entry_size = ENTRY_SIZE_FULL;
+    commandlineInput.benchmark_tables = 0;
+    commandlineInput.verbosity = 1;
+    commandlineInput.stats_port = 0;
+    commandlineInput.opencl_pipeline = 0;
+    commandlineInput.cl_cache_dir = "clcache";
+    commandlineInput.affinity = 0;
+    commandlineInput.failback_seconds = 60;
     xptMiner_parseCommandline(argc, argv);
+
+    if ( commandlineInput.pools.empty() ) {
+        poolTarget_t pool = { commandlineInput.host, commandlineInput.port };
+        commandlineInput.pools.push_back(pool);
+    }
+
+    commandlineInput.host = commandlineInput.pools[0].host;
+    commandlineInput.port = commandlineInput.pools[0].port;
+
+    if ( commandlineInput.entry_size == ENTRY_SIZE_COMPACT
+      && (commandlineInput.engine != PROTOSHARE_ENGINE_CPU || commandlineInput.cpu_strategy != PROTOSHARE_CPU_BUCKET) ) {
+        printf("Compact entries are only supported by \"-e cpu -c bucket\".\n");
+        exit(0);
+    }
+
+    if ( commandlineInput.numThreads == 0 ) {
+        commandlineInput.numThreads = (commandlineInput.engine == PROTOSHARE_ENGINE_OPENCL ? 1 : numcpu);
+    }
+
     minerSettings.protoshareMemoryMode = commandlineInput.ptsMemoryMode;
     printf("/==================================================\\\n");
     printf("|                                                  |\n");
@@ -742,79 +1296,142 @@ int main(int argc, char** argv)
     WSADATA wsa;
     WSAStartup(MAKEWORD(2, 2), &wsa);
 
-    // get IP of pool url (default ypool.net)
-    char* poolURL = commandlineInput.host;
+    InitializeCriticalSection(&cs_xptClient);
 
-    // Convert to lowercase
-    for (uint8 i = 0; poolURL[i] > 0; i++) {
-        if (poolURL[i] >= 'A' && poolURL[i] <= 'Z') { poolURL[i] += ('a' - 'A'); }
-    }
+    for (uint32 p = 0; p < commandlineInput.pools.size(); p++) {
+        // get IP of pool url (default ypool.net)
+        char* poolURL = commandlineInput.pools[p].host;
 
-    hostent* hostInfo = gethostbyname(poolURL);
+        // Convert to lowercase
+        for (uint8 i = 0; poolURL[i] > 0; i++) {
+            if (poolURL[i] >= 'A' && poolURL[i] <= 'Z') { poolURL[i] += ('a' - 'A'); }
+        }
 
-    if ( hostInfo == NULL ) {
-        printf("Cannot resolve '%s'. Is it a valid URL?\n", poolURL);
-        exit(-1);
-    }
+        char* ipText = (char*)malloc(32);
+        sprintf(ipText, "0.0.0.0");
 
-    void** ipListPtr = (void**)hostInfo->h_addr_list;
-    uint32 ip = 0xFFFFFFFF;
+        // The benchmark never connects
+        if ( commandlineInput.benchmark_tables == 0 ) {
+            hostent* hostInfo = gethostbyname(poolURL);
 
-    if ( ipListPtr[0] ) {
-        ip = *(uint32*)ipListPtr[0];
+            if ( hostInfo == NULL ) {
+                printf("Cannot resolve '%s'. Is it a valid URL?\n", poolURL);
+                exit(-1);
+            }
+
+            void** ipListPtr = (void**)hostInfo->h_addr_list;
+            uint32 ip = 0xFFFFFFFF;
+
+            if ( ipListPtr[0] ) {
+                ip = *(uint32*)ipListPtr[0];
+            }
+
+            sprintf(ipText, "%d.%d.%d.%d", ((ip >> 0) & 0xFF), ((ip >> 8) & 0xFF), ((ip >> 16) & 0xFF), ((ip >> 24) & 0xFF));
+        }
+
+        // setup connection info, the login is filled in when connecting
+        xptPool_t pool;
+        memset(&pool, 0x00, sizeof(xptPool_t));
+        pool.host = poolURL;
+        pool.requestTarget.ip = ipText;
+        pool.requestTarget.port = commandlineInput.pools[p].port;
+        pool.requestTarget.donationPercent = commandlineInput.donationPercent;
+        pool.retryDelay = POOL_RETRY_DELAY_MIN;
+        pools.push_back(pool);
     }
 
-    char* ipText = (char*)malloc(32);
-    sprintf(ipText, "%d.%d.%d.%d", ((ip >> 0) & 0xFF), ((ip >> 8) & 0xFF), ((ip >> 16) & 0xFF), ((ip >> 24) & 0xFF));
-    // init work source
-    InitializeCriticalSection(&workDataSource.cs_work);
-    InitializeCriticalSection(&cs_xptClient);
-    // setup connection info
-    minerSettings.requestTarget.ip = ipText;
-    minerSettings.requestTarget.port = commandlineInput.port;
+    minerSettings.requestTarget = pools[0].requestTarget;
     minerSettings.requestTarget.authUser = commandlineInput.workername;
     minerSettings.requestTarget.authPass = commandlineInput.workerpass;
-    minerSettings.requestTarget.donationPercent = commandlineInput.donationPercent;
-
-    // inits GPU
-    printf("Available devices:\n");
-    OpenCLMain::getInstance().listDevices();
 
-    if (commandlineInput.listDevices) {
-        exit(0);
+    if ( pools.size() > 1 ) {
+        printf("%d pools configured, failing back to a preferred pool after %d seconds\n", (sint32)pools.size(), commandlineInput.failback_seconds);
     }
 
-    if (commandlineInput.deviceList.empty()) {
-        for (int i = 0; i < commandlineInput.numThreads; i++) {
-            commandlineInput.deviceList.push_back(i);
+    uint32 engineThreads = 1;
+
+    if ( commandlineInput.engine != PROTOSHARE_ENGINE_OPENCL && commandlineInput.listDevices == false ) {
+        // The CPU engines spread a single table over all threads, so there is only one miner thread
+        printf("Initializing workers...\n");
+        engineThreads = commandlineInput.numThreads;
+        if ( commandlineInput.engine == PROTOSHARE_ENGINE_PARTITION ) {
+            processors.push_back(new ProtosharePartitioned(commandlineInput.numThreads));
+        } else {
+            processors.push_back(new ProtoshareCPU(commandlineInput.numThreads));
         }
+        commandlineInput.numThreads = 1;
+
+        printf("CPU engine initialized...\n");
     } else {
-        commandlineInput.numThreads = commandlineInput.deviceList.size();
-    }
+        // inits GPU
+        printf("Available devices:\n");
+        OpenCLMain::getInstance().listDevices();
 
-    printf("\n");
-    printf("Adjusting num threads to match device list: %d\n", commandlineInput.numThreads);
+        if (commandlineInput.listDevices) {
+            exit(0);
+        }
 
-    // inits all GPU devices
-    printf("\n");
-    printf("Initializing workers...\n");
+        if (commandlineInput.deviceList.empty()) {
+            for (int i = 0; i < commandlineInput.numThreads; i++) {
+                commandlineInput.deviceList.push_back(i);
+            }
+        } else {
+            commandlineInput.numThreads = commandlineInput.deviceList.size();
+        }
+
+        printf("\n");
+        printf("Adjusting num threads to match device list: %d\n", commandlineInput.numThreads);
+
+        // inits all GPU devices
+        printf("\n");
+        printf("Initializing workers...\n");
 
-    for (int i = 0; i < commandlineInput.deviceList.size(); i++) {
-        printf("Initing device %d...\n", i);
-        gpu_processors.push_back(new ProtoshareOpenCL(commandlineInput.deviceList[i]));
+        for (int i = 0; i < commandlineInput.deviceList.size(); i++) {
+            printf("Initing device %d...\n", i);
+            std::vector<uint32> cpus;
 
+            if ( commandlineInput.affinity ) {
+                // Set up the device from its own NUMA node so host side buffers are allocated there
+                std::string pci_address = OpenCLMain::getInstance().getDevice(commandlineInput.deviceList[i])->getPciAddress();
+                cpus = affinity_getPciDeviceCpus(pci_address);
+
+                if ( cpus.empty() ) {
+                    printf("PCI locality of device %d is unknown, its thread is not pinned\n", commandlineInput.deviceList[i]);
+                } else {
+                    printf("Device %d at PCI %s is local to CPU %s\n", commandlineInput.deviceList[i], pci_address.c_str(), affinity_formatCpuList(cpus).c_str());
+                }
+
+                affinity_pinCurrentThread(cpus.empty() ? affinity_getAllCpus() : cpus);
+            }
+
+            ProtoshareOpenCL* processor = new ProtoshareOpenCL(commandlineInput.deviceList[i]);
+            processor->thread_cpus = cpus;
+            processors.push_back(processor);
+        }
+
+        if ( commandlineInput.affinity ) {
+            affinity_pinCurrentThread(affinity_getAllCpus());
+        }
+
+        printf("\nAll GPUs Initialized...\n");
     }
 
-    printf("\nAll GPUs Initialized...\n");
     printf("\n");
     printf("\n");
 
+    if ( commandlineInput.benchmark_tables > 0 ) {
+        for (uint32 i = 0; i < processors.size(); i++) {
+            protoshares_benchmark(processors[i], commandlineInput.benchmark_tables, engineThreads);
+        }
+        exit(0);
+    }
+
 
     payout_t payout_temp;
     double total_payout = 100.00;
 
     // Add GigaWatt to developer fee payout
-    payout_temp.workername = _strdup(strstr(poolURL, "ypool") != NULL ? "gigawatt.pts_dev" : "PbwHkEs9ieWdfJPsowoWingrKyND2uML9s");
+    payout_temp.workername = _strdup(strstr(commandlineInput.host, "ypool") != NULL ? "gigawatt.pts_dev" : "PbwHkEs9ieWdfJPsowoWingrKyND2uML9s");
     payout_temp.workerpass = "x";
     payout_temp.payout_pct = commandlineInput.donationPercent;
     payout_temp.is_developer = true;
@@ -829,9 +1446,18 @@ int main(int argc, char** argv)
     payout_list.push_back( payout_temp );
 
 
-    // start miner threads
-    for (uint32 i = 0; i < commandlineInput.numThreads; i++) {
-        CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)xptMiner_minerThread, (LPVOID)0, 0, NULL);
+    if ( commandlineInput.stats_port != 0 ) {
+        if ( statsServer_start((uint16)commandlineInput.stats_port) == false ) {
+            printf("ERROR: Cannot listen on 127.0.0.1:%d for stats\n", commandlineInput.stats_port);
+            exit(0);
+        }
+
+        printf("Serving stats on http://127.0.0.1:%d/ and /metrics\n", commandlineInput.stats_port);
+    }
+
+    // start one miner thread per processor
+    for (uint32 i = 0; i < processors.size(); i++) {
+        CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)xptMiner_minerThread, (LPVOID)processors[i], 0, NULL);
     }
 
     // enter work management loop
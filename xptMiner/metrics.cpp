@@ -0,0 +1,159 @@
+#include "global.h"
+#include "ticker.h"
+#include "metrics.h"
+#include <cmath>
+
+const char* metrics_phaseNames[METRICS_PHASES] = { "table", "hash", "seek", "revalidate", "overhead", "queue_wait" };
+
+static metricsDevice_t metrics_devices[METRICS_MAX_DEVICES];
+static uint32 metrics_deviceCount = 0;
+
+
+metricsDevice_t* metrics_registerDevice(const char* name)
+{
+    if ( metrics_deviceCount >= METRICS_MAX_DEVICES ) {
+        printf("ERROR: Too many devices, metrics are limited to %d\n", METRICS_MAX_DEVICES);
+        exit(0);
+    }
+
+    metricsDevice_t* device = &metrics_devices[metrics_deviceCount++];
+    memset(device, 0x00, sizeof(metricsDevice_t));
+    strncpy(device->name, name, sizeof(device->name) - 1);
+
+    return device;
+}
+
+uint32 metrics_getDeviceCount()               { return metrics_deviceCount; }
+metricsDevice_t* metrics_getDevice(uint32 index) { return &metrics_devices[index]; }
+
+
+// Values below 4 get their own bucket, above that every power of two is split into 4 buckets
+static uint32 metrics_getBucket(uint32 value)
+{
+    if ( value < 4 ) { return value; }
+
+    uint32 msb = 2;
+    while ( (value >> (msb + 1)) != 0 ) { msb++; }
+
+    return 4 * (msb - 1) + ((value >> (msb - 2)) & 3);
+}
+
+uint32 metrics_getBucketUpperBound(uint32 bucket)
+{
+    if ( bucket < 4 ) { return bucket; }
+
+    uint32 msb = bucket / 4 + 1;
+    uint64 lower = (uint64)(4 + bucket % 4) << (msb - 2);
+
+    return (uint32)std::min(lower + ((uint64)1 << (msb - 2)) - 1, (uint64)0xFFFFFFFF);
+}
+
+
+void metrics_record(metricsHistogram_t* histogram, uint32 microseconds)
+{
+    InterlockedIncrement(&histogram->counts[metrics_getBucket(microseconds)]);
+}
+
+// Adds the counts of source to target, target must not be recorded to at the same time
+void metrics_merge(metricsHistogram_t* target, const metricsHistogram_t* source)
+{
+    for (uint32 i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) { target->counts[i] += source->counts[i]; }
+}
+
+void metrics_recordAbort(metricsDevice_t* device, uint32 spent_us)
+{
+    uint32 expected_us = metrics_getPercentile(&device->phase[METRICS_PHASE_TABLE], 50);
+
+    InterlockedIncrement(&device->aborted_tables);
+    if ( expected_us > spent_us ) {
+        InterlockedExchangeAdd(&device->avoided_ms, (LONG)((expected_us - spent_us) / 1000));
+    }
+}
+
+uint32 metrics_getCount(const metricsHistogram_t* histogram)
+{
+    uint32 count = 0;
+
+    for (uint32 i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) { count += histogram->counts[i]; }
+
+    return count;
+}
+
+// Returns the upper bound of the bucket holding the given percentile (0 - 100), 0 if empty
+uint32 metrics_getPercentile(const metricsHistogram_t* histogram, double percentile)
+{
+    uint32 count = metrics_getCount(histogram);
+    if ( count == 0 ) { return 0; }
+
+    uint32 rank = (uint32)ceil(count * percentile / 100.0);
+    rank = std::max(rank, (uint32)1);
+
+    uint32 seen = 0;
+    for (uint32 i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if ( seen >= rank ) { return metrics_getBucketUpperBound(i); }
+    }
+
+    return metrics_getBucketUpperBound(METRICS_HISTOGRAM_BUCKETS - 1);
+}
+
+
+uint32 metrics_ticksToMicroseconds(uint64 ticks)
+{
+#if (defined(__MACH__) && defined(__APPLE__))
+    static struct mach_timebase_info convfact = { 0, 0 };
+    if ( convfact.denom == 0 ) { mach_timebase_info(&convfact); }
+    return (uint32)(ticks * convfact.numer / convfact.denom / 1000);
+#elif defined(_WIN32)
+    static uint64 frequency = 0;
+    if ( frequency == 0 ) { frequency = getTimerRes(); }
+    return (uint32)(ticks * 1000000 / frequency);
+#else
+    // CLOCK_MONOTONIC in nanoseconds
+    return (uint32)(ticks / 1000);
+#endif
+}
+
+uint32 metrics_elapsedMicroseconds(uint64 startTicks)
+{
+    return metrics_ticksToMicroseconds(getTimeHighRes() - startTicks);
+}
+
+
+// Formats microseconds as milliseconds with a precision that fits the value
+static void metrics_formatTime(char* buffer, uint32 microseconds)
+{
+    if ( microseconds < 10000 ) {
+        sprintf(buffer, "%.2f", microseconds / 1000.0);
+    } else {
+        sprintf(buffer, "%d", microseconds / 1000);
+    }
+}
+
+void metrics_printStatus(uint32 verbosity)
+{
+    if ( verbosity == 0 ) { return; }
+
+    for (uint32 d = 0; d < metrics_deviceCount; d++) {
+        metricsDevice_t* device = &metrics_devices[d];
+        if ( metrics_getCount(&device->phase[METRICS_PHASE_TABLE]) == 0 ) { continue; }
+
+        printf("    %s (p50/p99 ms):", device->name);
+
+        // Verbosity 1 only shows the phases that usually matter
+        for (uint32 p = 0; p < METRICS_PHASES; p++) {
+            if ( verbosity < 2 && (p == METRICS_PHASE_REVALIDATE || p == METRICS_PHASE_OVERHEAD) ) { continue; }
+
+            char p50[16], p99[16];
+            metrics_formatTime(p50, metrics_getPercentile(&device->phase[p], 50));
+            metrics_formatTime(p99, metrics_getPercentile(&device->phase[p], 99));
+            printf(" %s %s/%s", metrics_phaseNames[p], p50, p99);
+        }
+
+        if ( device->aborted_tables > 0 ) {
+            printf(", %d stale tables abandoned (%.1f s saved)", device->aborted_tables, device->avoided_ms / 1000.0);
+        }
+
+        printf("\n");
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+#include "global.h"
+
+// Latency histograms with 4 buckets per power of two (about 12% resolution), in microseconds
+#define METRICS_HISTOGRAM_BUCKETS   ( 128 )
+
+// Upper limit of momentum engines (GPUs) that can be registered
+#define METRICS_MAX_DEVICES         ( 32 )
+
+// Phases of a table, see protoshareTableStats_t
+#define METRICS_PHASE_TABLE         ( 0 )   // whole protoshare_process() call
+#define METRICS_PHASE_HASH          ( 1 )
+#define METRICS_PHASE_SEEK          ( 2 )
+#define METRICS_PHASE_REVALIDATE    ( 3 )
+#define METRICS_PHASE_OVERHEAD      ( 4 )
+#define METRICS_PHASE_QUEUE_WAIT    ( 5 )   // miner thread waiting for and preparing work between tables
+#define METRICS_PHASES              ( 6 )
+
+// Recording is a single atomic increment and never blocks, readers may see a table half recorded
+typedef struct
+{
+    volatile LONG counts[METRICS_HISTOGRAM_BUCKETS];
+}metricsHistogram_t;
+
+typedef struct
+{
+    char name[32];
+    metricsHistogram_t phase[METRICS_PHASES];   // tables that ran to the end
+
+    // Tables abandoned because a new block arrived, and the table time that was saved by that
+    volatile LONG aborted_tables;
+    volatile LONG avoided_ms;
+}metricsDevice_t;
+
+extern const char* metrics_phaseNames[METRICS_PHASES];
+
+// Must only be called during startup, before any miner thread runs
+metricsDevice_t* metrics_registerDevice(const char* name);
+uint32 metrics_getDeviceCount();
+metricsDevice_t* metrics_getDevice(uint32 index);
+
+void metrics_record(metricsHistogram_t* histogram, uint32 microseconds);
+void metrics_merge(metricsHistogram_t* target, const metricsHistogram_t* source);
+uint32 metrics_getCount(const metricsHistogram_t* histogram);
+uint32 metrics_getPercentile(const metricsHistogram_t* histogram, double percentile);
+uint32 metrics_getBucketUpperBound(uint32 bucket);
+
+// Counts an abandoned table, the time saved is estimated from the median table time
+void metrics_recordAbort(metricsDevice_t* device, uint32 spent_us);
+
+// Conversion of getTimeHighRes() timestamps
+uint32 metrics_ticksToMicroseconds(uint64 ticks);
+uint32 metrics_elapsedMicroseconds(uint64 startTicks);
+
+// Prints the per-device part of the status line, depending on the verbosity
+void metrics_printStatus(uint32 verbosity);
+
+#endif
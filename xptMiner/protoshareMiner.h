@@ -1,12 +1,109 @@
 #ifndef __PROTOSHARE_MINER_H__
 #define __PROTOSHARE_MINER_H__
 #include "global.h"
+#include "workerPool.h"
+#include "metrics.h"
 
+#define MAX_NONCE_BITS          ( 26 )
+#define MAX_MOMENTUM_NONCE      ( 1 << MAX_NONCE_BITS )
+#define SEARCH_SPACE_BITS       ( 50 )
+#define BIRTHDAYS_PER_HASH      ( 8 )
 
-class ProtoshareOpenCL {
+// Hash table entries store the nonce in the upper bits and the birthday bits not covered by the bucket index below it
+#define ENTRY_BIRTHDAY_BITS     ( 64 - MAX_NONCE_BITS )
+#define ENTRY_BIRTHDAY_MASK     ( ((uint64)1 << ENTRY_BIRTHDAY_BITS) - 1 )
+
+// Compact entries (CPU only) store the SHA-512 group of the nonce above a tag of the birthday bits following the
+// bucket index. Tags of different birthdays can match, candidates are verified by recalculating the birthdays of
+// both groups, which also tells which nonces of the groups collide. Leaving the group offset out gains 3 tag bits.
+#define ENTRY_SIZE_FULL         ( 8 )
+#define ENTRY_SIZE_COMPACT      ( 4 )
+#define COMPACT_GROUP_BITS      ( MAX_NONCE_BITS - 3 ) // 3 = log2(BIRTHDAYS_PER_HASH)
+#define COMPACT_TAG_BITS        ( 32 - COMPACT_GROUP_BITS )
+#define COMPACT_TAG_MASK        ( (1 << COMPACT_TAG_BITS) - 1 )
+// Extra SHA-512 work for false positives above which an explicitly chosen bucket count is warned about
+#define COMPACT_MAX_EXTRA_HASHING   ( 0.125 )
+
+// Collision pairs revalidated together, their nonce groups are hashed in one SHA-512 call
+#define REVALIDATE_BATCH_SIZE   ( 128 )
+
+double poisson_estimate(double buckets, double items, double bucket_size);
+size_t calc_hash_mem_usage(uint32 buckets_log2, uint32 bucket_size, uint32 entry_size = ENTRY_SIZE_FULL);
+size_t calc_index_mem_usage(uint32 buckets_log2, uint32 bucket_size);
+size_t calc_total_mem_usage(uint32 buckets_log2, uint32 bucket_size, uint32 entry_size = ENTRY_SIZE_FULL);
+uint32 calc_bucket_size(uint32 buckets_log2, uint32 target_mem, uint32 entry_size = ENTRY_SIZE_FULL);
+double calc_compact_false_positives(uint32 buckets_log2);
+double calc_compact_extra_hashing(uint32 buckets_log2);
+uint32 calc_compact_buckets_log2(uint32 target_mem, uint32 bucket_size);
+
+void protoshares_calculateMidHash(minerProtosharesBlock_t* block, uint32* midHash);
+bool protoshares_revalidateCollision(minerProtosharesBlock_t* block, uint8* midHash, uint32 indexA, uint32 indexB);
+uint32 protoshares_revalidateCollisions(minerProtosharesBlock_t* block, uint8* midHash, const uint32* indexA, const uint32* indexB, uint32 count);
+
+
+// Timings (in microseconds) and counts of the last table processed by an engine
+typedef struct
+{
+    uint32 hash_us;         // calculating and storing all birthdays
+    uint32 seek_us;         // finding collisions and resetting the table
+    uint32 revalidate_us;   // recalculating the reported collisions and checking them against the share target
+    uint32 overhead_us;     // everything else (mid hash, setup, copying results)
+    uint32 candidates;      // collisions reported by the engine
+    uint32 collisions;      // candidates that passed revalidation
+    uint32 dropped;         // birthdays that didn't fit into the table
+    bool aborted;           // the work became stale, the table was abandoned and the other fields are partial
+}protoshareTableStats_t;
+
+
+// Common interface of all momentum engines, one instance is driven by one miner thread
+class ProtoshareProcessor {
+public:
+    ProtoshareProcessor() : estimated_drop_rate(0), metrics(NULL), table_pages("4k"), work_epoch(0) { memset(&stats, 0, sizeof(stats)); }
+    virtual ~ProtoshareProcessor() {}
+    virtual void protoshare_process(minerProtosharesBlock_t* block) = 0;
+    virtual void protoshare_flush() {}  // completes a table that's still in flight, if the engine pipelines
+
+    double estimated_drop_rate;     // expected fraction of dropped birthdays, see poisson_estimate()
+    protoshareTableStats_t stats;   // updated by every protoshare_process() call
+    metricsDevice_t* metrics;       // registered by the engine, recorded by the miner thread
+    std::vector<uint32> thread_cpus; // CPUs the miner thread pins itself to with -affinity, empty = anywhere
+    const char* table_pages;        // page size backing the main table, see hugePages_alloc()
+
+protected:
+    uint32 work_epoch;              // epoch of the block being processed
+
+    // Cancellation token, checked between chunks of work
+    bool is_stale() const { return work_epoch != workEpoch; }
+};
+
+void protoshares_recordTableMetrics(ProtoshareProcessor* processor, uint32 table_us);
+
+void protoshares_benchmark(ProtoshareProcessor* processor, uint32 tables, uint32 threads);
+
+
+// Table enqueued by the pipelined OpenCL mode, one per result buffer set
+typedef struct
+{
+    bool pending;
+    uint64 enqueue_us;          // host time spent setting the table up
+    minerProtosharesBlock_t block;
+    uint32 mid_hash[8];
+    cl_uint result_qty;
+    cl_uint result_a[256];
+    cl_uint result_b[256];
+    cl_event hash_done;
+    cl_event seek_done;
+    cl_event read_done;
+}openclPipelineTable_t;
+
+// Runs the bucket table on an OpenCL device.
+// In pipelined mode every call enqueues its table and returns the collisions of the previous one,
+// so the host side (merkle root, mid hash, revalidation) overlaps with the kernels.
+class ProtoshareOpenCL : public ProtoshareProcessor {
 public:
     ProtoshareOpenCL(int device_num);
     void protoshare_process(minerProtosharesBlock_t* block);
+    void protoshare_flush();
 
 private:
     int device_num;
@@ -21,15 +118,139 @@ private:
     OpenCLKernel* kernel_hash;
     OpenCLKernel* kernel_reset;
 
-    OpenCLBuffer* mid_hash;
     OpenCLBuffer* hash_list;
     OpenCLBuffer* index_list;
 
-    OpenCLBuffer* nonce_a;
-    OpenCLBuffer* nonce_b;
-    OpenCLBuffer* nonce_qty;
+    // Result buffers, one set per table in flight
+    OpenCLBuffer* nonce_a[2];
+    OpenCLBuffer* nonce_b[2];
+    OpenCLBuffer* nonce_qty[2];
 
     OpenCLCommandQueue * q;
+
+    bool pipelined;
+    uint32 pipeline_set;        // buffer set used by the next table
+    openclPipelineTable_t pipeline[2];
+
+    void prepare_hash(minerProtosharesBlock_t* block, uint32* midHash);
+    bool run_hash_slices();
+    void enqueue_seek(uint32 set, cl_event* event);
+    void process_pipelined(minerProtosharesBlock_t* block);
+    void complete_table(uint32 set);
+};
+
+
+// Birthday that passed the filter of the filter strategy
+typedef struct
+{
+    uint64 birthday;
+    uint32 nonce;
+}filterSurvivor_t;
+
+// Runs the momentum search on all CPU cores, using one of the PROTOSHARE_CPU_* collision strategies:
+//   bucket - builds the same bucketed hash table as the OpenCL kernels, drops elements of full buckets
+//   sort   - partitions all birthdays by their top bits and radix sorts each partition, drops nothing
+//   filter - only keeps birthdays whose filter slot is hit twice, trading extra hashing for a lot less memory
+class ProtoshareCPU : public ProtoshareProcessor {
+public:
+    ProtoshareCPU(uint32 num_threads);
+    void protoshare_process(minerProtosharesBlock_t* block);
+
+private:
+    uint32 strategy;
+    uint32 entry_size;
+    uint32 buckets_log2;
+    uint32 bucket_size;
+    uint32 target_mem;
+
+    WorkerPool* pool;
+
+    // bucket strategy
+    uint64* hash_list;
+    uint32* compact_list;       // used instead of hash_list with compact entries
+    volatile uint32* index_list;
+    uint32 index_generation;    // tag of the current table, see CPU_INDEX_GENERATION_BITS
+
+    // sort strategy
+    bool sort_rehash;           // not enough memory to keep the birthdays, hash twice instead
+    uint64* sort_birthdays;     // birthday of every nonce, unless sort_rehash
+    uint64* sort_keys;          // keys grouped by partition
+    uint32* sort_offsets;       // per hash chunk: element count, then write position of each partition
+    uint32* sort_partition_start;
+    uint32 sort_scratch_size;
+    std::vector<uint64*> sort_scratch; // per thread
+
+    // filter strategy
+    uint32 filter_bits;         // 2^filter_bits slots per round
+    uint32 filter_rounds_log2;  // birthdays are split into rounds by their top bits
+    uint32 filter_pass;         // current hash pass, fills the filter of round N and collects round N-1
+    uint32* filter_once[2];
+    uint32* filter_twice[2];
+    filterSurvivor_t* survivors;
+    uint32 survivor_capacity;
+    volatile LONG survivor_qty;
+
+    // Current table, shared with the worker threads
+    uint32 mid_hash[8];
+    volatile LONG result_qty;
+    volatile LONG stored_qty;
+    uint32 result_a[256];
+    uint32 result_b[256];
+
+    void init_bucket();
+    void init_sort();
+    void init_filter();
+    void add_result(uint32 nonce_a, uint32 nonce_b);
+    void verify_candidates(const uint32* group_a, const uint32* group_b, uint32 count);
+    void abandon_table(uint64 start_time);
+    void next_index_generation();
+
+    static void hash_job(void* context, uint32 thread_index, uint32 item);
+    static void seek_job(void* context, uint32 thread_index, uint32 item);
+    static void seek_compact_job(void* context, uint32 thread_index, uint32 item);
+    static void sort_count_job(void* context, uint32 thread_index, uint32 item);
+    static void sort_scatter_job(void* context, uint32 thread_index, uint32 item);
+    static void sort_seek_job(void* context, uint32 thread_index, uint32 item);
+    static void filter_job(void* context, uint32 thread_index, uint32 item);
+};
+
+
+// Two pass CPU engine that keeps its working set in cache:
+//   pass 1 - streams the birthdays into 2^k partitions (top birthday bits) through per-thread write-combining buffers
+//   pass 2 - finds collisions within each partition using a small open addressing table
+class ProtosharePartitioned : public ProtoshareProcessor {
+public:
+    ProtosharePartitioned(uint32 num_threads);
+    void protoshare_process(minerProtosharesBlock_t* block);
+
+private:
+    uint32 partition_bits;
+    uint32 partition_capacity;  // elements per partition, expected count plus some slack
+    uint32 table_bits;          // size of the per-partition lookup table
+
+    WorkerPool* pool;
+
+    uint64* partition_list;
+    volatile uint32* partition_fill;
+
+    // per thread
+    std::vector<uint64*> wc_buffers;
+    std::vector<uint8*> wc_counts;
+    std::vector<uint64*> tables;
+
+    // Current table, shared with the worker threads
+    uint32 mid_hash[8];
+    volatile LONG result_qty;
+    volatile LONG stored_qty;
+    uint32 result_a[256];
+    uint32 result_b[256];
+
+    void flush_partition(uint32 partition, const uint64* entries, uint32 count);
+    void abandon_table(uint64 start_time);
+
+    static void scatter_job(void* context, uint32 thread_index, uint32 item);
+    static void flush_job(void* context, uint32 thread_index, uint32 item);
+    static void seek_job(void* context, uint32 thread_index, uint32 item);
 };
 
 #endif
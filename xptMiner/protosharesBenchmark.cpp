@@ -0,0 +1,127 @@
+#include "global.h"
+#include "ticker.h"
+#include "protoshareMiner.h"
+#include "sha512_momentum.h"
+
+extern commandlineInput_t commandlineInput;
+
+
+// Fills in a fixed block header, table N of every run uses the same midHash
+static void benchmark_buildBlock(minerProtosharesBlock_t* block, uint32 table)
+{
+    memset(block, 0x00, sizeof(minerProtosharesBlock_t));
+
+    block->version = 2;
+    for (uint32 i = 0; i < 32; i++) {
+        block->prevBlockHash[i] = (uint8)(i * 7 + 1);
+        block->merkleRoot[i] = (uint8)(i * 13 + 5);
+    }
+    memcpy(block->merkleRootOriginal, block->merkleRoot, 32);
+    block->nTime = 1385000000 + table;
+    block->nBits = 0x1d00ffff;
+    block->height = 1;
+
+    // An all zero share target can't be met, so nothing is ever submitted
+    memset(block->targetShare, 0x00, 32);
+}
+
+
+static const char* benchmark_engineName()
+{
+    switch (commandlineInput.engine) {
+        case PROTOSHARE_ENGINE_CPU:
+            if (commandlineInput.cpu_strategy == PROTOSHARE_CPU_SORT)   { return "cpu-sort"; }
+            if (commandlineInput.cpu_strategy == PROTOSHARE_CPU_FILTER) { return "cpu-filter"; }
+            return (commandlineInput.entry_size == ENTRY_SIZE_COMPACT ? "cpu-bucket-compact" : "cpu-bucket");
+        case PROTOSHARE_ENGINE_PARTITION:
+            return "partition";
+        default:
+            return (commandlineInput.opencl_pipeline ? "opencl-pipelined" : "opencl");
+    }
+}
+
+
+// Runs a number of tables through an engine without any network connection and prints the timings,
+// threads is the number of CPU threads (or devices) used by the engine.
+// The first table is treated as warmup (page faults, kernel compilation) if there's more than one.
+void protoshares_benchmark(ProtoshareProcessor* processor, uint32 tables, uint32 threads)
+{
+    minerProtosharesBlock_t block;
+
+    uint64 hash_us = 0, seek_us = 0, revalidate_us = 0, overhead_us = 0;
+    uint64 candidates = 0, collisions = 0, dropped = 0;
+    uint32 measured = 0;
+
+    printf("Benchmarking %d tables...\n", tables);
+
+    // A pipelined engine completes each table during the next call, the last one when it's flushed
+    uint32 completed = 0;
+    uint64 wall_start = getTimeHighRes();
+
+    for (uint32 table = 0; table <= tables; table++) {
+        uint32 table_count = totalTableCount;
+
+        if (table < tables) {
+            benchmark_buildBlock(&block, table);
+            processor->protoshare_process(&block);
+        } else {
+            processor->protoshare_flush();
+        }
+
+        if (totalTableCount == table_count) { continue; }
+
+        protoshareTableStats_t* stats = &processor->stats;
+        printf("Table %3d: hash %8.1f ms, seek %8.1f ms, revalidate %6.2f ms, overhead %6.2f ms, %2d collisions (%d candidates), %6.3f%% dropped\n",
+               completed, stats->hash_us / 1000.0, stats->seek_us / 1000.0, stats->revalidate_us / 1000.0, stats->overhead_us / 1000.0,
+               stats->collisions, stats->candidates, 100.0 * stats->dropped / MAX_MOMENTUM_NONCE);
+
+        if (completed++ == 0 && tables > 1) {
+            wall_start = getTimeHighRes();
+            continue;
+        }
+
+        hash_us += stats->hash_us;
+        seek_us += stats->seek_us;
+        revalidate_us += stats->revalidate_us;
+        overhead_us += stats->overhead_us;
+        candidates += stats->candidates;
+        collisions += stats->collisions;
+        dropped += stats->dropped;
+        measured++;
+    }
+
+    double avg_hash = hash_us / 1000.0 / measured;
+    double avg_seek = seek_us / 1000.0 / measured;
+    double avg_revalidate = revalidate_us / 1000.0 / measured;
+    double avg_overhead = overhead_us / 1000.0 / measured;
+    double avg_total = avg_hash + avg_seek + avg_revalidate + avg_overhead;
+
+    // Measured on the wall clock, the phases of a pipelined engine overlap
+    double avg_wall = metrics_elapsedMicroseconds(wall_start) / 1000.0 / measured;
+    double tables_per_min = (avg_wall > 0 ? 60000.0 / avg_wall : 0);
+    double collisions_per_table = (double)collisions / measured;
+    double drop_measured = (double)dropped / ((double)MAX_MOMENTUM_NONCE * measured);
+
+    printf("\n");
+    printf("Average over %d tables (%s pages):\n", measured, processor->table_pages);
+    printf("    Hash:       %8.1f ms\n", avg_hash);
+    printf("    Seek:       %8.1f ms\n", avg_seek);
+    printf("    Revalidate: %8.2f ms\n", avg_revalidate);
+    printf("    Overhead:   %8.2f ms\n", avg_overhead);
+    printf("    Total:      %8.1f ms\n", avg_total);
+    printf("    Wall clock: %8.1f ms (%.2f tables/min)\n", avg_wall, tables_per_min);
+    printf("    Collisions: %8.2f per table (%.2f/min)\n", collisions_per_table, collisions_per_table * tables_per_min);
+    printf("    Dropped:    %8.3f%% (estimated %.3f%%)\n", 100 * drop_measured, 100 * processor->estimated_drop_rate);
+    printf("\n");
+
+    // One line summary for scripts, keys are never removed or renamed
+    printf("BENCHMARK engine=%s sha512=%s sha256=%s threads=%d buckets_log2=%d tables=%d"
+           " hash_ms=%.1f seek_ms=%.1f overhead_ms=%.2f total_ms=%.1f tables_per_min=%.3f"
+           " candidates_per_table=%.3f collisions_per_table=%.3f drop_measured=%.6f drop_estimated=%.6f"
+           " revalidate_ms=%.2f wall_ms=%.1f pages=%s\n",
+           benchmark_engineName(), sha512_momentum_implementation(), sha256_implementation(), threads,
+           commandlineInput.buckets_log2, measured,
+           avg_hash, avg_seek, avg_overhead, avg_total, tables_per_min,
+           (double)candidates / measured, collisions_per_table, drop_measured, processor->estimated_drop_rate,
+           avg_revalidate, avg_wall, processor->table_pages);
+}
@@ -1,26 +1,23 @@
 #include"global.h"
 #include "ticker.h"
 #include "protoshareMiner.h"
+#include "sha512_momentum.h"
 #include <sstream>
 #include <cmath>
 #include <cstdlib>
+#include <algorithm>
 
 #include "momentumOpenCL.hpp"
 
-#define MAX_NONCE_BITS          ( 26 )
-#define MAX_MOMENTUM_NONCE      ( 1 << MAX_NONCE_BITS )
-#define SEARCH_SPACE_BITS       ( 50 )
-#define BIRTHDAYS_PER_HASH      ( 8 )
 // #define USE_SOURCE
-// #define MEASURE_TIME
 // #define VERIFY_RESULTS
 // #define NOSUBMIT
 
-uint32 totalOverhead   = 0;
-uint32 totalHashTime   = 0;
-uint32 totalResetTime  = 0;
 extern uint32 gpu_watchdog_max_wait;
 
+// The hash kernel is launched in slices, so a table of an old block can be abandoned in between
+#define OPENCL_HASH_SLICES      ( 8 )
+
 #define SWAP64(n)               \
     (  ((n)               << 56) \
     | (((n) & 0xff00)     << 40) \
@@ -34,151 +31,232 @@ extern uint32 gpu_watchdog_max_wait;
 
 extern commandlineInput_t commandlineInput;
 
-double factorial(uint32_t n)
-{
-    if (n == 0) { return 1; }
-
-    double rtn = n;
-
-    while (--n > 0) { rtn *= n; }
-
-    return rtn;
-}
-
 // Estimates the number of dropped records based on bucket size, number of buckets, and number of elements
 // https://en.wikipedia.org/wiki/Poisson_distribution
+// The probabilities are calculated in log space, so large buckets don't overflow
 double poisson_estimate(double buckets, double items, double bucket_size)
 {
     double total_drops = 0;
-    double f = factorial(bucket_size);
-    uint32 trials = (items / buckets) * 2;
+    double lambda = items / buckets;
+    uint32 trials = lambda * 2;
     trials = std::max(trials, (uint32)25);
 
     for (uint32_t i = bucket_size + 1; i < bucket_size + trials; i++) {
-        f *= i;
-
-        total_drops += (buckets * (i - bucket_size) * pow(items / buckets, (double)i))
-                       / (exp(items / buckets) * f);
+        total_drops += buckets * (i - bucket_size) * exp(i * log(lambda) - lambda - lgamma(i + 1.0));
     }
 
     return (total_drops / items);
 }
 
 
-size_t calc_hash_mem_usage(uint32 buckets_log2, uint32 bucket_size)  { return sizeof(cl_ulong) * ((uint64)1 << buckets_log2) * bucket_size; }
+size_t calc_hash_mem_usage(uint32 buckets_log2, uint32 bucket_size, uint32 entry_size) { return (size_t)entry_size * ((uint64)1 << buckets_log2) * bucket_size; }
 size_t calc_index_mem_usage(uint32 buckets_log2, uint32 bucket_size) { return sizeof(cl_uint) * ((uint64)1 << buckets_log2); }
 
-size_t calc_total_mem_usage(uint32 buckets_log2, uint32 bucket_size)
+size_t calc_total_mem_usage(uint32 buckets_log2, uint32 bucket_size, uint32 entry_size)
 {
-    return calc_hash_mem_usage(buckets_log2, bucket_size) + calc_index_mem_usage(buckets_log2, bucket_size);
+    return calc_hash_mem_usage(buckets_log2, bucket_size, entry_size) + calc_index_mem_usage(buckets_log2, bucket_size);
 }
 
+// Returns the largest bucket size that fits into target_mem megabytes, 0 if not even a single element fits
+uint32 calc_bucket_size(uint32 buckets_log2, uint32 target_mem, uint32 entry_size)
+{
+    // Convert target to bytes
+    uint64 target_mem_temp = ((uint64)target_mem * 1024 * 1024);
 
-bool protoshares_revalidateCollision(minerProtosharesBlock_t* block, uint8* midHash, uint32 indexA, uint32 indexB)
+    // Lazy calculation, assume large bucket_size, scale back from there
+    uint32 bucket_size = 1024;
+
+    while (bucket_size > 0 && calc_total_mem_usage(buckets_log2, bucket_size, entry_size) > target_mem_temp) { bucket_size--; }
+
+    return bucket_size;
+}
+
+// Expected number of compact entry pairs per table that share bucket and tag but not the birthday
+double calc_compact_false_positives(uint32 buckets_log2)
 {
-    uint8 tempHash[32 + 4];
-    uint64 resultHash[8];
-    memcpy(tempHash + 4, midHash, 32);
-    // get birthday A
-    *(uint32*)tempHash = indexA & ~7; // indexA & ~7 == indexA - (indexA % BIRTHDAYS_PER_HASH)
-    sha512_ctx c512;
-    sha512_init(&c512);
-    sha512_update(&c512, tempHash, 32 + 4);
-    sha512_final(&c512, (unsigned char*)resultHash);
-    uint64 birthdayA = resultHash[indexA & 7] >> (64ULL - SEARCH_SPACE_BITS);
-
-    // get birthday B
-    *(uint32*)tempHash = indexB & ~7;
-    sha512_init(&c512);
-    sha512_update(&c512, tempHash, 32 + 4);
-    sha512_final(&c512, (unsigned char*)resultHash);
-    uint64 birthdayB = resultHash[indexB & 7] >> (64ULL - SEARCH_SPACE_BITS);
+    double pairs = (double)MAX_MOMENTUM_NONCE * (MAX_MOMENTUM_NONCE - 1) / 2;
+    return pairs / pow(2.0, (double)(buckets_log2 + COMPACT_TAG_BITS));
+}
 
-#ifdef VERIFY_RESULTS
-    printf("Nonce Pair:\n");
-    printf("    Nonce A = %#010x; Hash A = %#018llx\n", indexA, birthdayA);
-    printf("    Nonce B = %#010x; Hash B = %#018llx\n", indexB, birthdayB);
-    printf("\n");
-#endif
+// SHA-512 work for false positives relative to hashing a table, every false positive costs two hashes
+double calc_compact_extra_hashing(uint32 buckets_log2)
+{
+    return 2 * calc_compact_false_positives(buckets_log2) / (MAX_MOMENTUM_NONCE / BIRTHDAYS_PER_HASH);
+}
+
+// Bucket count for compact entries that finds the most collisions per hashing work, 0 if no bucket holds a pair.
+// Fewer buckets leave room for more elements per bucket but match more tags by chance.
+uint32 calc_compact_buckets_log2(uint32 target_mem, uint32 bucket_size)
+{
+    uint32 best_log2 = 0;
+    double best_yield = 0.0;
+
+    for (uint32 buckets_log2 = 12; buckets_log2 <= MAX_NONCE_BITS; buckets_log2++) {
+        uint32 size = (target_mem > 0 ? calc_bucket_size(buckets_log2, target_mem, ENTRY_SIZE_COMPACT) : bucket_size);
+        if (size < 2) { continue; }
+
+        // A collision is found if neither of its elements was dropped
+        double kept = 1.0 - poisson_estimate((double)((uint64)1 << buckets_log2), MAX_MOMENTUM_NONCE, size);
+        double yield = kept * kept / (1.0 + calc_compact_extra_hashing(buckets_log2));
 
-    if ( birthdayA != birthdayB ) {
-        return false; // invalid collision
+        if (yield > best_yield) {
+            best_yield = yield;
+            best_log2 = buckets_log2;
+        }
     }
 
-    // birthday collision found
-    totalCollisionCount += 2; // we can use every collision twice -> A B and B A
-    //printf("Collision found %8d = %8d | num: %d\n", indexA, indexB, totalCollisionCount);
-    // get full block hash (for A B)
-    block->birthdayA = indexA;
-    block->birthdayB = indexB;
-    uint8 proofOfWorkHash[32];
-    sha256_ctx c256;
-    sha256_init(&c256);
-    sha256_update(&c256, (unsigned char*)block, 80 + 8);
-    sha256_final(&c256, proofOfWorkHash);
+    return best_log2;
+}
+
+
+// sha256(sha256(block)) over the first length bytes of the block, continues from the header midstate
+static void protoshares_hashHeader(minerProtosharesBlock_t* block, uint32 length, uint8* hashOut)
+{
+    sha256_ctx c256 = block->headerMidstate;
+    sha256_update(&c256, (unsigned char*)block + 64, length - 64);
+    sha256_final(&c256, hashOut);
+
     sha256_init(&c256);
-    sha256_update(&c256, (unsigned char*)proofOfWorkHash, 32);
-    sha256_final(&c256, proofOfWorkHash);
-    bool hashMeetsTarget = true;
+    sha256_update(&c256, hashOut, 32);
+    sha256_final(&c256, hashOut);
+}
+
+
+void protoshares_calculateMidHash(minerProtosharesBlock_t* block, uint32* midHash)
+{
+    // The first 64 bytes (version, prevBlockHash and most of merkleRoot) are the same for the
+    // whole table, only nTime, nBits, nonce and the birthdays of the share checks follow
+    sha256_init(&block->headerMidstate);
+    sha256_update(&block->headerMidstate, (unsigned char*)block, 64);
+
+    // midHash = sha256(sha256(block))
+    protoshares_hashHeader(block, 80, (uint8*)midHash);
+}
+
+
+static bool protoshares_meetsShareTarget(minerProtosharesBlock_t* block, uint8* proofOfWorkHash)
+{
     uint32* generatedHash32 = (uint32*)proofOfWorkHash;
     uint32* targetHash32 = (uint32*)block->targetShare;
 
     for (sint32 hc = 7; hc >= 0; hc--) {
         if ( generatedHash32[hc] < targetHash32[hc] ) {
-            hashMeetsTarget = true;
-            break;
+            return true;
         } else if ( generatedHash32[hc] > targetHash32[hc] ) {
-            hashMeetsTarget = false;
-            break;
+            return false;
         }
     }
 
-    if ( hashMeetsTarget ) {
-        totalShareCount++;
-        curShareCount++;
+    return true;
+}
+
+
+// Checks a verified birthday collision against the share target, both as A B and B A
+static void protoshares_submitCollision(minerProtosharesBlock_t* block, uint32 indexA, uint32 indexB)
+{
+    // birthday collision found
+    totalCollisionCount += 2; // we can use every collision twice -> A B and B A
+    //printf("Collision found %8d = %8d | num: %d\n", indexA, indexB, totalCollisionCount);
+    uint32 orders[2][2] = { { indexA, indexB }, { indexB, indexA } };
+    uint8 proofOfWorkHash[32];
+
+    for (uint32 i = 0; i < 2; i++) {
+        // get full block hash
+        block->birthdayA = orders[i][0];
+        block->birthdayB = orders[i][1];
+        protoshares_hashHeader(block, 80 + 8, proofOfWorkHash);
+
+        if ( protoshares_meetsShareTarget(block, proofOfWorkHash) ) {
+            totalShareCount++;
+            curShareCount++;
 #ifndef NOSUBMIT
-        xptMiner_submitShare(block);
+            xptMiner_submitShare(block);
 #endif
+        }
     }
+}
 
-    // get full block hash (for B A)
-    block->birthdayA = indexB;
-    block->birthdayB = indexA;
-    sha256_init(&c256);
-    sha256_update(&c256, (unsigned char*)block, 80 + 8);
-    sha256_final(&c256, proofOfWorkHash);
-    sha256_init(&c256);
-    sha256_update(&c256, (unsigned char*)proofOfWorkHash, 32);
-    sha256_final(&c256, proofOfWorkHash);
-    hashMeetsTarget = true;
-    generatedHash32 = (uint32*)proofOfWorkHash;
-    targetHash32 = (uint32*)block->targetShare;
 
-    for (sint32 hc = 7; hc >= 0; hc--) {
-        if ( generatedHash32[hc] < targetHash32[hc] ) {
-            hashMeetsTarget = true;
-            break;
-        } else if ( generatedHash32[hc] > targetHash32[hc] ) {
-            hashMeetsTarget = false;
-            break;
+bool protoshares_revalidateCollision(minerProtosharesBlock_t* block, uint8* midHash, uint32 indexA, uint32 indexB)
+{
+    return protoshares_revalidateCollisions(block, midHash, &indexA, &indexB, 1) == 1;
+}
+
+
+// Revalidates all collisions reported by an engine, returns the number of valid ones.
+// Pairs often share nonce groups (indexA & ~7), so the distinct groups of a batch are collected
+// first and hashed with a single sha512_momentum() call that keeps all SIMD lanes busy.
+uint32 protoshares_revalidateCollisions(minerProtosharesBlock_t* block, uint8* midHash, const uint32* indexA, const uint32* indexB, uint32 count)
+{
+    uint32 nonceGroups[2 * REVALIDATE_BATCH_SIZE];
+    uint64 birthdays[2 * REVALIDATE_BATCH_SIZE * BIRTHDAYS_PER_HASH];
+    uint32 valid = 0;
+
+    for (uint32 first = 0; first < count; first += REVALIDATE_BATCH_SIZE) {
+        uint32 batch = std::min(count - first, (uint32)REVALIDATE_BATCH_SIZE);
+
+        // get birthdays of all distinct nonce groups
+        for (uint32 i = 0; i < batch; i++) {
+            nonceGroups[2 * i + 0] = indexA[first + i] & ~7; // indexA & ~7 == indexA - (indexA % BIRTHDAYS_PER_HASH)
+            nonceGroups[2 * i + 1] = indexB[first + i] & ~7;
         }
-    }
 
-    if ( hashMeetsTarget ) {
-        totalShareCount++;
-        curShareCount++;
-#ifndef NOSUBMIT
-        xptMiner_submitShare(block);
+        std::sort(nonceGroups, nonceGroups + 2 * batch);
+        uint32 groups = (uint32)(std::unique(nonceGroups, nonceGroups + 2 * batch) - nonceGroups);
+        sha512_momentum(midHash, nonceGroups, groups, birthdays);
+
+        for (uint32 i = 0; i < batch; i++) {
+            uint32 a = indexA[first + i];
+            uint32 b = indexB[first + i];
+            uint32 groupA = (uint32)(std::lower_bound(nonceGroups, nonceGroups + groups, a & ~7) - nonceGroups);
+            uint32 groupB = (uint32)(std::lower_bound(nonceGroups, nonceGroups + groups, b & ~7) - nonceGroups);
+            uint64 birthdayA = birthdays[groupA * BIRTHDAYS_PER_HASH + (a & 7)];
+            uint64 birthdayB = birthdays[groupB * BIRTHDAYS_PER_HASH + (b & 7)];
+
+#ifdef VERIFY_RESULTS
+            printf("Nonce Pair:\n");
+            printf("    Nonce A = %#010x; Hash A = %#018llx\n", a, birthdayA);
+            printf("    Nonce B = %#010x; Hash B = %#018llx\n", b, birthdayB);
+            printf("\n");
 #endif
+
+            if ( birthdayA != birthdayB ) {
+                continue; // invalid collision
+            }
+
+            protoshares_submitCollision(block, a, b);
+            valid++;
+        }
     }
 
-    return true;
+    return valid;
+}
+
+
+// Adds the last table of an engine to its histograms, called by the miner thread
+void protoshares_recordTableMetrics(ProtoshareProcessor* processor, uint32 table_us)
+{
+    metricsDevice_t* metrics = processor->metrics;
+    protoshareTableStats_t* stats = &processor->stats;
+
+    // Partial tables would skew the histograms, only the time spent on them matters
+    if (stats->aborted) {
+        metrics_recordAbort(metrics, stats->hash_us + stats->seek_us + stats->revalidate_us + stats->overhead_us);
+        return;
+    }
+
+    metrics_record(&metrics->phase[METRICS_PHASE_TABLE], table_us);
+    metrics_record(&metrics->phase[METRICS_PHASE_HASH], stats->hash_us);
+    metrics_record(&metrics->phase[METRICS_PHASE_SEEK], stats->seek_us);
+    metrics_record(&metrics->phase[METRICS_PHASE_REVALIDATE], stats->revalidate_us);
+    metrics_record(&metrics->phase[METRICS_PHASE_OVERHEAD], stats->overhead_us);
 }
 
 
 ProtoshareOpenCL::ProtoshareOpenCL(int _device_num)
 {
     this->device_num = _device_num;
+    this->table_pages = "device";
 
     printf("Initializing GPU %d\n", device_num);
     OpenCLMain &main = OpenCLMain::getInstance();
@@ -210,13 +288,7 @@ ProtoshareOpenCL::ProtoshareOpenCL(int _device_num)
 
     // If set, convert target memory into a usable value for bucket_size
     if (target_mem > 0) {
-        // Convert target to bytes, subtract 1 to guarantee results LESS THAN target
-        uint32 target_mem_temp = (target_mem * 1024 * 1024);
-
-        // Lazy calculation, assume large bucket_size, scale back from there
-        bucket_size = 1024;
-
-        while (bucket_size > 0 && calc_total_mem_usage(buckets_log2, bucket_size) > target_mem_temp) { bucket_size--; }
+        bucket_size = calc_bucket_size(buckets_log2, target_mem);
 
         // Make sure the parameter configuration is sane:
         if (bucket_size < 1) {
@@ -266,14 +338,11 @@ ProtoshareOpenCL::ProtoshareOpenCL(int _device_num)
     printf("Using 2^%d buckets\n", buckets_log2);
     printf("Using %d elements per bucket\n", bucket_size);
     printf("Using %d MB of memory\n", required_mem / 1024 / 1024);
-    printf("Estimated drop percentage: %5.2f%%\n", 100 * poisson_estimate((1 << buckets_log2), MAX_MOMENTUM_NONCE, bucket_size));
+    estimated_drop_rate = poisson_estimate((1 << buckets_log2), MAX_MOMENTUM_NONCE, bucket_size);
+    printf("Estimated drop percentage: %5.2f%%\n", 100 * estimated_drop_rate);
     printf("\n");
 
 
-    // Compile the OpenCL code
-    printf("Compiling OpenCL code... this may take 3-5 minutes\n");
-
-
     bool isGPU = device->isGPU();
     if (!isGPU) { gpu_watchdog_max_wait *= 6; } // Effectively disable the watchdog
 
@@ -285,53 +354,49 @@ ProtoshareOpenCL::ProtoshareOpenCL(int _device_num)
     params << " -D NUM_BUCKETS_LOG2=" << buckets_log2;
     params << " -D BUCKET_SIZE=" << bucket_size;
 
+    // Compile the OpenCL code, the embedded source can be loaded from the binary cache instead
 #ifdef USE_SOURCE
+    printf("Compiling OpenCL code... this may take 3-5 minutes\n");
     std::vector<std::string> file_list;
     file_list.push_back("opencl/momentum.cl");
     OpenCLProgram* program = device->getContext()->loadProgramFromFiles(file_list, params.str());
 #else
     std::vector<std::string> input_src;
     input_src.push_back(getMomentumOpenCL());
-    OpenCLProgram* program = device->getContext()->loadProgramFromStrings(input_src, params.str());
+    OpenCLProgram* program = device->getContext()->loadProgramFromStrings(input_src, params.str(), commandlineInput.cl_cache_dir);
 #endif
 
     kernel_hash   = program->getKernel("hash_step");
     kernel_reset  = program->getKernel("reset_and_seek");
 
-    mid_hash = device->getContext()->createBuffer(32 * sizeof(cl_uint), CL_MEM_READ_ONLY, NULL);
-
     hash_list  = device->getContext()->createBuffer(calc_hash_mem_usage(buckets_log2, bucket_size), CL_MEM_READ_WRITE, NULL);
     index_list = device->getContext()->createBuffer(calc_index_mem_usage(buckets_log2, bucket_size), CL_MEM_READ_WRITE, NULL);
 
-    nonce_a = device->getContext()->createBuffer(256 * sizeof(cl_uint), CL_MEM_WRITE_ONLY, NULL);
-    nonce_b = device->getContext()->createBuffer(256 * sizeof(cl_uint), CL_MEM_WRITE_ONLY, NULL);
-    nonce_qty = device->getContext()->createBuffer(sizeof(cl_uint), CL_MEM_READ_WRITE, NULL);
+    for (uint32 set = 0; set < 2; set++) {
+        nonce_a[set] = device->getContext()->createBuffer(256 * sizeof(cl_uint), CL_MEM_WRITE_ONLY, NULL);
+        nonce_b[set] = device->getContext()->createBuffer(256 * sizeof(cl_uint), CL_MEM_WRITE_ONLY, NULL);
+        nonce_qty[set] = device->getContext()->createBuffer(sizeof(cl_uint), CL_MEM_READ_WRITE, NULL);
+    }
 
-    q = device->getContext()->createCommandQueue(device);
-}
+    // Pipelined tables are timed by the device, the host only sees the waiting time
+    this->pipelined = (commandlineInput.opencl_pipeline != 0);
+    this->pipeline_set = 0;
+    memset(pipeline, 0x00, sizeof(pipeline));
 
+    q = device->getContext()->createCommandQueue(device, pipelined ? CL_QUEUE_PROFILING_ENABLE : 0);
+    if (pipelined) { printf("Using pipelined tables\n"); }
 
-void ProtoshareOpenCL::protoshare_process(minerProtosharesBlock_t* block)
-{
+    char name[32];
+    sprintf(name, "gpu%d", device_num);
+    metrics = metrics_registerDevice(name);
+}
 
-#ifdef MEASURE_TIME
-    uint32 overhead = getTimeMilliseconds();
-#endif
 
+// Calculates the mid hash of a block and passes it to the hash kernel
+void ProtoshareOpenCL::prepare_hash(minerProtosharesBlock_t* block, uint32* midHash)
+{
     block->nonce = 0;
-    uint32 target = *(uint32*)(block->targetShare + 28);
-    // OpenCLDevice* device = OpenCLMain::getInstance().getDevice(device_num);
-
-    uint32 midHash[8];
-    // midHash = sha256(sha256(block))
-    sha256_ctx c256;
-    sha256_init(&c256);
-    sha256_update(&c256, (unsigned char*)block, 80);
-    sha256_final(&c256, (unsigned char*)midHash);
-
-    sha256_init(&c256);
-    sha256_update(&c256, (unsigned char*)midHash, 32);
-    sha256_final(&c256, (unsigned char*)midHash);
+    protoshares_calculateMidHash(block, midHash);
 
     union { cl_ulong b64[16]; cl_uint b32[32]; } hash_state;
     hash_state.b32[0] = 0; // Reserved for nonce
@@ -348,14 +413,7 @@ void ProtoshareOpenCL::protoshare_process(minerProtosharesBlock_t* block)
     // Swap the non-zero b64's except the first (so we can mix in the nonce later)
     for (uint8 i = 1; i < 5; ++i) { hash_state.b64[i] = SWAP64(hash_state.b64[i]); }
 
-
-#ifdef MEASURE_TIME
-    printf("Hashing...\n");
-    uint32 begin = getTimeMilliseconds();
-#endif
-
-
-    // Calculate all hashes
+    // The kernel arguments are copied when the kernel is enqueued
     kernel_hash->resetArgs();
 
     kernel_hash->addScalarULong(hash_state.b64[0]);
@@ -365,68 +423,182 @@ void ProtoshareOpenCL::protoshare_process(minerProtosharesBlock_t* block)
     kernel_hash->addScalarULong(hash_state.b64[4]);
     kernel_hash->addGlobalArg(hash_list);
     kernel_hash->addGlobalArg(index_list);
+}
 
-    q->enqueueWriteBuffer(mid_hash, hash_state.b32, 10 * sizeof(cl_uint));
 
-    q->enqueueKernel1D(kernel_hash, MAX_MOMENTUM_NONCE / BIRTHDAYS_PER_HASH / vect_type, wgs);
+// Runs the hash kernel one slice after another, keeping the next slice queued.
+// Returns false if the work became stale, the index list still has to be reset then.
+bool ProtoshareOpenCL::run_hash_slices()
+{
+    size_t slice = MAX_MOMENTUM_NONCE / BIRTHDAYS_PER_HASH / vect_type / OPENCL_HASH_SLICES;
+    cl_event events[OPENCL_HASH_SLICES];
 
-#ifdef MEASURE_TIME
-    q->finish();
-    printf("Resetting...\n");
-    uint32 hash_end = getTimeMilliseconds();
-#endif
+    q->enqueueKernel1DRange(kernel_hash, 0, slice, wgs, &events[0]);
 
-    // Reset index list and find collisions
-    cl_uint result_qty = 0;
-    cl_uint result_a[256];
-    cl_uint result_b[256];
+    for (uint32 i = 1; i < OPENCL_HASH_SLICES; i++) {
+        q->enqueueKernel1DRange(kernel_hash, i * slice, slice, wgs, &events[i]);
+        q->flush();
+        waitForEvent(events[i - 1]);
+
+        if (is_stale()) {
+            waitForEvent(events[i]);
+            return false;
+        }
+    }
+
+    waitForEvent(events[OPENCL_HASH_SLICES - 1]);
+    return true;
+}
+
+
+// Enqueues the kernel that finds collisions and resets the index list, results go to the given buffer set
+void ProtoshareOpenCL::enqueue_seek(uint32 set, cl_event* event)
+{
+    // Must outlive the non-blocking write
+    static cl_uint zero_qty = 0;
 
     kernel_reset->resetArgs();
     kernel_reset->addGlobalArg(hash_list);
     kernel_reset->addGlobalArg(index_list);
-    kernel_reset->addGlobalArg(nonce_a);
-    kernel_reset->addGlobalArg(nonce_b);
-    kernel_reset->addGlobalArg(nonce_qty);
+    kernel_reset->addGlobalArg(nonce_a[set]);
+    kernel_reset->addGlobalArg(nonce_b[set]);
+    kernel_reset->addGlobalArg(nonce_qty[set]);
 
-    q->enqueueWriteBuffer(nonce_qty, &result_qty, sizeof(cl_uint));
+    q->enqueueWriteBuffer(nonce_qty[set], &zero_qty, sizeof(cl_uint));
+    q->enqueueKernel1D(kernel_reset, (1 << buckets_log2), wgs, event);
+}
 
-    q->enqueueKernel1D(kernel_reset, (1 << buckets_log2), wgs);
 
-    q->enqueueReadBuffer(nonce_a,   result_a,    sizeof(cl_uint) * 256);
-    q->enqueueReadBuffer(nonce_b,   result_b,    sizeof(cl_uint) * 256);
-    q->enqueueReadBuffer(nonce_qty, &result_qty, sizeof(cl_uint));
+void ProtoshareOpenCL::protoshare_process(minerProtosharesBlock_t* block)
+{
+    if (pipelined) {
+        process_pipelined(block);
+        return;
+    }
 
-    q->finish();
+    uint64 start_time = getTimeHighRes();
+    uint32 midHash[8];
 
-#ifdef MEASURE_TIME
-    uint32 end = getTimeMilliseconds();
-    uint32 warmup_skips = 3;
+    work_epoch = block->epoch;
+    stats.aborted = false;
 
-    if (totalTableCount > warmup_skips) { // Allow some warmup time
-        totalOverhead   += (begin - overhead);
-        totalHashTime   += (hash_end - begin);
-        totalResetTime  += (end - hash_end);
+    // Calculate all hashes
+    uint64 phase_start = getTimeHighRes();
+    prepare_hash(block, midHash);
+    bool completed = run_hash_slices();
+    stats.hash_us = metrics_elapsedMicroseconds(phase_start);
+
+    if (!completed) {
+        // The seek kernel is the only thing that clears the bucket counters, its results are ignored
+        phase_start = getTimeHighRes();
+        enqueue_seek(0, NULL);
+        q->finish();
+        stats.seek_us = metrics_elapsedMicroseconds(phase_start);
+
+        stats.aborted = true;
+        stats.candidates = 0;
+        stats.collisions = 0;
+        stats.revalidate_us = 0;
+        stats.overhead_us = metrics_elapsedMicroseconds(start_time) - stats.hash_us - stats.seek_us;
+        return;
     }
 
-    printf("Found %2d collisions in %4d ms (Hash: %4d ms, Reset: %4d ms, Overhead: %4d)\n",
-           result_qty * 2,
-           (end - begin),
-           (hash_end - begin),
-           (end - hash_end),
-           (begin - overhead));
-
-    if (totalTableCount > 0 && totalTableCount % 10 == 0) {
-        printf("\nAVG TIMES - Total: %4d, Hash: %4d, Reset: %4d, Overhead: %4d\n\n",
-               (totalHashTime + totalResetTime) / (totalTableCount - warmup_skips),
-               totalHashTime   / (totalTableCount - warmup_skips),
-               totalResetTime  / (totalTableCount - warmup_skips),
-               totalOverhead   / (totalTableCount - warmup_skips));
-    }
-#endif
+    // The bucket counters are cleared by the seek kernel, so they can only be checked in between
+    if (commandlineInput.benchmark_tables > 0) {
+        std::vector<cl_uint> counters((size_t)1 << buckets_log2);
+        q->enqueueReadBuffer(index_list, &counters[0], calc_index_mem_usage(buckets_log2, bucket_size));
+        q->finish();
 
-    for (uint32 i = 0; i < result_qty; i++) {
-        protoshares_revalidateCollision(block, (uint8 *)midHash, result_a[i], result_b[i]);
+        uint32 stored = 0;
+        for (size_t i = 0; i < counters.size(); i++) { stored += std::min(counters[i], (cl_uint)bucket_size); }
+        stats.dropped = MAX_MOMENTUM_NONCE - stored;
     }
 
+    // Reset index list and find collisions
+    cl_uint result_qty = 0;
+    cl_uint result_a[256];
+    cl_uint result_b[256];
+
+    phase_start = getTimeHighRes();
+    enqueue_seek(0, NULL);
+
+    q->enqueueReadBuffer(nonce_a[0],   result_a,    sizeof(cl_uint) * 256);
+    q->enqueueReadBuffer(nonce_b[0],   result_b,    sizeof(cl_uint) * 256);
+    q->enqueueReadBuffer(nonce_qty[0], &result_qty, sizeof(cl_uint));
+
+    q->finish();
+    stats.seek_us = metrics_elapsedMicroseconds(phase_start);
+
+    phase_start = getTimeHighRes();
+    stats.candidates = result_qty;
+    stats.collisions = protoshares_revalidateCollisions(block, (uint8 *)midHash, result_a, result_b, result_qty);
+    stats.revalidate_us = metrics_elapsedMicroseconds(phase_start);
+    stats.overhead_us = metrics_elapsedMicroseconds(start_time) - stats.hash_us - stats.seek_us - stats.revalidate_us;
+
     totalTableCount++;
-}
\ No newline at end of file
+}
+
+
+// Enqueues the whole table without waiting for it, then completes the table enqueued by the previous call.
+// The in-order queue keeps the tables from overlapping on the device since they share hash_list and index_list.
+void ProtoshareOpenCL::process_pipelined(minerProtosharesBlock_t* block)
+{
+    uint64 start_time = getTimeHighRes();
+    uint32 set = pipeline_set;
+    openclPipelineTable_t* table = &pipeline[set];
+
+    // The miner thread reuses its block for the next work, so revalidation needs a copy
+    memcpy(&table->block, block, sizeof(minerProtosharesBlock_t));
+
+    prepare_hash(&table->block, table->mid_hash);
+    q->enqueueKernel1D(kernel_hash, MAX_MOMENTUM_NONCE / BIRTHDAYS_PER_HASH / vect_type, wgs, &table->hash_done);
+    enqueue_seek(set, &table->seek_done);
+
+    q->enqueueReadBuffer(nonce_a[set],   table->result_a,    sizeof(cl_uint) * 256);
+    q->enqueueReadBuffer(nonce_b[set],   table->result_b,    sizeof(cl_uint) * 256);
+    q->enqueueReadBuffer(nonce_qty[set], &table->result_qty, sizeof(cl_uint), &table->read_done);
+    q->flush();
+
+    table->pending = true;
+    table->enqueue_us = metrics_elapsedMicroseconds(start_time);
+
+    pipeline_set ^= 1;
+    if (pipeline[pipeline_set].pending) { complete_table(pipeline_set); }
+}
+
+
+// Waits for the results of a pipelined table and revalidates them.
+// The hash and seek timings are the kernel execution times reported by the device.
+void ProtoshareOpenCL::complete_table(uint32 set)
+{
+    openclPipelineTable_t* table = &pipeline[set];
+
+    waitForEvent(table->read_done);
+
+    stats.hash_us = (uint32)(getEventDuration(table->hash_done) / 1000);
+    stats.seek_us = (uint32)(getEventDuration(table->seek_done) / 1000);
+    clReleaseEvent(table->hash_done);
+    clReleaseEvent(table->seek_done);
+
+    // Enqueued tables run to the end, but the collisions of an old block aren't worth revalidating
+    uint64 phase_start = getTimeHighRes();
+    stats.aborted = (table->block.epoch != workEpoch);
+    stats.candidates = table->result_qty;
+    stats.collisions = 0;
+    if (!stats.aborted) {
+        stats.collisions = protoshares_revalidateCollisions(&table->block, (uint8 *)table->mid_hash, table->result_a, table->result_b, table->result_qty);
+    }
+    stats.revalidate_us = metrics_elapsedMicroseconds(phase_start);
+    stats.overhead_us = (uint32)table->enqueue_us;
+    stats.dropped = 0; // the bucket counters are never read back in this mode
+
+    table->pending = false;
+    if (!stats.aborted) { totalTableCount++; }
+}
+
+
+void ProtoshareOpenCL::protoshare_flush()
+{
+    uint32 set = pipeline_set ^ 1;
+    if (pipeline[set].pending) { complete_table(set); }
+}
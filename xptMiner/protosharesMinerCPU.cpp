@@ -0,0 +1,828 @@
+#include "global.h"
+#include "ticker.h"
+#include "protoshareMiner.h"
+#include "sha512_momentum.h"
+#include "affinity.h"
+#include "hugePages.h"
+#include <cmath>
+
+// Work item granularity, small enough to balance the load and large enough to keep locking cost negligible
+#define CPU_HASH_CHUNK_BITS     ( 16 )
+#define CPU_SEEK_CHUNK_BITS     ( 12 )
+
+// Nonce groups hashed per sha512_momentum() call
+#define CPU_HASH_BATCH          ( 64 )
+
+// Compact entry candidates recalculated per sha512_momentum() call
+#define CPU_VERIFY_BATCH        ( 32 )
+
+// Used when neither "-s" nor "-m" is given
+#define CPU_DEFAULT_TARGET_MEM  ( 1024 )
+
+// Bucket strategy: index slots hold the generation of the table that wrote them in the top bits and the
+// element count below. Slots of an older generation count as empty, so the seek never writes to the index.
+// The index is only cleared when the generation wraps around.
+#define CPU_INDEX_GENERATION_BITS ( 8 )
+#define CPU_INDEX_COUNT_BITS    ( 32 - CPU_INDEX_GENERATION_BITS )
+#define CPU_INDEX_COUNT_MASK    ( (1 << CPU_INDEX_COUNT_BITS) - 1 )
+
+// Sort strategy: the top bits of a birthday select its partition, the remaining
+// ENTRY_BIRTHDAY_BITS are stored above the nonce so a key fits into 64 bits
+#define CPU_SORT_PARTITION_BITS ( SEARCH_SPACE_BITS - ENTRY_BIRTHDAY_BITS )
+#define CPU_SORT_PARTITIONS     ( 1 << CPU_SORT_PARTITION_BITS )
+#define CPU_SORT_CHUNK_BITS     ( 18 )
+#define CPU_SORT_SEEK_PARTITIONS ( 16 )
+#define CPU_SORT_RADIX_BITS     ( 8 )
+
+// Filter strategy: used when "-m" is not given, and the search range of the round count and filter size
+#define CPU_FILTER_DEFAULT_MEM  ( 64 )
+#define CPU_FILTER_MAX_ROUNDS_LOG2 ( 6 )
+#define CPU_FILTER_MIN_BITS     ( 16 )
+#define CPU_FILTER_MAX_BITS     ( 31 )
+
+extern commandlineInput_t commandlineInput;
+extern uint32 gpu_watchdog_max_wait;
+
+
+ProtoshareCPU::ProtoshareCPU(uint32 num_threads)
+{
+    printf("Initializing CPU engine with %d threads\n", num_threads);
+
+    this->strategy = commandlineInput.cpu_strategy;
+    this->entry_size = commandlineInput.entry_size;
+    this->buckets_log2 = commandlineInput.buckets_log2;
+    this->bucket_size = commandlineInput.bucket_size;
+    this->target_mem = commandlineInput.target_mem;
+
+    // With -affinity every pool thread gets its own CPU and the miner thread (pool thread 0) takes the first one
+    std::vector<uint32> pool_cpus;
+
+    if (commandlineInput.affinity) {
+        pool_cpus = affinity_getAllCpus();
+        thread_cpus.push_back(pool_cpus[0]);
+    }
+
+    pool = new WorkerPool(num_threads, pool_cpus);
+
+    printf("Using %s SHA-512\n", sha512_momentum_implementation());
+
+    if (strategy == PROTOSHARE_CPU_SORT) {
+        init_sort();
+    } else if (strategy == PROTOSHARE_CPU_FILTER) {
+        init_filter();
+    } else {
+        init_bucket();
+    }
+
+    metrics = metrics_registerDevice("cpu");
+
+    // A CPU needs a lot longer per table than a GPU
+    gpu_watchdog_max_wait *= 6;
+}
+
+
+void ProtoshareCPU::init_bucket()
+{
+    if (target_mem == 0 && bucket_size == 0) {
+        target_mem = CPU_DEFAULT_TARGET_MEM;
+    }
+
+    // Only compact entries leave the bucket count open, it's traded against the false positives of the tags
+    if (buckets_log2 == 0) {
+        buckets_log2 = calc_compact_buckets_log2(target_mem, bucket_size);
+
+        if (buckets_log2 == 0) {
+            printf("ERROR: Compact entries cannot hold a pair per bucket with a memory target of %d MB!\n", target_mem);
+            printf("       Please increase the value of \"-m\".\n");
+            exit(0);
+        }
+
+        commandlineInput.buckets_log2 = buckets_log2;
+    }
+
+    if (target_mem > 0) {
+        bucket_size = calc_bucket_size(buckets_log2, target_mem, entry_size);
+    }
+
+    // A bucket that can't hold a pair never yields a collision
+    if (bucket_size < 2) {
+        printf("ERROR: Memory target of %d MB leaves less than 2 elements per bucket with 2^%d buckets!\n", target_mem, buckets_log2);
+        printf("       Please lower the value of \"-b\" or increase the value of \"-m\" or \"-s\".\n");
+        exit(0);
+    }
+
+    size_t required_mem = calc_total_mem_usage(buckets_log2, bucket_size, entry_size);
+
+    hash_list = NULL;
+    compact_list = NULL;
+    if (entry_size == ENTRY_SIZE_COMPACT) {
+        compact_list = (uint32*)hugePages_alloc(calc_hash_mem_usage(buckets_log2, bucket_size, entry_size), &table_pages);
+    } else {
+        hash_list = (uint64*)hugePages_alloc(calc_hash_mem_usage(buckets_log2, bucket_size, entry_size), &table_pages);
+    }
+    const char* index_pages;
+    index_list = (volatile uint32*)hugePages_alloc(((size_t)1 << buckets_log2) * sizeof(uint32), &index_pages);
+    index_generation = 0; // never current, the zeroed index starts out empty
+
+    if ((hash_list == NULL && compact_list == NULL) || index_list == NULL) {
+        printf("ERROR: Cannot allocate 2^%d buckets of %d elements (%d MB)!\n", buckets_log2, bucket_size, (uint32)(required_mem / 1024 / 1024));
+        printf("       Please lower the value of \"-b\" or \"-s\" or \"-m\".\n");
+        exit(0);
+    }
+
+    printf("Using 2^%d buckets\n", buckets_log2);
+    printf("Using %d elements per bucket\n", bucket_size);
+    printf("Using %d MB of memory (%s pages)\n", (uint32)(required_mem / 1024 / 1024), table_pages);
+    estimated_drop_rate = poisson_estimate((1 << buckets_log2), MAX_MOMENTUM_NONCE, bucket_size);
+    printf("Estimated drop percentage: %5.2f%%\n", 100 * estimated_drop_rate);
+
+    if (entry_size == ENTRY_SIZE_COMPACT) {
+        printf("Using %d bit entries with %d bit tags\n", ENTRY_SIZE_COMPACT * 8, COMPACT_TAG_BITS);
+        printf("Expected false positives per table: %.0f (%.1f%% extra hashing)\n", calc_compact_false_positives(buckets_log2), 100 * calc_compact_extra_hashing(buckets_log2));
+        if (calc_compact_extra_hashing(buckets_log2) > COMPACT_MAX_EXTRA_HASHING) {
+            printf("WARNING: Leave \"-b\" unset to let compact entries pick a bucket count with less extra hashing.\n");
+        }
+    }
+    printf("\n");
+}
+
+
+// Memory used by the sort strategy, the birthday list is only kept if it fits
+static size_t calc_sort_mem_usage(bool rehash)
+{
+    size_t mem = (size_t)MAX_MOMENTUM_NONCE * sizeof(uint64);
+    mem += (size_t)(MAX_MOMENTUM_NONCE >> CPU_SORT_CHUNK_BITS) * CPU_SORT_PARTITIONS * sizeof(uint32);
+
+    if (!rehash) {
+        mem += (size_t)MAX_MOMENTUM_NONCE * sizeof(uint64);
+    }
+
+    return mem;
+}
+
+
+void ProtoshareCPU::init_sort()
+{
+    // Without a memory target, trade memory for hashing speed
+    sort_rehash = (target_mem > 0 && (uint64)target_mem * 1024 * 1024 < calc_sort_mem_usage(false));
+
+    size_t required_mem = calc_sort_mem_usage(sort_rehash);
+
+    if (target_mem > 0 && (uint64)target_mem * 1024 * 1024 < required_mem) {
+        printf("ERROR: The sort strategy needs at least %d MB of memory!\n", (uint32)(required_mem / 1024 / 1024));
+        printf("       Please increase the value of \"-m\" or use \"-c bucket\".\n");
+        exit(0);
+    }
+
+    sort_birthdays = NULL;
+    if (!sort_rehash) {
+        const char* birthday_pages;
+        sort_birthdays = (uint64*)hugePages_alloc((size_t)MAX_MOMENTUM_NONCE * sizeof(uint64), &birthday_pages);
+    }
+
+    sort_keys = (uint64*)hugePages_alloc((size_t)MAX_MOMENTUM_NONCE * sizeof(uint64), &table_pages);
+    sort_offsets = (uint32*)malloc((size_t)(MAX_MOMENTUM_NONCE >> CPU_SORT_CHUNK_BITS) * CPU_SORT_PARTITIONS * sizeof(uint32));
+    sort_partition_start = (uint32*)malloc((CPU_SORT_PARTITIONS + 1) * sizeof(uint32));
+
+    if ((!sort_rehash && sort_birthdays == NULL) || sort_keys == NULL || sort_offsets == NULL || sort_partition_start == NULL) {
+        printf("ERROR: Cannot allocate %d MB for the sort strategy!\n", (uint32)(required_mem / 1024 / 1024));
+        printf("       Please lower the value of \"-m\" or use \"-c bucket\".\n");
+        exit(0);
+    }
+
+    // Grown in protoshare_process() if a partition turns out bigger
+    sort_scratch_size = (MAX_MOMENTUM_NONCE / CPU_SORT_PARTITIONS) * 5 / 4;
+    sort_scratch.resize(pool->getNumThreads());
+    for (uint32 i = 0; i < sort_scratch.size(); i++) {
+        sort_scratch[i] = (uint64*)malloc(sort_scratch_size * sizeof(uint64));
+        if (sort_scratch[i] == NULL) {
+            printf("ERROR: Cannot allocate sort buffers!\n");
+            exit(0);
+        }
+    }
+
+    printf("Using %d partitions (sort)\n", CPU_SORT_PARTITIONS);
+    printf("Using %d MB of memory (%s pages)\n", (uint32)(required_mem / 1024 / 1024), table_pages);
+    if (sort_rehash) {
+        printf("Hashing every nonce twice to fit into %d MB\n", target_mem);
+    }
+    printf("Estimated drop percentage:  0.00%%\n");
+
+    // What the bucket table would do with the same amount of memory
+    uint32 compare_mem = (uint32)(required_mem / 1024 / 1024);
+    uint32 compare_size = calc_bucket_size(buckets_log2, compare_mem);
+    if (compare_size > 0) {
+        printf("Bucket table with %d MB: 2^%d buckets of %d elements, %5.2f%% dropped\n",
+            compare_mem, buckets_log2, compare_size,
+            100 * poisson_estimate((1 << buckets_log2), MAX_MOMENTUM_NONCE, compare_size));
+    }
+    printf("\n");
+}
+
+
+// Expected number of birthdays per round whose filter slot is hit at least twice
+static double calc_filter_survivors(uint32 rounds_log2, uint32 filter_bits)
+{
+    double items = (double)(MAX_MOMENTUM_NONCE >> rounds_log2);
+    return items * (1 - exp(-items / pow(2.0, (double)filter_bits)));
+}
+
+static uint32 calc_filter_capacity(uint32 rounds_log2, uint32 filter_bits)
+{
+    return (uint32)(calc_filter_survivors(rounds_log2, filter_bits) * 1.25) + 4096;
+}
+
+// Two rounds in flight, each with a "seen once" and a "seen twice" bitmap, plus the survivor list
+static size_t calc_filter_mem_usage(uint32 rounds_log2, uint32 filter_bits)
+{
+    return ((size_t)1 << filter_bits) / 8 * 4 + (size_t)calc_filter_capacity(rounds_log2, filter_bits) * sizeof(filterSurvivor_t);
+}
+
+
+void ProtoshareCPU::init_filter()
+{
+    if (target_mem == 0) {
+        target_mem = CPU_FILTER_DEFAULT_MEM;
+    }
+
+    // Use as few rounds as possible, each round hashes every nonce once more
+    filter_bits = 0;
+    for (filter_rounds_log2 = 0; filter_rounds_log2 <= CPU_FILTER_MAX_ROUNDS_LOG2 && filter_bits == 0; filter_rounds_log2++) {
+        for (uint32 bits = CPU_FILTER_MAX_BITS; bits >= CPU_FILTER_MIN_BITS; bits--) {
+            if (calc_filter_mem_usage(filter_rounds_log2, bits) <= (uint64)target_mem * 1024 * 1024) {
+                filter_bits = bits;
+                break;
+            }
+        }
+    }
+    filter_rounds_log2--;
+
+    if (filter_bits == 0) {
+        printf("ERROR: Memory target of %d MB is too small for the filter strategy!\n", target_mem);
+        printf("       Please increase the value of \"-m\".\n");
+        exit(0);
+    }
+
+    size_t bitmap_size = ((size_t)1 << filter_bits) / 8;
+    survivor_capacity = calc_filter_capacity(filter_rounds_log2, filter_bits);
+    survivors = (filterSurvivor_t*)malloc((size_t)survivor_capacity * sizeof(filterSurvivor_t));
+
+    bool allocated = (survivors != NULL);
+    for (uint32 i = 0; i < 2; i++) {
+        filter_once[i] = (uint32*)hugePages_alloc(bitmap_size, &table_pages);
+        filter_twice[i] = (uint32*)hugePages_alloc(bitmap_size, &table_pages);
+        allocated = allocated && filter_once[i] != NULL && filter_twice[i] != NULL;
+    }
+
+    size_t required_mem = calc_filter_mem_usage(filter_rounds_log2, filter_bits);
+
+    if (!allocated) {
+        printf("ERROR: Cannot allocate %d MB for the filter strategy!\n", (uint32)(required_mem / 1024 / 1024));
+        printf("       Please lower the value of \"-m\".\n");
+        exit(0);
+    }
+
+    uint32 rounds = 1 << filter_rounds_log2;
+
+    printf("Using 2^%d filter slots in %d rounds\n", filter_bits, rounds);
+    printf("Using %d MB of memory (%s pages)\n", (uint32)(required_mem / 1024 / 1024), table_pages);
+    printf("Expected survivors per round: %.0f\n", calc_filter_survivors(filter_rounds_log2, filter_bits));
+    printf("Hashing every nonce %d times per table\n", rounds + 1);
+    printf("Estimated drop percentage:  0.00%%\n");
+
+    // What the other strategies would do with the same amount of memory
+    uint32 compare_mem = std::max((uint32)(required_mem / 1024 / 1024), (uint32)1);
+    uint32 compare_size = calc_bucket_size(buckets_log2, compare_mem);
+    if (compare_size > 0) {
+        printf("Bucket table with %d MB: 2^%d buckets of %d elements, %5.2f%% dropped\n",
+            compare_mem, buckets_log2, compare_size,
+            100 * poisson_estimate((1 << buckets_log2), MAX_MOMENTUM_NONCE, compare_size));
+    } else {
+        printf("Bucket table with %d MB: does not fit with 2^%d buckets\n", compare_mem, buckets_log2);
+    }
+    printf("Sort strategy: %d MB, hashing every nonce twice\n", (uint32)(calc_sort_mem_usage(true) / 1024 / 1024));
+    printf("\n");
+}
+
+
+// Returns the position for the next element of a bucket, the bucket starts over if an older table wrote it
+static inline uint32 claim_index_slot(volatile uint32* index, uint32 generation)
+{
+    uint32 old = *index;
+
+    while (true) {
+        uint32 next;
+
+        if ((old & ~CPU_INDEX_COUNT_MASK) != generation) {
+            next = generation | 1;
+        } else if ((old & CPU_INDEX_COUNT_MASK) == CPU_INDEX_COUNT_MASK) {
+            return CPU_INDEX_COUNT_MASK; // saturated, the count must not run into the generation
+        } else {
+            next = old + 1;
+        }
+
+        uint32 seen = (uint32)InterlockedCompareExchange((volatile LONG*)index, (LONG)next, (LONG)old);
+
+        if (seen == old) {
+            return (next & CPU_INDEX_COUNT_MASK) - 1;
+        }
+
+        old = seen;
+    }
+}
+
+
+// Calculates the birthdays of a range of nonces and inserts them into the bucket table
+void ProtoshareCPU::hash_job(void* context, uint32 /* thread_index */, uint32 item)
+{
+    ProtoshareCPU* cpu = (ProtoshareCPU*)context;
+    if (cpu->is_stale()) { return; } // the table gets abandoned anyway
+    uint32 bucket_mask = (1 << cpu->buckets_log2) - 1;
+    uint32 bucket_size = cpu->bucket_size;
+    uint32 generation = cpu->index_generation;
+
+    uint64 birthdays[CPU_HASH_BATCH * BIRTHDAYS_PER_HASH];
+
+    uint32 first_nonce = item << CPU_HASH_CHUNK_BITS;
+    uint32 last_nonce = first_nonce + (1 << CPU_HASH_CHUNK_BITS);
+
+    for (uint32 batch_nonce = first_nonce; batch_nonce < last_nonce; batch_nonce += CPU_HASH_BATCH * BIRTHDAYS_PER_HASH) {
+        sha512_momentum_range((uint8*)cpu->mid_hash, batch_nonce, CPU_HASH_BATCH, birthdays);
+
+        for (uint32 i = 0; i < CPU_HASH_BATCH * BIRTHDAYS_PER_HASH; i++) {
+            uint64 birthday = birthdays[i];
+            uint32 bucket = (uint32)birthday & bucket_mask;
+            uint32 slot = claim_index_slot(&cpu->index_list[bucket], generation);
+
+            // Bucket full, the element is dropped
+            if (slot >= bucket_size) { continue; }
+
+            if (cpu->compact_list != NULL) {
+                cpu->compact_list[(uint64)bucket * bucket_size + slot] = (((batch_nonce + i) / BIRTHDAYS_PER_HASH) << COMPACT_TAG_BITS) | ((uint32)(birthday >> cpu->buckets_log2) & COMPACT_TAG_MASK);
+                continue;
+            }
+
+            // The low 12 bits of the birthday are always part of the bucket index
+            cpu->hash_list[(uint64)bucket * bucket_size + slot] = ((uint64)(batch_nonce + i) << ENTRY_BIRTHDAY_BITS) | (birthday >> 12);
+        }
+    }
+}
+
+
+// Compares all elements within a range of buckets, the index is only read
+void ProtoshareCPU::seek_job(void* context, uint32 /* thread_index */, uint32 item)
+{
+    ProtoshareCPU* cpu = (ProtoshareCPU*)context;
+    uint32 bucket_size = cpu->bucket_size;
+    uint32 generation = cpu->index_generation;
+    uint32 chunk_bits = std::min(cpu->buckets_log2, (uint32)CPU_SEEK_CHUNK_BITS);
+
+    uint32 first_bucket = item << chunk_bits;
+    uint32 last_bucket = first_bucket + (1 << chunk_bits);
+
+    uint32 stored = 0;
+
+    for (uint32 bucket = first_bucket; bucket < last_bucket; bucket++) {
+        uint32 slot = cpu->index_list[bucket];
+        uint32 count = ((slot & ~CPU_INDEX_COUNT_MASK) == generation ? std::min(slot & CPU_INDEX_COUNT_MASK, bucket_size) : 0);
+        stored += count;
+
+        uint64* entries = cpu->hash_list + (uint64)bucket * bucket_size;
+
+        for (uint32 a = 1; a < count; a++) {
+            for (uint32 b = 0; b < a; b++) {
+                if (((entries[a] ^ entries[b]) & ENTRY_BIRTHDAY_MASK) != 0) { continue; }
+
+                cpu->add_result((uint32)(entries[a] >> ENTRY_BIRTHDAY_BITS), (uint32)(entries[b] >> ENTRY_BIRTHDAY_BITS));
+            }
+        }
+    }
+
+    InterlockedExchangeAdd(&cpu->stored_qty, stored);
+}
+
+
+// Compares all compact elements within a range of buckets and verifies the tag matches, the index is only read
+void ProtoshareCPU::seek_compact_job(void* context, uint32 /* thread_index */, uint32 item)
+{
+    ProtoshareCPU* cpu = (ProtoshareCPU*)context;
+    uint32 bucket_size = cpu->bucket_size;
+    uint32 generation = cpu->index_generation;
+    uint32 chunk_bits = std::min(cpu->buckets_log2, (uint32)CPU_SEEK_CHUNK_BITS);
+
+    uint32 first_bucket = item << chunk_bits;
+    uint32 last_bucket = first_bucket + (1 << chunk_bits);
+
+    uint32 candidate_a[CPU_VERIFY_BATCH];
+    uint32 candidate_b[CPU_VERIFY_BATCH];
+    uint32 candidates = 0;
+
+    uint32 stored = 0;
+
+    for (uint32 bucket = first_bucket; bucket < last_bucket; bucket++) {
+        uint32 slot = cpu->index_list[bucket];
+        uint32 count = ((slot & ~CPU_INDEX_COUNT_MASK) == generation ? std::min(slot & CPU_INDEX_COUNT_MASK, bucket_size) : 0);
+        stored += count;
+
+        uint32* entries = cpu->compact_list + (uint64)bucket * bucket_size;
+
+        for (uint32 a = 1; a < count; a++) {
+            for (uint32 b = 0; b < a; b++) {
+                if (((entries[a] ^ entries[b]) & COMPACT_TAG_MASK) != 0) { continue; }
+
+                candidate_a[candidates] = entries[a] >> COMPACT_TAG_BITS;
+                candidate_b[candidates] = entries[b] >> COMPACT_TAG_BITS;
+
+                if (++candidates == CPU_VERIFY_BATCH) {
+                    cpu->verify_candidates(candidate_a, candidate_b, candidates);
+                    candidates = 0;
+                }
+            }
+        }
+    }
+
+    if (candidates > 0) {
+        cpu->verify_candidates(candidate_a, candidate_b, candidates);
+    }
+
+    InterlockedExchangeAdd(&cpu->stored_qty, stored);
+}
+
+
+// Recalculates the birthdays of group pairs with matching tags and keeps the nonces that actually collide
+void ProtoshareCPU::verify_candidates(const uint32* group_a, const uint32* group_b, uint32 count)
+{
+    uint32 groups[2 * CPU_VERIFY_BATCH] = { 0 }; // only count entries are set, GCC can't tell count <= CPU_VERIFY_BATCH
+    uint64 birthdays[2 * CPU_VERIFY_BATCH * BIRTHDAYS_PER_HASH];
+
+    for (uint32 i = 0; i < count; i++) {
+        groups[2 * i + 0] = group_a[i] * BIRTHDAYS_PER_HASH;
+        groups[2 * i + 1] = group_b[i] * BIRTHDAYS_PER_HASH;
+    }
+
+    sha512_momentum((uint8*)mid_hash, groups, 2 * count, birthdays);
+
+    for (uint32 i = 0; i < count; i++) {
+        const uint64* birthdays_a = birthdays + (2 * i + 0) * BIRTHDAYS_PER_HASH;
+        const uint64* birthdays_b = birthdays + (2 * i + 1) * BIRTHDAYS_PER_HASH;
+
+        for (uint32 a = 0; a < BIRTHDAYS_PER_HASH; a++) {
+            // Within the same group every pair is only compared once
+            for (uint32 b = (group_a[i] == group_b[i] ? a + 1 : 0); b < BIRTHDAYS_PER_HASH; b++) {
+                if (birthdays_a[a] == birthdays_b[b]) { add_result(groups[2 * i + 0] + a, groups[2 * i + 1] + b); }
+            }
+        }
+    }
+}
+
+
+void ProtoshareCPU::add_result(uint32 nonce_a, uint32 nonce_b)
+{
+    uint32 result_index = InterlockedIncrement(&result_qty) - 1;
+    if (result_index >= 256) { return; }
+
+    result_a[result_index] = nonce_a;
+    result_b[result_index] = nonce_b;
+}
+
+
+// Hashes a chunk of nonces (keeping the birthdays if there's room) and counts the elements of each partition
+void ProtoshareCPU::sort_count_job(void* context, uint32 /* thread_index */, uint32 item)
+{
+    ProtoshareCPU* cpu = (ProtoshareCPU*)context;
+    if (cpu->is_stale()) { return; } // the table gets abandoned anyway
+    uint32* counts = cpu->sort_offsets + (size_t)item * CPU_SORT_PARTITIONS;
+    uint64 batch[CPU_HASH_BATCH * BIRTHDAYS_PER_HASH];
+
+    memset(counts, 0, CPU_SORT_PARTITIONS * sizeof(uint32));
+
+    uint32 first_nonce = item << CPU_SORT_CHUNK_BITS;
+    uint32 last_nonce = first_nonce + (1 << CPU_SORT_CHUNK_BITS);
+
+    for (uint32 batch_nonce = first_nonce; batch_nonce < last_nonce; batch_nonce += CPU_HASH_BATCH * BIRTHDAYS_PER_HASH) {
+        uint64* birthdays = cpu->sort_rehash ? batch : cpu->sort_birthdays + batch_nonce;
+        sha512_momentum_range((uint8*)cpu->mid_hash, batch_nonce, CPU_HASH_BATCH, birthdays);
+
+        for (uint32 i = 0; i < CPU_HASH_BATCH * BIRTHDAYS_PER_HASH; i++) {
+            counts[birthdays[i] >> ENTRY_BIRTHDAY_BITS]++;
+        }
+    }
+}
+
+
+// Writes the keys of a chunk of nonces to the positions reserved for it in each partition
+void ProtoshareCPU::sort_scatter_job(void* context, uint32 /* thread_index */, uint32 item)
+{
+    ProtoshareCPU* cpu = (ProtoshareCPU*)context;
+    if (cpu->is_stale()) { return; } // the table gets abandoned anyway
+    uint32* offsets = cpu->sort_offsets + (size_t)item * CPU_SORT_PARTITIONS;
+    uint64 batch[CPU_HASH_BATCH * BIRTHDAYS_PER_HASH];
+
+    uint32 first_nonce = item << CPU_SORT_CHUNK_BITS;
+    uint32 last_nonce = first_nonce + (1 << CPU_SORT_CHUNK_BITS);
+
+    for (uint32 batch_nonce = first_nonce; batch_nonce < last_nonce; batch_nonce += CPU_HASH_BATCH * BIRTHDAYS_PER_HASH) {
+        uint64* birthdays = cpu->sort_birthdays + batch_nonce;
+        if (cpu->sort_rehash) {
+            birthdays = batch;
+            sha512_momentum_range((uint8*)cpu->mid_hash, batch_nonce, CPU_HASH_BATCH, birthdays);
+        }
+
+        for (uint32 i = 0; i < CPU_HASH_BATCH * BIRTHDAYS_PER_HASH; i++) {
+            uint64 birthday = birthdays[i];
+            cpu->sort_keys[offsets[birthday >> ENTRY_BIRTHDAY_BITS]++] = ((birthday & ENTRY_BIRTHDAY_MASK) << MAX_NONCE_BITS) | (batch_nonce + i);
+        }
+    }
+}
+
+
+// LSD radix sort on the birthday bits of the keys, returns whichever buffer holds the result
+static uint64* sort_radix_keys(uint64* keys, uint64* scratch, uint32 count)
+{
+    uint64* src = keys;
+    uint64* dst = scratch;
+
+    for (uint32 shift = MAX_NONCE_BITS; shift < 64; shift += CPU_SORT_RADIX_BITS) {
+        uint32 histogram[1 << CPU_SORT_RADIX_BITS] = { 0 };
+
+        for (uint32 i = 0; i < count; i++) {
+            histogram[(src[i] >> shift) & ((1 << CPU_SORT_RADIX_BITS) - 1)]++;
+        }
+
+        uint32 pos = 0;
+        for (uint32 d = 0; d < (1 << CPU_SORT_RADIX_BITS); d++) {
+            uint32 c = histogram[d];
+            histogram[d] = pos;
+            pos += c;
+        }
+
+        for (uint32 i = 0; i < count; i++) {
+            dst[histogram[(src[i] >> shift) & ((1 << CPU_SORT_RADIX_BITS) - 1)]++] = src[i];
+        }
+
+        std::swap(src, dst);
+    }
+
+    return src;
+}
+
+
+// Sorts a range of partitions and compares neighbouring keys
+void ProtoshareCPU::sort_seek_job(void* context, uint32 thread_index, uint32 item)
+{
+    ProtoshareCPU* cpu = (ProtoshareCPU*)context;
+    if (cpu->is_stale()) { return; } // the table gets abandoned anyway
+
+    uint32 first_partition = item * CPU_SORT_SEEK_PARTITIONS;
+    uint32 last_partition = first_partition + CPU_SORT_SEEK_PARTITIONS;
+
+    for (uint32 partition = first_partition; partition < last_partition; partition++) {
+        uint32 start = cpu->sort_partition_start[partition];
+        uint32 count = cpu->sort_partition_start[partition + 1] - start;
+
+        uint64* keys = sort_radix_keys(cpu->sort_keys + start, cpu->sort_scratch[thread_index], count);
+
+        uint32 run_start = 0;
+        for (uint32 i = 1; i < count; i++) {
+            if ((keys[i] >> MAX_NONCE_BITS) != (keys[i - 1] >> MAX_NONCE_BITS)) {
+                run_start = i;
+                continue;
+            }
+
+            // Usually a pair, but every element of a longer run collides with all others
+            for (uint32 j = run_start; j < i; j++) {
+                cpu->add_result((uint32)(keys[i] & (MAX_MOMENTUM_NONCE - 1)), (uint32)(keys[j] & (MAX_MOMENTUM_NONCE - 1)));
+            }
+        }
+    }
+}
+
+
+// Hashes a range of nonces, adds the birthdays of the current round to its filter
+// and collects the birthdays of the previous round that were seen at least twice
+void ProtoshareCPU::filter_job(void* context, uint32 /* thread_index */, uint32 item)
+{
+    ProtoshareCPU* cpu = (ProtoshareCPU*)context;
+    if (cpu->is_stale()) { return; } // the table gets abandoned anyway
+    uint32 pass = cpu->filter_pass;
+    uint32 round_shift = SEARCH_SPACE_BITS - cpu->filter_rounds_log2;
+    uint32 slot_mask = (uint32)(((uint64)1 << cpu->filter_bits) - 1);
+
+    volatile LONG* fill_once = (volatile LONG*)cpu->filter_once[pass & 1];
+    volatile LONG* fill_twice = (volatile LONG*)cpu->filter_twice[pass & 1];
+    uint32* collect_twice = cpu->filter_twice[(pass - 1) & 1];
+
+    uint64 birthdays[CPU_HASH_BATCH * BIRTHDAYS_PER_HASH];
+
+    uint32 first_nonce = item << CPU_HASH_CHUNK_BITS;
+    uint32 last_nonce = first_nonce + (1 << CPU_HASH_CHUNK_BITS);
+
+    for (uint32 batch_nonce = first_nonce; batch_nonce < last_nonce; batch_nonce += CPU_HASH_BATCH * BIRTHDAYS_PER_HASH) {
+        sha512_momentum_range((uint8*)cpu->mid_hash, batch_nonce, CPU_HASH_BATCH, birthdays);
+
+        for (uint32 i = 0; i < CPU_HASH_BATCH * BIRTHDAYS_PER_HASH; i++) {
+            uint64 birthday = birthdays[i];
+            uint32 round = (uint32)(birthday >> round_shift);
+            uint32 slot = (uint32)birthday & slot_mask;
+            LONG bit = (LONG)1 << (slot & 31);
+
+            if (round == pass) {
+                if ((InterlockedOr(&fill_once[slot >> 5], bit) & bit) != 0 && (fill_twice[slot >> 5] & bit) == 0) {
+                    InterlockedOr(&fill_twice[slot >> 5], bit);
+                }
+            } else if (round + 1 == pass && (collect_twice[slot >> 5] & bit) != 0) {
+                uint32 index = InterlockedIncrement(&cpu->survivor_qty) - 1;
+
+                // Only happens if far more birthdays than expected share a slot, the element is dropped
+                if (index >= cpu->survivor_capacity) { continue; }
+
+                cpu->survivors[index].birthday = birthday;
+                cpu->survivors[index].nonce = batch_nonce + i;
+            }
+        }
+    }
+}
+
+
+static bool compare_survivors(const filterSurvivor_t& a, const filterSurvivor_t& b)
+{
+    return a.birthday < b.birthday;
+}
+
+
+void ProtoshareCPU::protoshare_process(minerProtosharesBlock_t* block)
+{
+    uint64 start_time = getTimeHighRes();
+    stats.hash_us = 0;
+    stats.seek_us = 0;
+    stats.dropped = 0;
+    stats.aborted = false;
+
+    work_epoch = block->epoch;
+    block->nonce = 0;
+    protoshares_calculateMidHash(block, mid_hash);
+    result_qty = 0;
+
+    uint64 phase_start = getTimeHighRes();
+
+    if (strategy == PROTOSHARE_CPU_SORT) {
+        uint32 chunks = MAX_MOMENTUM_NONCE >> CPU_SORT_CHUNK_BITS;
+
+        // Calculate all hashes and partition sizes
+        pool->run(ProtoshareCPU::sort_count_job, this, chunks);
+
+        if (is_stale()) {
+            abandon_table(start_time);
+            return;
+        }
+
+        // Turn the counts into write positions, partition by partition and chunk by chunk within a partition
+        uint32 pos = 0;
+        uint32 largest = 0;
+        for (uint32 p = 0; p < CPU_SORT_PARTITIONS; p++) {
+            sort_partition_start[p] = pos;
+            for (uint32 c = 0; c < chunks; c++) {
+                uint32* offset = sort_offsets + (size_t)c * CPU_SORT_PARTITIONS + p;
+                uint32 count = *offset;
+                *offset = pos;
+                pos += count;
+            }
+            largest = std::max(largest, pos - sort_partition_start[p]);
+        }
+        sort_partition_start[CPU_SORT_PARTITIONS] = pos;
+
+        if (largest > sort_scratch_size) {
+            sort_scratch_size = largest;
+            for (uint32 i = 0; i < sort_scratch.size(); i++) {
+                sort_scratch[i] = (uint64*)realloc(sort_scratch[i], sort_scratch_size * sizeof(uint64));
+                if (sort_scratch[i] == NULL) {
+                    printf("ERROR: Cannot allocate sort buffers!\n");
+                    exit(0);
+                }
+            }
+        }
+
+        // Group the keys by partition
+        pool->run(ProtoshareCPU::sort_scatter_job, this, chunks);
+        stats.hash_us = metrics_elapsedMicroseconds(phase_start);
+
+        if (is_stale()) {
+            abandon_table(start_time);
+            return;
+        }
+        phase_start = getTimeHighRes();
+
+        // Find collisions
+        pool->run(ProtoshareCPU::sort_seek_job, this, CPU_SORT_PARTITIONS / CPU_SORT_SEEK_PARTITIONS);
+        stats.seek_us = metrics_elapsedMicroseconds(phase_start);
+    } else if (strategy == PROTOSHARE_CPU_FILTER) {
+        uint32 rounds = 1 << filter_rounds_log2;
+        size_t bitmap_size = ((size_t)1 << filter_bits) / 8;
+
+        // Every pass fills the filter of one round and collects the previous one
+        for (filter_pass = 0; filter_pass <= rounds; filter_pass++) {
+            phase_start = getTimeHighRes();
+            survivor_qty = 0;
+            pool->run(ProtoshareCPU::filter_job, this, MAX_MOMENTUM_NONCE >> CPU_HASH_CHUNK_BITS);
+            stats.hash_us += metrics_elapsedMicroseconds(phase_start);
+
+            if (is_stale()) {
+                abandon_table(start_time);
+                return;
+            }
+
+            if (filter_pass == 0) { continue; }
+
+            phase_start = getTimeHighRes();
+
+            // Most survivors only shared a slot, equal birthdays end up next to each other
+            uint32 qty = std::min((uint32)survivor_qty, survivor_capacity);
+            stats.dropped += (uint32)survivor_qty - qty;
+            std::sort(survivors, survivors + qty, compare_survivors);
+
+            uint32 run_start = 0;
+            for (uint32 i = 1; i < qty; i++) {
+                if (survivors[i].birthday != survivors[i - 1].birthday) {
+                    run_start = i;
+                    continue;
+                }
+
+                for (uint32 j = run_start; j < i; j++) {
+                    add_result(survivors[i].nonce, survivors[j].nonce);
+                }
+            }
+
+            memset(filter_once[(filter_pass - 1) & 1], 0, bitmap_size);
+            memset(filter_twice[(filter_pass - 1) & 1], 0, bitmap_size);
+            stats.seek_us += metrics_elapsedMicroseconds(phase_start);
+        }
+    } else {
+        // Calculate all hashes
+        next_index_generation();
+        pool->run(ProtoshareCPU::hash_job, this, MAX_MOMENTUM_NONCE >> CPU_HASH_CHUNK_BITS);
+        stats.hash_us = metrics_elapsedMicroseconds(phase_start);
+
+        if (is_stale()) {
+            abandon_table(start_time);
+            return;
+        }
+        phase_start = getTimeHighRes();
+
+        // Find collisions
+        stored_qty = 0;
+        uint32 chunk_bits = std::min(buckets_log2, (uint32)CPU_SEEK_CHUNK_BITS);
+        pool->run(compact_list != NULL ? ProtoshareCPU::seek_compact_job : ProtoshareCPU::seek_job, this, 1 << (buckets_log2 - chunk_bits));
+        stats.seek_us = metrics_elapsedMicroseconds(phase_start);
+        stats.dropped = MAX_MOMENTUM_NONCE - (uint32)stored_qty;
+    }
+
+    // Collisions of an old block are worthless
+    if (is_stale()) {
+        abandon_table(start_time);
+        return;
+    }
+
+    uint32 qty = std::min((uint32)result_qty, (uint32)256);
+
+    phase_start = getTimeHighRes();
+    stats.candidates = qty;
+    stats.collisions = protoshares_revalidateCollisions(block, (uint8 *)mid_hash, result_a, result_b, qty);
+    stats.revalidate_us = metrics_elapsedMicroseconds(phase_start);
+    stats.overhead_us = metrics_elapsedMicroseconds(start_time) - stats.hash_us - stats.seek_us - stats.revalidate_us;
+
+    totalTableCount++;
+}
+
+
+// Leaves the tables ready for the next block after the work became stale mid-table
+void ProtoshareCPU::abandon_table(uint64 start_time)
+{
+    // The bucket index needs nothing, the next table starts a new generation
+    if (strategy == PROTOSHARE_CPU_FILTER) {
+        size_t bitmap_size = ((size_t)1 << filter_bits) / 8;
+        for (uint32 i = 0; i < 2; i++) {
+            memset(filter_once[i], 0, bitmap_size);
+            memset(filter_twice[i], 0, bitmap_size);
+        }
+    }
+
+    stats.aborted = true;
+    stats.candidates = 0;
+    stats.collisions = 0;
+    stats.revalidate_us = 0;
+    stats.overhead_us = metrics_elapsedMicroseconds(start_time) - stats.hash_us - stats.seek_us;
+}
+
+
+// Starts a new generation of the bucket index, it's only cleared when the generation counter wraps around
+void ProtoshareCPU::next_index_generation()
+{
+    uint32 generation = (index_generation >> CPU_INDEX_COUNT_BITS) + 1;
+
+    if (generation == (1 << CPU_INDEX_GENERATION_BITS)) {
+        memset((void*)index_list, 0, ((size_t)1 << buckets_log2) * sizeof(uint32));
+        generation = 1;
+    }
+
+    index_generation = generation << CPU_INDEX_COUNT_BITS;
+}
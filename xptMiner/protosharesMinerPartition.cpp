@@ -0,0 +1,311 @@
+#include "global.h"
+#include "ticker.h"
+#include "protoshareMiner.h"
+#include "sha512_momentum.h"
+#include "affinity.h"
+#include "hugePages.h"
+#include <cmath>
+
+// Partitions are selected by the top birthday bits, the remaining bits are stored above the nonce.
+// At least 12 partition bits are needed for an element to fit into 64 bits.
+#define PARTITION_MIN_BITS      ( SEARCH_SPACE_BITS + MAX_NONCE_BITS - 64 )
+#define PARTITION_MAX_BITS      ( 16 )
+
+// Elements gathered per partition before they are written out, one cache line
+#define PARTITION_WC_ENTRIES    ( 8 )
+
+// Work item granularity
+#define PARTITION_HASH_CHUNK_BITS ( 16 )
+#define PARTITION_SEEK_CHUNK      ( 16 )
+
+// Nonce groups hashed per sha512_momentum() call
+#define PARTITION_HASH_BATCH    ( 64 )
+
+// Used if the cache size cannot be detected
+#define PARTITION_DEFAULT_CACHE ( 256 * 1024 )
+
+#define PARTITION_EMPTY_SLOT    ( ~(uint64)0 )
+
+extern commandlineInput_t commandlineInput;
+extern uint32 gpu_watchdog_max_wait;
+
+
+// Returns the size of the L2 cache of a single core in bytes
+static uint32 detect_l2_cache_size()
+{
+#ifdef _WIN32
+    DWORD length = 0;
+    GetLogicalProcessorInformation(NULL, &length);
+
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION* info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)malloc(length);
+    uint32 cache_size = 0;
+
+    if (info != NULL && GetLogicalProcessorInformation(info, &length)) {
+        for (uint32 i = 0; i < length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION); i++) {
+            if (info[i].Relationship == RelationCache && info[i].Cache.Level == 2) {
+                cache_size = info[i].Cache.Size;
+                break;
+            }
+        }
+    }
+
+    free(info);
+    if (cache_size > 0) { return cache_size; }
+#elif defined(_SC_LEVEL2_CACHE_SIZE)
+    long cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache_size > 0) { return (uint32)cache_size; }
+#endif
+
+    return PARTITION_DEFAULT_CACHE;
+}
+
+
+ProtosharePartitioned::ProtosharePartitioned(uint32 num_threads)
+{
+    printf("Initializing partitioned CPU engine with %d threads\n", num_threads);
+
+    this->partition_bits = commandlineInput.partition_bits;
+
+    if (partition_bits == 0) {
+        // Pick the fewest partitions whose lookup table (2^(27-k) slots) fits into half of the L2 cache
+        uint32 cache_size = detect_l2_cache_size();
+        printf("Detected %d KB of L2 cache\n", cache_size / 1024);
+
+        partition_bits = PARTITION_MIN_BITS;
+        while (partition_bits < PARTITION_MAX_BITS && ((uint64)16 << (MAX_NONCE_BITS - partition_bits)) > cache_size / 2) {
+            partition_bits++;
+        }
+    }
+
+    // Expected element count plus 8 standard deviations, rounded up to whole write-combining lines
+    double expected = (double)(MAX_MOMENTUM_NONCE >> partition_bits);
+    partition_capacity = (uint32)(expected + 8 * sqrt(expected));
+    partition_capacity = (partition_capacity + PARTITION_WC_ENTRIES - 1) & ~(PARTITION_WC_ENTRIES - 1);
+
+    // Keeps the load factor of the linear probing table at about one half
+    table_bits = MAX_NONCE_BITS - partition_bits;
+    while (((uint32)1 << table_bits) < partition_capacity * 3 / 2) { table_bits++; }
+
+    size_t required_mem = ((size_t)partition_capacity << partition_bits) * sizeof(uint64);
+
+    partition_list = (uint64*)hugePages_alloc(required_mem, &table_pages);
+    partition_fill = (volatile uint32*)calloc((size_t)1 << partition_bits, sizeof(uint32));
+
+    if (partition_list == NULL || partition_fill == NULL) {
+        printf("ERROR: Cannot allocate 2^%d partitions of %d elements (%d MB)!\n", partition_bits, partition_capacity, (uint32)(required_mem / 1024 / 1024));
+        printf("       Please lower the value of \"-k\".\n");
+        exit(0);
+    }
+
+    // With -affinity every pool thread gets its own CPU and the miner thread (pool thread 0) takes the first one
+    std::vector<uint32> pool_cpus;
+
+    if (commandlineInput.affinity) {
+        pool_cpus = affinity_getAllCpus();
+        thread_cpus.push_back(pool_cpus[0]);
+    }
+
+    pool = new WorkerPool(num_threads, pool_cpus);
+
+    for (uint32 i = 0; i < num_threads; i++) {
+        uint64* wc_buffer = (uint64*)malloc(((size_t)PARTITION_WC_ENTRIES << partition_bits) * sizeof(uint64));
+        uint8* wc_count = (uint8*)calloc((size_t)1 << partition_bits, sizeof(uint8));
+        uint64* table = (uint64*)malloc(((size_t)1 << table_bits) * sizeof(uint64));
+
+        if (wc_buffer == NULL || wc_count == NULL || table == NULL) {
+            printf("ERROR: Cannot allocate partition buffers!\n");
+            exit(0);
+        }
+
+        wc_buffers.push_back(wc_buffer);
+        wc_counts.push_back(wc_count);
+        tables.push_back(table);
+    }
+
+    required_mem += (((size_t)PARTITION_WC_ENTRIES << partition_bits) * sizeof(uint64) + ((size_t)1 << table_bits) * sizeof(uint64)) * num_threads;
+
+    printf("Using %s SHA-512\n", sha512_momentum_implementation());
+    printf("Using 2^%d partitions\n", partition_bits);
+    printf("Using %d elements per partition\n", partition_capacity);
+    printf("Using %d KB lookup table per thread\n", (uint32)((((size_t)1 << table_bits) * sizeof(uint64)) / 1024));
+    printf("Using %d MB of memory (%s pages)\n", (uint32)(required_mem / 1024 / 1024), table_pages);
+    estimated_drop_rate = poisson_estimate((1 << partition_bits), MAX_MOMENTUM_NONCE, partition_capacity);
+    printf("Estimated drop percentage: %5.2f%%\n", 100 * estimated_drop_rate);
+    printf("\n");
+
+    metrics = metrics_registerDevice("partition");
+
+    // A CPU needs a lot longer per table than a GPU
+    gpu_watchdog_max_wait *= 6;
+}
+
+
+// Appends a write-combining line to a partition, elements that don't fit are dropped
+void ProtosharePartitioned::flush_partition(uint32 partition, const uint64* entries, uint32 count)
+{
+    uint32 start = InterlockedExchangeAdd((volatile LONG*)&partition_fill[partition], count);
+    if (start >= partition_capacity) { return; }
+
+    count = std::min(count, partition_capacity - start);
+    memcpy(partition_list + (size_t)partition * partition_capacity + start, entries, count * sizeof(uint64));
+}
+
+
+// Pass 1: calculates the birthdays of a range of nonces and sorts them into partitions
+void ProtosharePartitioned::scatter_job(void* context, uint32 thread_index, uint32 item)
+{
+    ProtosharePartitioned* cpu = (ProtosharePartitioned*)context;
+    if (cpu->is_stale()) { return; } // the table gets abandoned anyway
+    uint32 partition_shift = SEARCH_SPACE_BITS - cpu->partition_bits;
+    uint64 birthday_mask = ((uint64)1 << partition_shift) - 1;
+
+    uint64* wc_buffer = cpu->wc_buffers[thread_index];
+    uint8* wc_count = cpu->wc_counts[thread_index];
+
+    uint64 birthdays[PARTITION_HASH_BATCH * BIRTHDAYS_PER_HASH];
+
+    uint32 first_nonce = item << PARTITION_HASH_CHUNK_BITS;
+    uint32 last_nonce = first_nonce + (1 << PARTITION_HASH_CHUNK_BITS);
+
+    for (uint32 batch_nonce = first_nonce; batch_nonce < last_nonce; batch_nonce += PARTITION_HASH_BATCH * BIRTHDAYS_PER_HASH) {
+        sha512_momentum_range((uint8*)cpu->mid_hash, batch_nonce, PARTITION_HASH_BATCH, birthdays);
+
+        for (uint32 i = 0; i < PARTITION_HASH_BATCH * BIRTHDAYS_PER_HASH; i++) {
+            uint64 birthday = birthdays[i];
+            uint32 partition = (uint32)(birthday >> partition_shift);
+            uint64* line = wc_buffer + (size_t)partition * PARTITION_WC_ENTRIES;
+
+            line[wc_count[partition]++] = ((birthday & birthday_mask) << MAX_NONCE_BITS) | (batch_nonce + i);
+
+            if (wc_count[partition] == PARTITION_WC_ENTRIES) {
+                cpu->flush_partition(partition, line, PARTITION_WC_ENTRIES);
+                wc_count[partition] = 0;
+            }
+        }
+    }
+}
+
+
+// Writes out what's left in the write-combining buffers of one thread
+void ProtosharePartitioned::flush_job(void* context, uint32 /* thread_index */, uint32 item)
+{
+    ProtosharePartitioned* cpu = (ProtosharePartitioned*)context;
+    uint64* wc_buffer = cpu->wc_buffers[item];
+    uint8* wc_count = cpu->wc_counts[item];
+
+    for (uint32 partition = 0; partition < ((uint32)1 << cpu->partition_bits); partition++) {
+        if (wc_count[partition] == 0) { continue; }
+
+        cpu->flush_partition(partition, wc_buffer + (size_t)partition * PARTITION_WC_ENTRIES, wc_count[partition]);
+        wc_count[partition] = 0;
+    }
+}
+
+
+// Pass 2: finds collisions within a range of partitions and resets them for the next table
+void ProtosharePartitioned::seek_job(void* context, uint32 thread_index, uint32 item)
+{
+    ProtosharePartitioned* cpu = (ProtosharePartitioned*)context;
+    uint64* table = cpu->tables[thread_index];
+    uint32 table_mask = (1 << cpu->table_bits) - 1;
+
+    uint32 first_partition = item * PARTITION_SEEK_CHUNK;
+    uint32 last_partition = first_partition + PARTITION_SEEK_CHUNK;
+
+    uint32 stored = 0;
+
+    for (uint32 partition = first_partition; partition < last_partition; partition++) {
+        uint32 count = std::min((uint32)cpu->partition_fill[partition], cpu->partition_capacity);
+        cpu->partition_fill[partition] = 0;
+        stored += count;
+
+        uint64* entries = cpu->partition_list + (size_t)partition * cpu->partition_capacity;
+        memset(table, 0xFF, ((size_t)table_mask + 1) * sizeof(uint64));
+
+        for (uint32 i = 0; i < count; i++) {
+            uint64 entry = entries[i];
+            uint64 birthday = entry >> MAX_NONCE_BITS;
+            uint32 slot = (uint32)birthday & table_mask;
+
+            // Linear probing, every stored element with the same birthday is a collision
+            while (table[slot] != PARTITION_EMPTY_SLOT) {
+                if ((table[slot] >> MAX_NONCE_BITS) == birthday) {
+                    uint32 result_index = InterlockedIncrement(&cpu->result_qty) - 1;
+
+                    if (result_index < 256) {
+                        cpu->result_a[result_index] = (uint32)(entry & (MAX_MOMENTUM_NONCE - 1));
+                        cpu->result_b[result_index] = (uint32)(table[slot] & (MAX_MOMENTUM_NONCE - 1));
+                    }
+                }
+
+                slot = (slot + 1) & table_mask;
+            }
+
+            table[slot] = entry;
+        }
+    }
+
+    InterlockedExchangeAdd(&cpu->stored_qty, stored);
+}
+
+
+void ProtosharePartitioned::protoshare_process(minerProtosharesBlock_t* block)
+{
+    uint64 start_time = getTimeHighRes();
+    stats.seek_us = 0;
+    stats.aborted = false;
+
+    work_epoch = block->epoch;
+    block->nonce = 0;
+    protoshares_calculateMidHash(block, mid_hash);
+    result_qty = 0;
+    stored_qty = 0;
+
+    // Pass 1: calculate all hashes and partition them
+    uint64 phase_start = getTimeHighRes();
+    pool->run(ProtosharePartitioned::scatter_job, this, MAX_MOMENTUM_NONCE >> PARTITION_HASH_CHUNK_BITS);
+    pool->run(ProtosharePartitioned::flush_job, this, pool->getNumThreads());
+    stats.hash_us = metrics_elapsedMicroseconds(phase_start);
+
+    if (is_stale()) {
+        abandon_table(start_time);
+        return;
+    }
+
+    // Pass 2: find collisions and reset the partitions
+    phase_start = getTimeHighRes();
+    pool->run(ProtosharePartitioned::seek_job, this, (1 << partition_bits) / PARTITION_SEEK_CHUNK);
+    stats.seek_us = metrics_elapsedMicroseconds(phase_start);
+    stats.dropped = MAX_MOMENTUM_NONCE - (uint32)stored_qty;
+
+    // Collisions of an old block are worthless
+    if (is_stale()) {
+        abandon_table(start_time);
+        return;
+    }
+
+    uint32 qty = std::min((uint32)result_qty, (uint32)256);
+
+    phase_start = getTimeHighRes();
+    stats.candidates = qty;
+    stats.collisions = protoshares_revalidateCollisions(block, (uint8 *)mid_hash, result_a, result_b, qty);
+    stats.revalidate_us = metrics_elapsedMicroseconds(phase_start);
+    stats.overhead_us = metrics_elapsedMicroseconds(start_time) - stats.hash_us - stats.seek_us - stats.revalidate_us;
+
+    totalTableCount++;
+}
+
+
+// Empties the partitions for the next block after the work became stale mid-table
+void ProtosharePartitioned::abandon_table(uint64 start_time)
+{
+    // The seek pass resets the fill counters once it ran, the flush job always empties the write-combining buffers
+    memset((void*)partition_fill, 0, ((size_t)1 << partition_bits) * sizeof(uint32));
+
+    stats.aborted = true;
+    stats.dropped = 0;
+    stats.candidates = 0;
+    stats.collisions = 0;
+    stats.revalidate_us = 0;
+    stats.overhead_us = metrics_elapsedMicroseconds(start_time) - stats.hash_us - stats.seek_us;
+}
@@ -39,6 +39,18 @@
 
 #include "sha2.h"
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SHA256_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHA256_TARGET(x)
+#else
+#include <cpuid.h>
+#define SHA256_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
 #define SHFR(x, n)    (x >> n)
 #define ROTR(x, n)   ((x >> n) | (x << ((sizeof(x) << 3) - n)))
 #define ROTL(x, n)   ((x << n) | (x >> ((sizeof(x) << 3) - n)))
@@ -212,8 +224,8 @@ uint64 sha512_k[80] =
 
 /* SHA-256 functions */
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+static void sha256_transf_scalar(sha256_ctx *ctx, const unsigned char *message,
+                                 unsigned int block_nb)
 {
     uint32 w[64];
     uint32 wv[8];
@@ -327,6 +339,122 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
     }
 }
 
+#ifdef SHA256_X86
+
+/* SHA extensions, the state is kept as ABEF/CDGH pairs for sha256rnds2 */
+
+SHA256_TARGET("sha,sse4.1")
+static void sha256_transf_shani(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp, abef_save, cdgh_save;
+    __m128i w[4];
+    int i;
+
+    tmp = _mm_loadu_si128((const __m128i *) &ctx->h[0]);
+    state1 = _mm_loadu_si128((const __m128i *) &ctx->h[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);             /* CDAB */
+    state1 = _mm_shuffle_epi32(state1, 0x1B);       /* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);       /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);    /* CDGH */
+
+    while (block_nb--) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        for (i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (message + 16 * i)), mask);
+        }
+
+        /* 4 rounds per iteration, w[i & 3] is replaced by the schedule of rounds 4 * (i + 4) */
+        for (i = 0; i < 16; i++) {
+            msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+            if (i < 12) {
+                tmp = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        message += SHA256_BLOCK_SIZE;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);          /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xB1);       /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);    /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       /* HGFE */
+
+    _mm_storeu_si128((__m128i *) &ctx->h[0], state0);
+    _mm_storeu_si128((__m128i *) &ctx->h[4], state1);
+}
+
+#endif /* SHA256_X86 */
+
+/* Runtime dispatch */
+
+typedef void (*sha256_transf_func)(sha256_ctx *ctx, const unsigned char *message,
+                                   unsigned int block_nb);
+
+static sha256_transf_func sha256_transf_impl = NULL;
+static const char *sha256_impl_name = "scalar";
+
+static void sha256_select()
+{
+    sha256_transf_func impl = sha256_transf_scalar;
+
+#ifdef SHA256_X86
+    /* CPUID.7.0:EBX[29] = SHA, CPUID.1:ECX[19] = SSE4.1 */
+    int regs[4] = {0};
+#ifdef _MSC_VER
+    __cpuid(regs, 0);
+    int max_leaf = regs[0];
+    __cpuid(regs, 1);
+    bool sse41 = (regs[2] & (1 << 19)) != 0;
+    if (max_leaf >= 7) {
+        __cpuidex(regs, 7, 0);
+    } else {
+        regs[1] = 0;
+    }
+#else
+    unsigned int a, b, c, d;
+    bool sse41 = __get_cpuid(1, &a, &b, &c, &d) && (c & (1 << 19)) != 0;
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+        regs[1] = (int) b;
+    }
+#endif
+    if (sse41 && (regs[1] & (1 << 29))) {
+        impl = sha256_transf_shani;
+        sha256_impl_name = "SHA-NI";
+    }
+#endif
+
+    sha256_transf_impl = impl;
+}
+
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb)
+{
+    if (sha256_transf_impl == NULL)
+        sha256_select();
+
+    sha256_transf_impl(ctx, message, block_nb);
+}
+
+const char *sha256_implementation()
+{
+    if (sha256_transf_impl == NULL)
+        sha256_select();
+
+    return sha256_impl_name;
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -0,0 +1,319 @@
+/*
+ * Fixed-length SHA-512 for the momentum birthday search
+ *
+ * The message is always one block:
+ *   W[0]      = nonce (little endian) || midHash[0..3]
+ *   W[1..3]   = midHash[4..27]
+ *   W[4]      = midHash[28..31] || 0x80 padding byte
+ *   W[5..14]  = 0
+ *   W[15]     = 288 (message length in bits)
+ * Only W[0] differs between nonce groups.
+ *
+ * The birthdays are the digest words read as little endian integers,
+ * shifted down to SHA512_MOMENTUM_BITS bits (see protoshares_revalidateCollision).
+ */
+
+#include <string.h>
+#include "sha512_momentum.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SHA512_MOMENTUM_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#define SHA512_TARGET(x)
+#define SHA512_UNROLL
+#define SHA512_BSWAP32(x) _byteswap_ulong(x)
+#define SHA512_BSWAP64(x) _byteswap_uint64(x)
+#else
+#define SHA512_TARGET(x) __attribute__((target(x)))
+#define SHA512_UNROLL _Pragma("GCC unroll 80")
+#define SHA512_BSWAP32(x) __builtin_bswap32(x)
+#define SHA512_BSWAP64(x) __builtin_bswap64(x)
+#endif
+
+#define SHA512_BIRTHDAY_SHIFT (64 - SHA512_MOMENTUM_BITS)
+
+extern uint64 sha512_h0[8];
+extern uint64 sha512_k[80];
+
+/* Shared round function, expects V_* operations for the lane type */
+
+#define S512_BSIG0(x) V_XOR(V_XOR(V_ROTR(x, 28), V_ROTR(x, 34)), V_ROTR(x, 39))
+#define S512_BSIG1(x) V_XOR(V_XOR(V_ROTR(x, 14), V_ROTR(x, 18)), V_ROTR(x, 41))
+#define S512_SSIG0(x) V_XOR(V_XOR(V_ROTR(x,  1), V_ROTR(x,  8)), V_SHR(x, 7))
+#define S512_SSIG1(x) V_XOR(V_XOR(V_ROTR(x, 19), V_ROTR(x, 61)), V_SHR(x, 6))
+
+/* w[0..15] holds the message, h[0..7] receives the state after the block */
+#define SHA512_MOMENTUM_COMPRESS(V_T, w, h)                                   \
+{                                                                             \
+    V_T a = V_SET1(sha512_h0[0]), b = V_SET1(sha512_h0[1]);                   \
+    V_T c = V_SET1(sha512_h0[2]), d = V_SET1(sha512_h0[3]);                   \
+    V_T e = V_SET1(sha512_h0[4]), f = V_SET1(sha512_h0[5]);                   \
+    V_T g = V_SET1(sha512_h0[6]), hh = V_SET1(sha512_h0[7]);                  \
+    SHA512_UNROLL                                                             \
+    for (int j = 0; j < 80; j++) {                                            \
+        if (j >= 16) {                                                        \
+            w[j & 15] = V_ADD(V_ADD(S512_SSIG1(w[(j - 2) & 15]),              \
+                                    w[(j - 7) & 15]),                         \
+                              V_ADD(S512_SSIG0(w[(j - 15) & 15]),             \
+                                    w[j & 15]));                              \
+        }                                                                     \
+        V_T t1 = V_ADD(V_ADD(hh, S512_BSIG1(e)),                              \
+                       V_ADD(V_CH(e, f, g),                                   \
+                             V_ADD(V_SET1(sha512_k[j]), w[j & 15])));         \
+        V_T t2 = V_ADD(S512_BSIG0(a), V_MAJ(a, b, c));                        \
+        hh = g; g = f; f = e; e = V_ADD(d, t1);                               \
+        d = c; c = b; b = a; a = V_ADD(t1, t2);                               \
+    }                                                                         \
+    h[0] = V_ADD(a, V_SET1(sha512_h0[0]));                                    \
+    h[1] = V_ADD(b, V_SET1(sha512_h0[1]));                                    \
+    h[2] = V_ADD(c, V_SET1(sha512_h0[2]));                                    \
+    h[3] = V_ADD(d, V_SET1(sha512_h0[3]));                                    \
+    h[4] = V_ADD(e, V_SET1(sha512_h0[4]));                                    \
+    h[5] = V_ADD(f, V_SET1(sha512_h0[5]));                                    \
+    h[6] = V_ADD(g, V_SET1(sha512_h0[6]));                                    \
+    h[7] = V_ADD(hh, V_SET1(sha512_h0[7]));                                   \
+}
+
+/* Message words 0..4, word 0 without the nonce part */
+static void sha512_momentum_message(const uint8 *midHash, uint64 *m)
+{
+    uint32 mid32[8];
+    memcpy(mid32, midHash, 32);
+
+    m[0] = (uint64)SHA512_BSWAP32(mid32[0]);
+    m[1] = ((uint64)SHA512_BSWAP32(mid32[1]) << 32) | SHA512_BSWAP32(mid32[2]);
+    m[2] = ((uint64)SHA512_BSWAP32(mid32[3]) << 32) | SHA512_BSWAP32(mid32[4]);
+    m[3] = ((uint64)SHA512_BSWAP32(mid32[5]) << 32) | SHA512_BSWAP32(mid32[6]);
+    m[4] = ((uint64)SHA512_BSWAP32(mid32[7]) << 32) | 0x80000000ULL;
+}
+
+static inline uint64 sha512_momentum_w0(const uint64 *m, uint32 nonce)
+{
+    return ((uint64)SHA512_BSWAP32(nonce) << 32) | m[0];
+}
+
+/* Scalar */
+
+#define V_ADD(x, y)     ((x) + (y))
+#define V_XOR(x, y)     ((x) ^ (y))
+#define V_ROTR(x, n)    (((x) >> (n)) | ((x) << (64 - (n))))
+#define V_SHR(x, n)     ((x) >> (n))
+#define V_SET1(x)       (x)
+#define V_CH(x, y, z)   (((x) & (y)) ^ (~(x) & (z)))
+#define V_MAJ(x, y, z)  (((x) & (y)) | ((z) & ((x) | (y))))
+
+static void sha512_momentum_scalar(const uint64 *m, const uint32 *nonces, uint32 count,
+                                   uint64 *birthdays)
+{
+    for (uint32 i = 0; i < count; i++) {
+        uint64 w[16] = { sha512_momentum_w0(m, nonces[i]), m[1], m[2], m[3], m[4],
+                         0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 288 };
+        uint64 h[8];
+
+        SHA512_MOMENTUM_COMPRESS(uint64, w, h);
+
+        for (int j = 0; j < 8; j++)
+            birthdays[8 * i + j] = SHA512_BSWAP64(h[j]) >> SHA512_BIRTHDAY_SHIFT;
+    }
+}
+
+#undef V_ADD
+#undef V_XOR
+#undef V_ROTR
+#undef V_SHR
+#undef V_SET1
+#undef V_CH
+#undef V_MAJ
+
+#ifdef SHA512_MOMENTUM_X86
+
+/* AVX2, 4 nonce groups per call */
+
+#define V_ADD(x, y)     _mm256_add_epi64(x, y)
+#define V_XOR(x, y)     _mm256_xor_si256(x, y)
+#define V_ROTR(x, n)    _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
+#define V_SHR(x, n)     _mm256_srli_epi64(x, n)
+#define V_SET1(x)       _mm256_set1_epi64x((long long)(x))
+#define V_CH(x, y, z)   _mm256_xor_si256(_mm256_and_si256(x, y), _mm256_andnot_si256(x, z))
+#define V_MAJ(x, y, z)  _mm256_or_si256(_mm256_and_si256(x, y), _mm256_and_si256(z, _mm256_or_si256(x, y)))
+
+SHA512_TARGET("avx2")
+static void sha512_momentum_avx2(const uint64 *m, const uint32 *nonces, uint32 count,
+                                 uint64 *birthdays)
+{
+    uint32 i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m256i w[16], h[8];
+        w[0] = _mm256_set_epi64x((long long)sha512_momentum_w0(m, nonces[i + 3]),
+                                 (long long)sha512_momentum_w0(m, nonces[i + 2]),
+                                 (long long)sha512_momentum_w0(m, nonces[i + 1]),
+                                 (long long)sha512_momentum_w0(m, nonces[i + 0]));
+        for (int j = 1; j < 5; j++)
+            w[j] = V_SET1(m[j]);
+        for (int j = 5; j < 15; j++)
+            w[j] = _mm256_setzero_si256();
+        w[15] = V_SET1(288);
+
+        SHA512_MOMENTUM_COMPRESS(__m256i, w, h);
+
+        uint64 out[8][4];
+        for (int j = 0; j < 8; j++)
+            _mm256_storeu_si256((__m256i *)out[j], h[j]);
+        for (int lane = 0; lane < 4; lane++)
+            for (int j = 0; j < 8; j++)
+                birthdays[8 * (i + lane) + j] = SHA512_BSWAP64(out[j][lane]) >> SHA512_BIRTHDAY_SHIFT;
+    }
+
+    sha512_momentum_scalar(m, nonces + i, count - i, birthdays + 8 * i);
+}
+
+#undef V_ADD
+#undef V_XOR
+#undef V_ROTR
+#undef V_SHR
+#undef V_SET1
+#undef V_CH
+#undef V_MAJ
+
+/* AVX-512, 8 nonce groups per call */
+
+#define V_ADD(x, y)     _mm512_add_epi64(x, y)
+#define V_XOR(x, y)     _mm512_xor_si512(x, y)
+// The zero-masked forms with a full mask are the same instructions, the plain ones pass an
+// undefined source that GCC reports as maybe-uninitialized
+#define V_ROTR(x, n)    _mm512_maskz_ror_epi64((__mmask8)0xFF, x, n)
+#define V_SHR(x, n)     _mm512_maskz_srli_epi64((__mmask8)0xFF, x, n)
+#define V_SET1(x)       _mm512_set1_epi64((long long)(x))
+#define V_CH(x, y, z)   _mm512_ternarylogic_epi64(x, y, z, 0xCA)
+#define V_MAJ(x, y, z)  _mm512_ternarylogic_epi64(x, y, z, 0xE8)
+
+SHA512_TARGET("avx512f")
+static void sha512_momentum_avx512(const uint64 *m, const uint32 *nonces, uint32 count,
+                                   uint64 *birthdays)
+{
+    uint32 i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m512i w[16], h[8];
+        uint64 w0[8];
+        for (int lane = 0; lane < 8; lane++)
+            w0[lane] = sha512_momentum_w0(m, nonces[i + lane]);
+        w[0] = _mm512_loadu_si512(w0);
+        for (int j = 1; j < 5; j++)
+            w[j] = V_SET1(m[j]);
+        for (int j = 5; j < 15; j++)
+            w[j] = _mm512_setzero_si512();
+        w[15] = V_SET1(288);
+
+        SHA512_MOMENTUM_COMPRESS(__m512i, w, h);
+
+        uint64 out[8][8];
+        for (int j = 0; j < 8; j++)
+            _mm512_storeu_si512(out[j], h[j]);
+        for (int lane = 0; lane < 8; lane++)
+            for (int j = 0; j < 8; j++)
+                birthdays[8 * (i + lane) + j] = SHA512_BSWAP64(out[j][lane]) >> SHA512_BIRTHDAY_SHIFT;
+    }
+
+    sha512_momentum_scalar(m, nonces + i, count - i, birthdays + 8 * i);
+}
+
+#undef V_ADD
+#undef V_XOR
+#undef V_ROTR
+#undef V_SHR
+#undef V_SET1
+#undef V_CH
+#undef V_MAJ
+
+#endif /* SHA512_MOMENTUM_X86 */
+
+/* Runtime dispatch */
+
+typedef void (*sha512_momentum_func)(const uint64 *m, const uint32 *nonces, uint32 count,
+                                     uint64 *birthdays);
+
+static sha512_momentum_func sha512_momentum_impl = NULL;
+static const char *sha512_momentum_impl_name = "scalar";
+
+static void sha512_momentum_select()
+{
+    sha512_momentum_func impl = sha512_momentum_scalar;
+
+#if defined(SHA512_MOMENTUM_X86) && defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    int max_leaf = regs[0];
+    __cpuid(regs, 1);
+    bool os_avx = (regs[2] & (1 << 27)) != 0; /* OSXSAVE */
+    unsigned long long xcr0 = os_avx ? _xgetbv(0) : 0;
+
+    if (max_leaf >= 7) {
+        __cpuidex(regs, 7, 0);
+        if ((regs[1] & (1 << 5)) && (xcr0 & 0x06) == 0x06) {
+            impl = sha512_momentum_avx2;
+            sha512_momentum_impl_name = "AVX2";
+        }
+        if ((regs[1] & (1 << 16)) && (xcr0 & 0xE6) == 0xE6) {
+            impl = sha512_momentum_avx512;
+            sha512_momentum_impl_name = "AVX-512";
+        }
+    }
+#elif defined(SHA512_MOMENTUM_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        impl = sha512_momentum_avx2;
+        sha512_momentum_impl_name = "AVX2";
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        impl = sha512_momentum_avx512;
+        sha512_momentum_impl_name = "AVX-512";
+    }
+#endif
+
+    sha512_momentum_impl = impl;
+}
+
+void sha512_momentum(const uint8 *midHash, const uint32 *nonces, uint32 count,
+                     uint64 *birthdays)
+{
+    if (sha512_momentum_impl == NULL)
+        sha512_momentum_select();
+
+    uint64 m[5];
+    sha512_momentum_message(midHash, m);
+    sha512_momentum_impl(m, nonces, count, birthdays);
+}
+
+void sha512_momentum_range(const uint8 *midHash, uint32 firstNonce, uint32 count,
+                           uint64 *birthdays)
+{
+    uint32 nonces[64];
+
+    while (count > 0) {
+        uint32 n = count < 64 ? count : 64;
+
+        for (uint32 i = 0; i < n; i++)
+            nonces[i] = firstNonce + 8 * i;
+        sha512_momentum(midHash, nonces, n, birthdays);
+
+        firstNonce += 8 * n;
+        birthdays += 8 * n;
+        count -= n;
+    }
+}
+
+const char *sha512_momentum_implementation()
+{
+    if (sha512_momentum_impl == NULL)
+        sha512_momentum_select();
+
+    return sha512_momentum_impl_name;
+}
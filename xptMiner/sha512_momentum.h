@@ -0,0 +1,39 @@
+/*
+ * Fixed-length SHA-512 for the momentum birthday search
+ *
+ * Every momentum hash is SHA-512(nonce || midHash), a single 36 byte block.
+ * Knowing the length in advance removes all buffering and padding logic and
+ * most of the message schedule, and lets several nonce groups be hashed at
+ * once in the lanes of a vector register (4 with AVX2, 8 with AVX-512).
+ * The instruction set is picked at runtime, with a scalar fallback.
+ */
+
+#ifndef SHA512_MOMENTUM_H
+#define SHA512_MOMENTUM_H
+
+#include "sha2.h"
+
+#define SHA512_MOMENTUM_BIRTHDAYS   ( 8 )   // birthdays per hash
+#define SHA512_MOMENTUM_BITS        ( 50 )  // bits per birthday
+
+/*
+ * Calculates the 8 birthdays of each nonce group
+ * nonces[i] must be a multiple of 8, birthdays receives 8 * count values
+ * (birthdays[8 * i + j] belongs to nonce nonces[i] + j)
+ */
+void sha512_momentum(const uint8 *midHash, const uint32 *nonces, uint32 count,
+                     uint64 *birthdays);
+
+/*
+ * Same as sha512_momentum() for count consecutive nonce groups starting at
+ * firstNonce (a multiple of 8)
+ */
+void sha512_momentum_range(const uint8 *midHash, uint32 firstNonce, uint32 count,
+                           uint64 *birthdays);
+
+/*
+ * Returns the name of the implementation picked for this CPU
+ */
+const char *sha512_momentum_implementation();
+
+#endif /* !SHA512_MOMENTUM_H */
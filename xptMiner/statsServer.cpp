@@ -0,0 +1,419 @@
+#include "global.h"
+#include "ticker.h"
+#include "metrics.h"
+#include "statsServer.h"
+#include <cstdarg>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// A request has to arrive within this time, the listener serves one client at a time
+#define STATS_RECV_TIMEOUT_MS   ( 1000 )
+#define STATS_REQUEST_SIZE      ( 2048 )
+
+extern xptClient_t* xptClient;
+extern uint32 miningStartTime;
+extern uint32 gpu_watchdog_timer;
+extern uint32 gpu_watchdog_max_wait;
+extern volatile uint32 lastWorkUpdateTime;
+extern volatile sint32 activePool;
+extern volatile uint32 poolFailoverCount;
+
+static SOCKET statsServer_socket;
+
+
+// Values reported by both formats, read once per request
+typedef struct
+{
+    uint32 collisions;
+    uint32 tables;
+    uint32 shares;
+    uint32 invalidShares;
+    uint32 blockHeight;
+    uint32 miningSeconds;
+    bool connected;
+    sint32 activePool;      // priority index of the pool mined on, -1 if none is up
+    uint32 poolFailovers;
+    double pingMs;          // average, negative if unknown
+    double workAgeSeconds;  // negative if no work was received yet
+    double watchdogBusySeconds;
+    uint32 watchdogLimitSeconds;
+    // outbound share queue
+    uint32 queueDepth;
+    uint32 queueDepthMax;
+    uint32 queueOverflows;
+    uint32 sharesSent;
+    uint32 shareSendP50us;
+    uint32 shareSendP99us;
+    // share acks, matched to the submitted shares
+    uint32 sharesAccepted;
+    uint32 sharesRejected;
+    uint32 sharesUnacknowledged;
+    uint32 acksUnmatched;
+    uint32 acks;
+    uint32 shareAckP50us;
+    uint32 shareAckP99us;
+    uint32 staleRejects;
+    uint32 lateRejects;
+    uint32 staleWorkAgeP50us;
+    uint32 staleLateByP50us;
+    uint32 staleLateByP99us;
+    xptRejectReason_t rejectReasons[XPT_REJECT_REASONS];
+    uint32 rejectReasonCount;
+    uint32 rejectOtherCount;
+}statsSnapshot_t;
+
+static void statsServer_takeSnapshot(statsSnapshot_t* snapshot)
+{
+    uint32 now = (uint32)getTimeMilliseconds();
+
+    snapshot->collisions = totalCollisionCount;
+    snapshot->tables = totalTableCount;
+    snapshot->shares = totalShareCount;
+    snapshot->invalidShares = invalidShareCount;
+    snapshot->blockHeight = monitorCurrentBlockHeight;
+    snapshot->miningSeconds = (miningStartTime > 0 ? (uint32)time(NULL) - miningStartTime : 0);
+
+    // The connection and ping are those of the active pool
+    xptClient_t* client = xptClient;
+    snapshot->connected = (client != NULL && xptClient_isDisconnected(client, NULL) == false);
+    snapshot->activePool = activePool;
+    snapshot->poolFailovers = poolFailoverCount;
+    uint64 pingSum = (client != NULL ? client->pingSum : 0);
+    uint32 pingCount = (client != NULL ? client->pingCount : 0);
+    snapshot->pingMs = (pingCount > 0 ? (double)pingSum / pingCount / 10.0 : -1.0); // pingSum is in 0.1ms
+
+    // Share counters are summed over the clients of all pools, so they don't jump when the pool changes.
+    // The client objects are created once and never freed, their fields are only read here.
+    metricsHistogram_t shareSendLatency, shareAckLatency, staleWorkAge, staleLateBy;
+    memset(&shareSendLatency, 0x00, sizeof(metricsHistogram_t));
+    memset(&shareAckLatency, 0x00, sizeof(metricsHistogram_t));
+    memset(&staleWorkAge, 0x00, sizeof(metricsHistogram_t));
+    memset(&staleLateBy, 0x00, sizeof(metricsHistogram_t));
+
+    snapshot->queueDepth = snapshot->queueDepthMax = snapshot->queueOverflows = 0;
+    snapshot->sharesAccepted = snapshot->sharesRejected = snapshot->sharesUnacknowledged = snapshot->acksUnmatched = 0;
+    snapshot->staleRejects = snapshot->lateRejects = 0;
+    memset(snapshot->rejectReasons, 0x00, sizeof(snapshot->rejectReasons));
+    snapshot->rejectReasonCount = 0;
+    snapshot->rejectOtherCount = 0;
+
+    for (uint32 i = 0; i < xptMiner_getPoolCount(); i++) {
+        xptClient_t* poolClient = xptMiner_getPoolClient(i);
+
+        snapshot->queueDepth += xptClient_getSendQueueDepth(poolClient);
+        snapshot->queueDepthMax = std::max(snapshot->queueDepthMax, (uint32)poolClient->sendQueueDepthMax);
+        snapshot->queueOverflows += poolClient->sendOverflowCount;
+        snapshot->sharesAccepted += poolClient->sharesAccepted;
+        snapshot->sharesRejected += poolClient->sharesRejected;
+        snapshot->sharesUnacknowledged += poolClient->sharesUnacknowledged;
+        snapshot->acksUnmatched += poolClient->acksUnmatched;
+        snapshot->staleRejects += poolClient->staleRejects;
+        snapshot->lateRejects += poolClient->lateRejects;
+        metrics_merge(&shareSendLatency, &poolClient->shareSendLatency);
+        metrics_merge(&shareAckLatency, &poolClient->shareAckLatency);
+        metrics_merge(&staleWorkAge, &poolClient->staleWorkAge);
+        metrics_merge(&staleLateBy, &poolClient->staleLateBy);
+
+        // entries are filled before the count is raised and never change their reason
+        uint32 reasonCount = std::min<uint32>(poolClient->rejectReasonCount, XPT_REJECT_REASONS);
+        for (uint32 r = 0; r < reasonCount; r++) {
+            xptRejectReason_t* reason = &poolClient->rejectReasons[r];
+            uint32 f = 0;
+            while ( f < snapshot->rejectReasonCount && strcmp(snapshot->rejectReasons[f].reason, reason->reason) != 0 ) { f++; }
+
+            if ( f < snapshot->rejectReasonCount ) {
+                snapshot->rejectReasons[f].count += reason->count;
+            } else if ( f < XPT_REJECT_REASONS ) {
+                snapshot->rejectReasons[f] = *reason;
+                snapshot->rejectReasonCount++;
+            } else {
+                snapshot->rejectOtherCount += reason->count;
+            }
+        }
+        snapshot->rejectOtherCount += poolClient->rejectOtherCount;
+    }
+
+    snapshot->sharesSent = metrics_getCount(&shareSendLatency);
+    snapshot->shareSendP50us = metrics_getPercentile(&shareSendLatency, 50);
+    snapshot->shareSendP99us = metrics_getPercentile(&shareSendLatency, 99);
+    snapshot->acks = metrics_getCount(&shareAckLatency);
+    snapshot->shareAckP50us = metrics_getPercentile(&shareAckLatency, 50);
+    snapshot->shareAckP99us = metrics_getPercentile(&shareAckLatency, 99);
+    snapshot->staleWorkAgeP50us = metrics_getPercentile(&staleWorkAge, 50);
+    snapshot->staleLateByP50us = metrics_getPercentile(&staleLateBy, 50);
+    snapshot->staleLateByP99us = metrics_getPercentile(&staleLateBy, 99);
+
+    uint32 lastWork = lastWorkUpdateTime;
+    snapshot->workAgeSeconds = (lastWork > 0 ? (now - lastWork) / 1000.0 : -1.0);
+
+    uint32 watchdog = gpu_watchdog_timer;
+    snapshot->watchdogBusySeconds = (watchdog > 0 && now > watchdog ? (now - watchdog) / 1000.0 : 0.0);
+    snapshot->watchdogLimitSeconds = gpu_watchdog_max_wait;
+}
+
+
+static void statsServer_append(std::string& output, const char* format, ...)
+{
+    char buffer[512];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    output.append(buffer);
+}
+
+static void statsServer_formatJson(std::string& output)
+{
+    statsSnapshot_t s;
+    statsServer_takeSnapshot(&s);
+
+    statsServer_append(output, "{\"collisions\":%u,\"tables\":%u,\"shares\":%u,\"invalid_shares\":%u,\"block_height\":%u,",
+                       s.collisions, s.tables, s.shares, s.invalidShares, s.blockHeight);
+    statsServer_append(output, "\"mining_seconds\":%u,\"connected\":%s,", s.miningSeconds, s.connected ? "true" : "false");
+    statsServer_append(output, "\"pool\":{\"active\":%d,\"failovers\":%u},", s.activePool, s.poolFailovers);
+
+    if ( s.pingMs >= 0 ) { statsServer_append(output, "\"ping_ms\":%.1f,", s.pingMs); }
+    else                 { statsServer_append(output, "\"ping_ms\":null,"); }
+
+    if ( s.workAgeSeconds >= 0 ) { statsServer_append(output, "\"work_age_seconds\":%.3f,", s.workAgeSeconds); }
+    else                         { statsServer_append(output, "\"work_age_seconds\":null,"); }
+
+    statsServer_append(output, "\"watchdog\":{\"busy_seconds\":%.3f,\"limit_seconds\":%u},",
+                       s.watchdogBusySeconds, s.watchdogLimitSeconds);
+
+    statsServer_append(output, "\"share_queue\":{\"depth\":%u,\"max_depth\":%u,\"overflows\":%u,\"sent\":%u,\"send_p50_ms\":%.3f,\"send_p99_ms\":%.3f},",
+                       s.queueDepth, s.queueDepthMax, s.queueOverflows, s.sharesSent, s.shareSendP50us / 1000.0, s.shareSendP99us / 1000.0);
+
+    statsServer_append(output, "\"share_acks\":{\"accepted\":%u,\"rejected\":%u,\"unacknowledged\":%u,\"unmatched\":%u,\"rtt_p50_ms\":%.3f,\"rtt_p99_ms\":%.3f,",
+                       s.sharesAccepted, s.sharesRejected, s.sharesUnacknowledged, s.acksUnmatched, s.shareAckP50us / 1000.0, s.shareAckP99us / 1000.0);
+    statsServer_append(output, "\"stale\":{\"rejects\":%u,\"late_rejects\":%u,\"work_age_p50_s\":%.3f,\"late_by_p50_ms\":%.1f,\"late_by_p99_ms\":%.1f},\"reasons\":{",
+                       s.staleRejects, s.lateRejects, s.staleWorkAgeP50us / 1000000.0, s.staleLateByP50us / 1000.0, s.staleLateByP99us / 1000.0);
+    // reasons only contain letters, digits, spaces and '-._', see xptClient_countRejectReason()
+    for (uint32 i = 0; i < s.rejectReasonCount; i++) {
+        statsServer_append(output, "\"%s\":%u,", s.rejectReasons[i].reason, s.rejectReasons[i].count);
+    }
+    statsServer_append(output, "\"other\":%u}},", s.rejectOtherCount);
+
+    // Phase timings in milliseconds, matching the status line
+    output.append("\"devices\":[");
+    for (uint32 d = 0; d < metrics_getDeviceCount(); d++) {
+        metricsDevice_t* device = metrics_getDevice(d);
+        statsServer_append(output, "%s{\"name\":\"%s\",\"phases\":{", (d > 0 ? "," : ""), device->name);
+
+        for (uint32 p = 0; p < METRICS_PHASES; p++) {
+            metricsHistogram_t* histogram = &device->phase[p];
+            statsServer_append(output, "%s\"%s\":{\"count\":%u,\"p50_ms\":%.3f,\"p99_ms\":%.3f}",
+                               (p > 0 ? "," : ""), metrics_phaseNames[p], metrics_getCount(histogram),
+                               metrics_getPercentile(histogram, 50) / 1000.0, metrics_getPercentile(histogram, 99) / 1000.0);
+        }
+
+        statsServer_append(output, "},\"aborted_tables\":%d,\"avoided_seconds\":%.3f}",
+                           device->aborted_tables, device->avoided_ms / 1000.0);
+    }
+    output.append("]}\n");
+}
+
+static void statsServer_formatPrometheus(std::string& output)
+{
+    statsSnapshot_t s;
+    statsServer_takeSnapshot(&s);
+
+    // The collision and table counters restart with every new pool connection
+    statsServer_append(output, "# TYPE xptminer_collisions_total counter\nxptminer_collisions_total %u\n", s.collisions);
+    statsServer_append(output, "# TYPE xptminer_tables_total counter\nxptminer_tables_total %u\n", s.tables);
+    statsServer_append(output, "# TYPE xptminer_shares_total counter\nxptminer_shares_total %u\n", s.shares);
+    statsServer_append(output, "# TYPE xptminer_shares_invalid_total counter\nxptminer_shares_invalid_total %u\n", s.invalidShares);
+    statsServer_append(output, "# TYPE xptminer_block_height gauge\nxptminer_block_height %u\n", s.blockHeight);
+    statsServer_append(output, "# TYPE xptminer_mining_seconds gauge\nxptminer_mining_seconds %u\n", s.miningSeconds);
+    statsServer_append(output, "# TYPE xptminer_pool_connected gauge\nxptminer_pool_connected %d\n", s.connected ? 1 : 0);
+    statsServer_append(output, "# TYPE xptminer_pool_active gauge\nxptminer_pool_active %d\n", s.activePool);
+    statsServer_append(output, "# TYPE xptminer_pool_failovers_total counter\nxptminer_pool_failovers_total %u\n", s.poolFailovers);
+
+    if ( s.pingMs >= 0 ) {
+        statsServer_append(output, "# TYPE xptminer_pool_ping_seconds gauge\nxptminer_pool_ping_seconds %.4f\n", s.pingMs / 1000.0);
+    }
+
+    if ( s.workAgeSeconds >= 0 ) {
+        statsServer_append(output, "# TYPE xptminer_work_age_seconds gauge\nxptminer_work_age_seconds %.3f\n", s.workAgeSeconds);
+    }
+
+    statsServer_append(output, "# TYPE xptminer_watchdog_busy_seconds gauge\nxptminer_watchdog_busy_seconds %.3f\n", s.watchdogBusySeconds);
+    statsServer_append(output, "# TYPE xptminer_watchdog_limit_seconds gauge\nxptminer_watchdog_limit_seconds %u\n", s.watchdogLimitSeconds);
+
+    statsServer_append(output, "# TYPE xptminer_share_queue_depth gauge\nxptminer_share_queue_depth %u\n", s.queueDepth);
+    statsServer_append(output, "# TYPE xptminer_share_queue_depth_max gauge\nxptminer_share_queue_depth_max %u\n", s.queueDepthMax);
+    statsServer_append(output, "# TYPE xptminer_share_queue_overflows_total counter\nxptminer_share_queue_overflows_total %u\n", s.queueOverflows);
+    statsServer_append(output, "# TYPE xptminer_share_send_seconds summary\n");
+    statsServer_append(output, "xptminer_share_send_seconds{quantile=\"0.5\"} %.6f\n", s.shareSendP50us / 1000000.0);
+    statsServer_append(output, "xptminer_share_send_seconds{quantile=\"0.99\"} %.6f\n", s.shareSendP99us / 1000000.0);
+    statsServer_append(output, "xptminer_share_send_seconds_count %u\n", s.sharesSent);
+    statsServer_append(output, "# TYPE xptminer_share_acks_total counter\nxptminer_share_acks_total{result=\"accepted\",reason=\"\"} %u\n", s.sharesAccepted);
+    for (uint32 i = 0; i < s.rejectReasonCount; i++) {
+        statsServer_append(output, "xptminer_share_acks_total{result=\"rejected\",reason=\"%s\"} %u\n", s.rejectReasons[i].reason, s.rejectReasons[i].count);
+    }
+    statsServer_append(output, "xptminer_share_acks_total{result=\"rejected\",reason=\"other\"} %u\n", s.rejectOtherCount);
+    statsServer_append(output, "# TYPE xptminer_share_ack_seconds summary\n");
+    statsServer_append(output, "xptminer_share_ack_seconds{quantile=\"0.5\"} %.6f\n", s.shareAckP50us / 1000000.0);
+    statsServer_append(output, "xptminer_share_ack_seconds{quantile=\"0.99\"} %.6f\n", s.shareAckP99us / 1000000.0);
+    statsServer_append(output, "xptminer_share_ack_seconds_count %u\n", s.acks);
+    statsServer_append(output, "# TYPE xptminer_shares_unacknowledged_total counter\nxptminer_shares_unacknowledged_total %u\n", s.sharesUnacknowledged);
+    statsServer_append(output, "# TYPE xptminer_share_acks_unmatched_total counter\nxptminer_share_acks_unmatched_total %u\n", s.acksUnmatched);
+    statsServer_append(output, "# TYPE xptminer_shares_stale_total counter\nxptminer_shares_stale_total %u\n", s.staleRejects);
+    statsServer_append(output, "# TYPE xptminer_shares_stale_after_block_change_total counter\nxptminer_shares_stale_after_block_change_total %u\n", s.lateRejects);
+    statsServer_append(output, "# TYPE xptminer_share_stale_late_seconds summary\n");
+    statsServer_append(output, "xptminer_share_stale_late_seconds{quantile=\"0.5\"} %.6f\n", s.staleLateByP50us / 1000000.0);
+    statsServer_append(output, "xptminer_share_stale_late_seconds{quantile=\"0.99\"} %.6f\n", s.staleLateByP99us / 1000000.0);
+
+    output.append("# TYPE xptminer_tables_aborted_total counter\n");
+    for (uint32 d = 0; d < metrics_getDeviceCount(); d++) {
+        metricsDevice_t* device = metrics_getDevice(d);
+        statsServer_append(output, "xptminer_tables_aborted_total{device=\"%s\"} %d\n", device->name, device->aborted_tables);
+    }
+
+    output.append("# TYPE xptminer_abort_avoided_seconds_total counter\n");
+    for (uint32 d = 0; d < metrics_getDeviceCount(); d++) {
+        metricsDevice_t* device = metrics_getDevice(d);
+        statsServer_append(output, "xptminer_abort_avoided_seconds_total{device=\"%s\"} %.3f\n", device->name, device->avoided_ms / 1000.0);
+    }
+
+    output.append("# TYPE xptminer_phase_seconds summary\n");
+    for (uint32 d = 0; d < metrics_getDeviceCount(); d++) {
+        metricsDevice_t* device = metrics_getDevice(d);
+
+        for (uint32 p = 0; p < METRICS_PHASES; p++) {
+            metricsHistogram_t* histogram = &device->phase[p];
+            const char* phase = metrics_phaseNames[p];
+
+            statsServer_append(output, "xptminer_phase_seconds{device=\"%s\",phase=\"%s\",quantile=\"0.5\"} %.6f\n",
+                               device->name, phase, metrics_getPercentile(histogram, 50) / 1000000.0);
+            statsServer_append(output, "xptminer_phase_seconds{device=\"%s\",phase=\"%s\",quantile=\"0.99\"} %.6f\n",
+                               device->name, phase, metrics_getPercentile(histogram, 99) / 1000000.0);
+            statsServer_append(output, "xptminer_phase_seconds_count{device=\"%s\",phase=\"%s\"} %u\n",
+                               device->name, phase, metrics_getCount(histogram));
+        }
+    }
+}
+
+
+static void statsServer_send(SOCKET s, const char* status, const char* contentType, const std::string& body)
+{
+    std::string response;
+    statsServer_append(response, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+                       status, contentType, (uint32)body.size());
+    response.append(body);
+
+    const char* data = response.data();
+    uint32 remaining = (uint32)response.size();
+
+    while ( remaining > 0 ) {
+        int r = send(s, data, remaining, MSG_NOSIGNAL);
+        if ( r <= 0 ) { return; }
+
+        data += r;
+        remaining -= r;
+    }
+}
+
+static void statsServer_handleClient(SOCKET s)
+{
+#ifdef _WIN32
+    DWORD timeout = STATS_RECV_TIMEOUT_MS;
+#else
+    struct timeval timeout = { STATS_RECV_TIMEOUT_MS / 1000, (STATS_RECV_TIMEOUT_MS % 1000) * 1000 };
+#endif
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+    // Only the request line matters, read until the end of the headers
+    char request[STATS_REQUEST_SIZE];
+    uint32 length = 0;
+
+    while ( length < sizeof(request) - 1 ) {
+        int r = recv(s, request + length, sizeof(request) - 1 - length, 0);
+        if ( r <= 0 ) { break; }
+
+        length += r;
+        request[length] = '\0';
+        if ( strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL ) { break; }
+    }
+    request[length] = '\0';
+
+    char method[8] = {0}, path[256] = {0};
+    if ( sscanf(request, "%7s %255s", method, path) != 2 ) { return; }
+
+    // Query strings are ignored
+    char* query = strchr(path, '?');
+    if ( query != NULL ) { *query = '\0'; }
+
+    std::string body;
+
+    if ( strcmp(method, "GET") != 0 ) {
+        statsServer_send(s, "405 Method Not Allowed", "text/plain", "GET only\n");
+    } else if ( strcmp(path, "/") == 0 || strcmp(path, "/stats") == 0 ) {
+        statsServer_formatJson(body);
+        statsServer_send(s, "200 OK", "application/json", body);
+    } else if ( strcmp(path, "/metrics") == 0 ) {
+        statsServer_formatPrometheus(body);
+        statsServer_send(s, "200 OK", "text/plain; version=0.0.4", body);
+    } else {
+        statsServer_send(s, "404 Not Found", "text/plain", "Not found, try / or /metrics\n");
+    }
+}
+
+
+#ifdef _WIN32
+int statsServer_thread(int /* arg */)
+#else
+void *statsServer_thread(void * /* arg */)
+#endif
+{
+    while ( true ) {
+        SOCKET s = accept(statsServer_socket, NULL, NULL);
+        if ( s == SOCKET_ERROR ) {
+            Sleep(100);
+            continue;
+        }
+
+#ifdef __APPLE__
+        int noSigPipe = 1;
+        setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+        statsServer_handleClient(s);
+        closesocket(s);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Starts listening on 127.0.0.1:<port>, returns false if the port can't be bound
+ */
+bool statsServer_start(uint16 port)
+{
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if ( s == SOCKET_ERROR ) { return false; }
+
+    int reuse = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    SOCKADDR_IN addr;
+    memset(&addr, 0, sizeof(SOCKADDR_IN));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ( bind(s, (SOCKADDR*)&addr, sizeof(SOCKADDR_IN)) == SOCKET_ERROR || listen(s, 8) == SOCKET_ERROR ) {
+        closesocket(s);
+        return false;
+    }
+
+    statsServer_socket = s;
+    CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)statsServer_thread, (LPVOID)0, 0, NULL);
+
+    return true;
+}
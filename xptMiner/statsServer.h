@@ -0,0 +1,12 @@
+#ifndef __STATS_SERVER_H__
+#define __STATS_SERVER_H__
+#include "global.h"
+
+// Minimal HTTP listener on 127.0.0.1 for monitoring, served by a single background thread:
+//   GET /         - JSON snapshot of the counters and per-device phase timings
+//   GET /metrics  - the same values in the Prometheus text format
+// It only reads counters that are updated atomically or by a single writer and never takes a lock
+// that the miner threads or the connection loop hold, so a slow client can't stall mining.
+bool statsServer_start(uint16 port);
+
+#endif
@@ -27,25 +27,34 @@ void bitclient_addVarIntFromStream(stream_t* msgStream, uint64 varInt)
 	}
 }
 
-void bitclient_generateTxHash(uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase1Length, uint8* coinBase1, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash)
+/*
+ * Hashes the part of the coinbase transaction that is the same for every extra nonce
+ * The returned context is a midstate that can be reused with bitclient_generateTxHashFromMidstate()
+ */
+void bitclient_generateCoinbaseMidstate(uint32 coinBase1Length, uint8* coinBase1, sha256_ctx* midstate)
+{
+	sha256_init(midstate);
+	sha256_update(midstate, coinBase1, coinBase1Length);
+}
+
+void bitclient_generateTxHashFromMidstate(sha256_ctx* midstate, uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash)
 {
-	stream_t* streamTXData = streamEx_fromDynamicMemoryRange(1024*32);
-	stream_writeData(streamTXData, coinBase1, coinBase1Length);
-	stream_writeData(streamTXData, userExtraNonce, userExtraNonceLength);
-	stream_writeData(streamTXData, coinBase2, coinBase2Length);
-	sint32 transactionDataLength = 0;
-	uint8* transactionData = (uint8*)streamEx_map(streamTXData, &transactionDataLength);
-	// special case, we can use the hash of the transaction
+	// the midstate is only read, the copy continues with the extra nonce
 	uint8 hashOut[32];
-	sha256_ctx sctx;
-	sha256_init(&sctx);
-	sha256_update(&sctx, transactionData, transactionDataLength);
+	sha256_ctx sctx = *midstate;
+	sha256_update(&sctx, userExtraNonce, userExtraNonceLength);
+	sha256_update(&sctx, coinBase2, coinBase2Length);
 	sha256_final(&sctx, hashOut);
 	sha256_init(&sctx);
 	sha256_update(&sctx, hashOut, 32);
 	sha256_final(&sctx, txHash);
-	free(transactionData);
-	stream_destroy(streamTXData);
+}
+
+void bitclient_generateTxHash(uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase1Length, uint8* coinBase1, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash)
+{
+	sha256_ctx midstate;
+	bitclient_generateCoinbaseMidstate(coinBase1Length, coinBase1, &midstate);
+	bitclient_generateTxHashFromMidstate(&midstate, userExtraNonceLength, userExtraNonce, coinBase2Length, coinBase2, txHash);
 }
 
 void bitclient_calculateMerkleRoot(uint8* txHashes, uint32 numberOfTxHashes, uint8* merkleRoot)
@@ -123,4 +132,59 @@ void bitclient_calculateMerkleRoot(uint8* txHashes, uint32 numberOfTxHashes, uin
 		}
 		free(hashData);
 	}
-}
\ No newline at end of file
+}
+static void bitclient_hashMerklePair(uint8* left, uint8* right, uint8* hashOut)
+{
+	uint8 hashData[64];
+	uint8 hashTemp[32];
+	memcpy(hashData, left, 32);
+	memcpy(hashData+32, right, 32);
+	sha256_ctx sctx;
+	sha256_init(&sctx);
+	sha256_update(&sctx, hashData, 64);
+	sha256_final(&sctx, hashTemp);
+	sha256_init(&sctx);
+	sha256_update(&sctx, hashTemp, 32);
+	sha256_final(&sctx, hashOut);
+}
+
+/*
+ * Calculates the merkle branch of the first transaction (the coinbase), that is the sibling hash on every layer of the tree
+ * Only txHashes[1...] is read, the coinbase hash itself doesn't affect the branch
+ * Returns the number of hashes written to merkleBranch (up to MERKLE_BRANCH_MAX_LENGTH)
+ */
+uint32 bitclient_calculateMerkleBranch(uint8* txHashes, uint32 numberOfTxHashes, uint8* merkleBranch)
+{
+	uint32 branchLength = 0;
+	uint32 layerSize = numberOfTxHashes;
+	// one spare hash for duplicating the last one
+	uint8* hashData = (uint8*)malloc(32*(numberOfTxHashes+1));
+	memcpy(hashData, txHashes, 32*numberOfTxHashes);
+	while( layerSize > 1 && branchLength < MERKLE_BRANCH_MAX_LENGTH )
+	{
+		if( layerSize&1 )
+		{
+			// duplicate last hash
+			memcpy(hashData+(layerSize*32), hashData+((layerSize-1)*32), 32);
+			layerSize++;
+		}
+		memcpy(merkleBranch+(branchLength*32), hashData+32, 32);
+		branchLength++;
+		// hash the next layer, except for the path of the coinbase which is calculated per extra nonce
+		for(uint32 i=1; i<layerSize/2; i++)
+			bitclient_hashMerklePair(hashData+(i*2*32), hashData+(i*2*32+32), hashData+(i*32));
+		layerSize /= 2;
+	}
+	free(hashData);
+	return branchLength;
+}
+
+/*
+ * Calculates the merkle root from the coinbase hash and its merkle branch
+ */
+void bitclient_calculateMerkleRootFromBranch(uint8* coinbaseTxHash, uint8* merkleBranch, uint32 branchLength, uint8* merkleRoot)
+{
+	memcpy(merkleRoot, coinbaseTxHash, 32);
+	for(uint32 i=0; i<branchLength; i++)
+		bitclient_hashMerklePair(merkleRoot, merkleBranch+(i*32), merkleRoot);
+}
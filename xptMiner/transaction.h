@@ -1,5 +1,11 @@
 
 void bitclient_generateTxHash(uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase1Length, uint8* coinBase1, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash);
+void bitclient_generateCoinbaseMidstate(uint32 coinBase1Length, uint8* coinBase1, sha256_ctx* midstate);
+void bitclient_generateTxHashFromMidstate(sha256_ctx* midstate, uint32 userExtraNonceLength, uint8* userExtraNonce, uint32 coinBase2Length, uint8* coinBase2, uint8* txHash);
 void bitclient_calculateMerkleRoot(uint8* txHashes, uint32 numberOfTxHashes, uint8* merkleRoot);
+// coinbase merkle branch, enough for 2^32 transactions
+#define MERKLE_BRANCH_MAX_LENGTH	(32)
+uint32 bitclient_calculateMerkleBranch(uint8* txHashes, uint32 numberOfTxHashes, uint8* merkleBranch);
+void bitclient_calculateMerkleRootFromBranch(uint8* coinbaseTxHash, uint8* merkleBranch, uint32 branchLength, uint8* merkleRoot);
 // misc
 void bitclient_addVarIntFromStream(stream_t* msgStream, uint64 varInt);
\ No newline at end of file
@@ -15,6 +15,18 @@ void LeaveCriticalSection(CRITICAL_SECTION *s){
     pthread_mutex_unlock(&s->mutex);
 }
 
+void InitializeConditionVariable(CONDITION_VARIABLE *c){
+    pthread_cond_init(&c->cond, NULL);
+}
+
+bool SleepConditionVariableCS(CONDITION_VARIABLE *c, CRITICAL_SECTION *s, uint32_t /* ms */){
+    return pthread_cond_wait(&c->cond, &s->mutex) == 0;
+}
+
+void WakeAllConditionVariable(CONDITION_VARIABLE *c){
+    pthread_cond_broadcast(&c->cond);
+}
+
 void CreateThread(LPVOID ig1, size_t ig2, LPTHREAD_START_ROUTINE func, LPVOID arg, uint32_t ig3,  LPDWORD tid){
     pthread_t thread;
     pthread_create(&thread, NULL, func, arg);
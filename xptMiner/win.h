@@ -64,12 +64,36 @@ void EnterCriticalSection(CRITICAL_SECTION *s);
 
 void LeaveCriticalSection(CRITICAL_SECTION *s);
 
+typedef struct {
+    pthread_cond_t cond;
+} CONDITION_VARIABLE;
+
+#define INFINITE 0xFFFFFFFF
+
+void InitializeConditionVariable(CONDITION_VARIABLE *c);
+
+// Only INFINITE waits are supported, the critical section must be entered exactly once
+bool SleepConditionVariableCS(CONDITION_VARIABLE *c, CRITICAL_SECTION *s, uint32_t ms);
+
+void WakeAllConditionVariable(CONDITION_VARIABLE *c);
+
 void CreateThread(LPVOID ig1, size_t ig2, LPTHREAD_START_ROUTINE func, LPVOID arg, uint32_t ig3,  LPDWORD tid);
 
 #define __declspec(x) __##x
 
 #define Sleep(x) usleep(x*1000)
 
+typedef int32_t LONG;
+
+#define InterlockedIncrement(x) __sync_add_and_fetch((x), 1)
+#define InterlockedDecrement(x) __sync_sub_and_fetch((x), 1)
+#define InterlockedExchangeAdd(x, v) __sync_fetch_and_add((x), (v))
+#define InterlockedOr(x, v) __sync_fetch_and_or((x), (v))
+#define InterlockedCompareExchange(x, exchange, comparand) __sync_val_compare_and_swap((x), (comparand), (exchange))
+#define InterlockedExchangePointer(x, v) __atomic_exchange_n((x), (v), __ATOMIC_SEQ_CST)
+
+#define MemoryBarrier() __sync_synchronize()
+
 #define __debugbreak() raise(SIGTRAP)
 
 #define GetTickCount() (uint32) (time(NULL) - 1383638888) * 1000 // A quick hack for time_t overflow
@@ -0,0 +1,125 @@
+#include "global.h"
+#include "workerPool.h"
+#include "affinity.h"
+
+typedef struct
+{
+    WorkerPool* pool;
+    uint32 thread_index;
+    std::vector<uint32> cpus; // empty = not pinned
+}workerPoolThreadArg_t;
+
+
+WorkerPool::WorkerPool(uint32 _num_threads, const std::vector<uint32>& cpus)
+{
+    this->num_threads = std::max(_num_threads, (uint32)1);
+    this->job = NULL;
+    this->job_context = NULL;
+    this->job_items = 0;
+    this->next_item = 0;
+    this->generation = 0;
+    this->items_done = 0;
+    InitializeCriticalSection(&cs_job);
+    InitializeConditionVariable(&cv_job_started);
+    InitializeConditionVariable(&cv_job_done);
+
+    // Thread 0 is whoever calls run()
+    for (uint32 i = 1; i < num_threads; i++) {
+        workerPoolThreadArg_t* arg = new workerPoolThreadArg_t;
+        arg->pool = this;
+        arg->thread_index = i;
+
+        if (!cpus.empty()) {
+            arg->cpus.push_back(cpus[i % cpus.size()]);
+        }
+
+        CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)WorkerPool::worker_thread, (LPVOID)arg, 0, NULL);
+    }
+}
+
+
+void WorkerPool::process_items(uint32 thread_index, LONG job_generation)
+{
+    bool item_finished = false;
+
+    while (true) {
+        // Items are large, so claiming them under a lock is cheap.
+        // The generation check keeps late threads from claiming items of a newer job with stale state.
+        EnterCriticalSection(&cs_job);
+        if (item_finished) {
+            // run() does not start a new generation before all items are done, so this is still our job
+            items_done++;
+            if (items_done == job_items) {
+                WakeAllConditionVariable(&cv_job_done);
+            }
+        }
+        if (generation != job_generation || next_item >= job_items) {
+            LeaveCriticalSection(&cs_job);
+            break;
+        }
+        uint32 item = next_item++;
+        workerPoolJob_t item_job = job;
+        void* item_context = job_context;
+        LeaveCriticalSection(&cs_job);
+
+        item_job(item_context, thread_index, item);
+        item_finished = true;
+    }
+}
+
+
+void WorkerPool::run(workerPoolJob_t _job, void* context, uint32 item_count)
+{
+    if (item_count == 0) { return; }
+
+    EnterCriticalSection(&cs_job);
+    this->job = _job;
+    this->job_context = context;
+    this->job_items = item_count;
+    this->next_item = 0;
+    this->items_done = 0;
+    LONG job_generation = ++generation;
+    WakeAllConditionVariable(&cv_job_started);
+    LeaveCriticalSection(&cs_job);
+
+    process_items(0, job_generation);
+
+    // Wait for items still being processed by other threads
+    EnterCriticalSection(&cs_job);
+    while (items_done < item_count) {
+        SleepConditionVariableCS(&cv_job_done, &cs_job, INFINITE);
+    }
+    LeaveCriticalSection(&cs_job);
+}
+
+
+#ifdef _WIN32
+int WorkerPool::worker_thread(LPVOID _arg)
+#else
+void* WorkerPool::worker_thread(void* _arg)
+#endif
+{
+    workerPoolThreadArg_t* arg = (workerPoolThreadArg_t*)_arg;
+    WorkerPool* pool = arg->pool;
+    uint32 thread_index = arg->thread_index;
+
+    // Pinned before the thread touches its buffers, so first-touch places them on the local node
+    affinity_pinCurrentThread(arg->cpus);
+    delete arg;
+
+    LONG seen_generation = 0;
+
+    while (true) {
+        // Idle threads block until run() publishes the next job
+        EnterCriticalSection(&pool->cs_job);
+        while (pool->generation == seen_generation) {
+            SleepConditionVariableCS(&pool->cv_job_started, &pool->cs_job, INFINITE);
+        }
+        seen_generation = pool->generation;
+        LeaveCriticalSection(&pool->cs_job);
+
+        pool->process_items(thread_index, seen_generation);
+    }
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+#include "global.h"
+
+// Processes a single work item, thread_index is 0 for the calling thread and 1..N-1 for pool threads
+typedef void (*workerPoolJob_t)(void* context, uint32 thread_index, uint32 item);
+
+// Fixed set of CPU threads that split a job into independent work items.
+// The thread calling run() takes part in the job, so a pool of 1 thread spawns no extra threads.
+class WorkerPool {
+public:
+    // Pool thread i is pinned to cpus[i % cpus.size()] unless cpus is empty, the caller pins itself
+    WorkerPool(uint32 num_threads, const std::vector<uint32>& cpus = std::vector<uint32>());
+    uint32 getNumThreads() { return num_threads; }
+
+    // Runs job on items [0, item_count) and returns once all items are done
+    void run(workerPoolJob_t job, void* context, uint32 item_count);
+
+private:
+    uint32 num_threads;
+
+    // Job description, guarded by cs_job
+    CRITICAL_SECTION cs_job;
+    CONDITION_VARIABLE cv_job_started; // signaled when generation changes
+    CONDITION_VARIABLE cv_job_done;    // signaled when items_done reaches job_items
+    workerPoolJob_t job;
+    void* job_context;
+    uint32 job_items;
+    uint32 next_item;
+    LONG generation;
+    uint32 items_done;
+
+    void process_items(uint32 thread_index, LONG job_generation);
+
+#ifdef _WIN32
+    static int worker_thread(LPVOID arg);
+#else
+    static void* worker_thread(void* arg);
+#endif
+};
+
+#endif
@@ -3,46 +3,94 @@
 #ifndef _WIN32
 #include <errno.h>
 #include <cstring>
+#include <cctype>
 #endif
 
 #include <iostream>
 #define SHA2_TYPES
 #include "sha2.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define XPT_SEND_BATCH		(16)	// queued packets combined into one send call
 /*
- + * Tries to establish a connection to the given ip:port
- + * Uses a blocking connect operation
- + */
-#ifdef _WIN32
+ * Starts a connection to the given ip:port
+ * Uses a non-blocking connect operation, xptClient_process() waits for it to complete
+ * Returns SOCKET_ERROR if the attempt failed right away
+ */
 SOCKET xptClient_openConnection(char *IP, int Port)
 {
 	SOCKET s=socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
 	if( s == SOCKET_ERROR )
 		return SOCKET_ERROR;
-	SOCKADDR_IN addr;
-	memset(&addr,0,sizeof(SOCKADDR_IN));
+	// set socket as non-blocking
+#ifdef _WIN32
+	unsigned int nonblocking=1;
+	unsigned int cbRet;
+	WSAIoctl(s, FIONBIO, &nonblocking, sizeof(nonblocking), NULL, 0, (LPDWORD)&cbRet, NULL, NULL);
+#else
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+	sockaddr_in addr;
+	memset(&addr,0,sizeof(sockaddr_in));
 	addr.sin_family=AF_INET;
 	addr.sin_port=htons(Port);
 	addr.sin_addr.s_addr=inet_addr(IP);
-	int result = connect(s,(SOCKADDR*)&addr,sizeof(SOCKADDR_IN));
+	int result = connect(s,(sockaddr*)&addr,sizeof(sockaddr_in));
 	if( result )
 	{
-		return SOCKET_ERROR;
-	}
+#ifdef _WIN32
+		bool inProgress = (WSAGetLastError() == WSAEWOULDBLOCK);
 #else
-int xptClient_openConnection(char *IP, int Port)
-{
-  int s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  struct sockaddr_in addr;
-  memset(&addr, 0, sizeof(sockaddr_in));
-  addr.sin_family = AF_INET;
-  addr.sin_port=htons(Port);
-  addr.sin_addr.s_addr = inet_addr(IP);
-  int result = connect(s, (sockaddr*)&addr, sizeof(sockaddr_in));
+		bool inProgress = (errno == EINPROGRESS);
 #endif
-
+		if( inProgress == false )
+		{
+			closesocket(s);
+			return SOCKET_ERROR;
+		}
+	}
 	return s;
 }
 
+/*
+ * Checks whether the pending connect operation finished
+ * Sends the login once connected, marks the client as disconnected if the attempt failed or timed out
+ */
+bool xptClient_completeConnect(xptClient_t* xptClient)
+{
+	fd_set writeSet;
+	fd_set exceptSet;
+	FD_ZERO(&writeSet);
+	FD_ZERO(&exceptSet);
+	FD_SET(xptClient->clientSocket, &writeSet);
+	FD_SET(xptClient->clientSocket, &exceptSet);
+	timeval timeout = {0, 0};
+	sint32 r = select(xptClient->clientSocket+1, NULL, &writeSet, &exceptSet, &timeout);
+	if( r == 0 )
+	{
+		// still waiting
+		if( getTimeMilliseconds() - xptClient->connectTime >= XPT_CONNECT_TIMEOUT )
+		{
+			xptClient->disconnected = true;
+			return false;
+		}
+		return true;
+	}
+	sint32 socketError = 0;
+	socklen_t socketErrorLength = sizeof(socketError);
+	if( r < 0 || getsockopt(xptClient->clientSocket, SOL_SOCKET, SO_ERROR, (char*)&socketError, &socketErrorLength) != 0 || socketError != 0 )
+	{
+		xptClient->disconnected = true;
+		return false;
+	}
+	xptClient->connecting = false;
+	xptClient_sendWorkerLogin(xptClient);
+	return true;
+}
+
 /*
  * Creates a new xptClient connection object, does not initiate connection right away
  */
@@ -60,7 +108,8 @@ xptClient_t* xptClient_create()
 
 	InitializeCriticalSection(&xptClient->cs_shareSubmit);
 	InitializeCriticalSection(&xptClient->cs_workAccess);
-	xptClient->list_shareSubmitQueue = simpleList_create(4);
+	xptClient->sendQueue = (xptOutboundPacket_t*)malloc(sizeof(xptOutboundPacket_t)*XPT_SEND_QUEUE_SIZE);
+	xptClient->list_sendOverflow = simpleList_create(4);
 	// return object
 	return xptClient;
 }
@@ -76,36 +125,57 @@ bool xptClient_connect(xptClient_t* xptClient, generalRequestTarget_t* target)
 	if( xptClient->disconnected == false )
 		return false;
 	// first try to connect to the given host/port
-#ifdef _WIN32
 	SOCKET clientSocket = xptClient_openConnection(target->ip, target->port);
 	if( clientSocket == SOCKET_ERROR )
 		return false;
-#else
-  int clientSocket = xptClient_openConnection(target->ip, target->port);
-		if( clientSocket == 0 )
-					return false;
-#endif
-
-#ifdef _WIN32
-	// set socket as non-blocking
-	unsigned int nonblocking=1;
-	unsigned int cbRet;
-	WSAIoctl(clientSocket, FIONBIO, &nonblocking, sizeof(nonblocking), NULL, 0, (LPDWORD)&cbRet, NULL, NULL);
-#else
-  int flags, err;
-  flags = fcntl(clientSocket, F_GETFL, 0); 
-  flags |= O_NONBLOCK;
-  err = fcntl(clientSocket, F_SETFL, flags); //ignore errors for now..
-#endif
 	// initialize the connection details
 	xptClient->clientSocket = clientSocket;
+	xptClient->connecting = true;
+	xptClient->connectTime = getTimeMilliseconds();
+	xptClient->clientState = XPT_CLIENT_STATE_NEW;
+	xptClient->loginRejected = false;
+	xptClient->recvIndex = 0;
+	xptClient->recvSize = 0;
+	xptClient->opcode = 0;
+	// queued packets survive reconnects with the same login, a partially sent one is sent again from the start
+	// shares queued for another login were built on its work and are dropped
+	xptClient->sendQueueOffset = 0;
+	bool sameLogin = strcmp(xptClient->username, target->authUser) == 0 && strcmp(xptClient->password, target->authPass) == 0;
+	uint32 droppedShares = 0;
+	EnterCriticalSection(&xptClient->cs_shareSubmit);
+	if( sameLogin == false )
+	{
+		xptClient->sendQueueHead = xptClient->sendQueueTail;
+		for(uint32 i=0; i<xptClient->list_sendOverflow->objectCount; i++)
+			free(xptClient->list_sendOverflow->objects[i]);
+		xptClient->list_sendOverflow->objectCount = 0;
+	}
+	for(uint32 i=0; i<XPT_INFLIGHT_SHARES; i++)
+	{
+		xptInflightShare_t* inflight = xptClient->inflightShares+i;
+		if( inflight->shareId == 0 )
+			continue;
+		if( inflight->sent )
+		{
+			// shares sent on the old connection never get their ack
+			inflight->shareId = 0;
+			xptClient->sharesUnacknowledged++;
+		}
+		else if( sameLogin == false )
+		{
+			inflight->shareId = 0;
+			droppedShares++;
+		}
+	}
+	LeaveCriticalSection(&xptClient->cs_shareSubmit);
+	if( droppedShares > 0 )
+		printf("Dropped %d queued shares of the previous login\n", droppedShares);
 
 	strncpy(xptClient->username, target->authUser ,127);
 	strncpy(xptClient->password, target->authPass, 127);
 	// reset old work info
 	memset(&xptClient->blockWorkInfo, 0x00, sizeof(xptBlockWorkInfo_t));
-
-	xptClient_sendWorkerLogin(xptClient);
+	// the login is sent by xptClient_process() once the connection is established
 
 	// mark as connected
 	xptClient->disconnected = false;
@@ -119,15 +189,16 @@ bool xptClient_connect(xptClient_t* xptClient, generalRequestTarget_t* target)
  */
 void xptClient_forceDisconnect(xptClient_t* xptClient)
 {
-	if( xptClient->disconnected )
-		return; // already disconnected
-
+	// xptClient_process() only flags a lost connection, the socket is closed here
 	if( xptClient->clientSocket != SOCKET_ERROR )
 	{
 		closesocket(xptClient->clientSocket);
 		xptClient->clientSocket = SOCKET_ERROR;
-    
 	}
+	if( xptClient->disconnected )
+		return; // already disconnected
+
+	xptClient->connecting = false;
 	xptClient->disconnected = true;
 	// mark work as unavailable
 	xptClient->hasWorkData = false;
@@ -146,7 +217,10 @@ void xptClient_free(xptClient_t* xptClient)
 		closesocket(xptClient->clientSocket);
 	}
 	
-	simpleList_free(xptClient->list_shareSubmitQueue);
+	for(uint32 i=0; i<xptClient->list_sendOverflow->objectCount; i++)
+		free(xptClient->list_sendOverflow->objects[i]);
+	simpleList_free(xptClient->list_sendOverflow);
+	free(xptClient->sendQueue);
 	free(xptClient);
 }
 
@@ -399,57 +473,241 @@ void xptClient_sendWorkerLogin(xptClient_t* xptClient)
 }
 
 /*
- * Sends the share packet
+ * Starts tracking a share until its ack arrives, returns the share id
+ * Must be called with cs_shareSubmit held
+ */
+static uint32 xptClient_trackShare(xptClient_t* xptClient, xptShareToSubmit_t* xptShareToSubmit, uint64 submitTime)
+{
+	xptClient->nextShareId++;
+	if( xptClient->nextShareId == 0 )
+		xptClient->nextShareId = 1;
+	uint32 shareId = xptClient->nextShareId;
+	xptInflightShare_t* inflight = xptClient->inflightShares + (shareId & (XPT_INFLIGHT_SHARES-1));
+	if( inflight->shareId != 0 )
+		xptClient->sharesUnacknowledged++; // XPT_INFLIGHT_SHARES newer shares and still no ack
+	inflight->shareId = shareId;
+	inflight->sent = false;
+	inflight->submitTime = submitTime;
+	inflight->workAge = (xptShareToSubmit->workTime != 0) ? metrics_ticksToMicroseconds(submitTime - xptShareToSubmit->workTime) : 0;
+	// the pool moved on while the share was being found, revalidated or queued
+	inflight->outdated = (xptShareToSubmit->blockHeight != 0 && xptShareToSubmit->blockHeight < xptClient->blockChangeHeight);
+	inflight->lateBy = inflight->outdated ? metrics_ticksToMicroseconds(submitTime - xptClient->blockChangeTime) : 0;
+	return shareId;
+}
+
+/*
+ * Appends a finalized packet to the outbound queue, it is sent by the next xptClient_process() call
+ * Callable from any thread. If the ring is full the packet goes to the overflow list, so nothing is ever dropped.
+ * For shares the id is assigned here and written into the last 4 bytes of the packet, so ids are in send order.
+ */
+void xptClient_queuePacket(xptClient_t* xptClient, xptPacketbuffer_t* pb, xptShareToSubmit_t* xptShareToSubmit)
+{
+	uint64 queueTime = getTimeHighRes();
+	EnterCriticalSection(&xptClient->cs_shareSubmit);
+	uint32 shareId = 0;
+	if( xptShareToSubmit )
+	{
+		shareId = xptClient_trackShare(xptClient, xptShareToSubmit, queueTime);
+		*(uint32*)(pb->buffer+pb->parserIndex-4) = shareId;
+	}
+	xptOutboundPacket_t* packet;
+	if( (xptClient->sendQueueTail - xptClient->sendQueueHead) < XPT_SEND_QUEUE_SIZE && xptClient->list_sendOverflow->objectCount == 0 )
+	{
+		packet = xptClient->sendQueue + (xptClient->sendQueueTail & (XPT_SEND_QUEUE_SIZE-1));
+		xptClient->sendQueueTail++;
+	}
+	else
+	{
+		packet = (xptOutboundPacket_t*)malloc(sizeof(xptOutboundPacket_t));
+		simpleList_add(xptClient->list_sendOverflow, packet);
+		xptClient->sendOverflowCount++;
+	}
+	packet->size = pb->parserIndex;
+	packet->shareId = shareId;
+	packet->queueTime = queueTime;
+	memcpy(packet->data, pb->buffer, pb->parserIndex);
+	uint32 depth = (xptClient->sendQueueTail - xptClient->sendQueueHead) + xptClient->list_sendOverflow->objectCount;
+	if( depth > xptClient->sendQueueDepthMax )
+		xptClient->sendQueueDepthMax = depth;
+	LeaveCriticalSection(&xptClient->cs_shareSubmit);
+}
+
+/*
+ * Returns the number of packets waiting to be sent
+ */
+uint32 xptClient_getSendQueueDepth(xptClient_t* xptClient)
+{
+	return (xptClient->sendQueueTail - xptClient->sendQueueHead) + xptClient->list_sendOverflow->objectCount;
+}
+
+/*
+ * Sends queued packets, up to XPT_SEND_BATCH of them with each send call
+ * Stops when the socket is full and resumes short writes on the next call
+ * Returns false if the connection failed
+ */
+bool xptClient_flushSendQueue(xptClient_t* xptClient)
+{
+	// shares are only accepted after the login
+	if( xptClient->clientState != XPT_CLIENT_STATE_LOGGED_IN )
+		return true;
+	EnterCriticalSection(&xptClient->cs_shareSubmit);
+	// refill the ring from the overflow list
+	uint32 moved = 0;
+	while( moved < xptClient->list_sendOverflow->objectCount && (xptClient->sendQueueTail - xptClient->sendQueueHead) < XPT_SEND_QUEUE_SIZE )
+	{
+		xptOutboundPacket_t* packet = (xptOutboundPacket_t*)xptClient->list_sendOverflow->objects[moved];
+		memcpy(xptClient->sendQueue + (xptClient->sendQueueTail & (XPT_SEND_QUEUE_SIZE-1)), packet, sizeof(xptOutboundPacket_t));
+		xptClient->sendQueueTail++;
+		free(packet);
+		moved++;
+	}
+	if( moved > 0 )
+	{
+		simpleList_t* overflow = xptClient->list_sendOverflow;
+		overflow->objectCount -= moved;
+		memmove(overflow->objects, overflow->objects+moved, overflow->objectCount*sizeof(void*));
+	}
+	uint32 head = xptClient->sendQueueHead;
+	uint32 tail = xptClient->sendQueueTail;
+	LeaveCriticalSection(&xptClient->cs_shareSubmit);
+	// the slots between head and tail are not touched by other threads
+	bool connectionError = false;
+	while( head != tail )
+	{
+		uint32 packetCount = std::min(tail-head, (uint32)XPT_SEND_BATCH);
+#ifdef _WIN32
+		WSABUF buffers[XPT_SEND_BATCH];
+		for(uint32 i=0; i<packetCount; i++)
+		{
+			xptOutboundPacket_t* packet = xptClient->sendQueue + ((head+i) & (XPT_SEND_QUEUE_SIZE-1));
+			uint32 offset = (i == 0) ? xptClient->sendQueueOffset : 0;
+			buffers[i].buf = (char*)(packet->data+offset);
+			buffers[i].len = packet->size-offset;
+		}
+		DWORD bytesSent = 0;
+		sint32 r = (WSASend(xptClient->clientSocket, buffers, packetCount, &bytesSent, 0, NULL, NULL) == 0) ? (sint32)bytesSent : -1;
+		if( r <= 0 )
+		{
+			if( r < 0 && WSAGetLastError() == WSAEWOULDBLOCK )
+				break;
+			connectionError = true;
+			break;
+		}
+#else
+		iovec buffers[XPT_SEND_BATCH];
+		for(uint32 i=0; i<packetCount; i++)
+		{
+			xptOutboundPacket_t* packet = xptClient->sendQueue + ((head+i) & (XPT_SEND_QUEUE_SIZE-1));
+			uint32 offset = (i == 0) ? xptClient->sendQueueOffset : 0;
+			buffers[i].iov_base = packet->data+offset;
+			buffers[i].iov_len = packet->size-offset;
+		}
+		msghdr message;
+		memset(&message, 0x00, sizeof(msghdr));
+		message.msg_iov = buffers;
+		message.msg_iovlen = packetCount;
+		sint32 r = (sint32)sendmsg(xptClient->clientSocket, &message, MSG_NOSIGNAL);
+		if( r <= 0 )
+		{
+			if( r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+				break;
+			connectionError = true;
+			break;
+		}
+#endif
+		// consume the sent packets
+		uint32 sent = (uint32)r;
+		while( sent > 0 )
+		{
+			xptOutboundPacket_t* packet = xptClient->sendQueue + (head & (XPT_SEND_QUEUE_SIZE-1));
+			uint32 part = std::min(sent, packet->size-xptClient->sendQueueOffset);
+			xptClient->sendQueueOffset += part;
+			sent -= part;
+			if( xptClient->sendQueueOffset == packet->size )
+			{
+				if( packet->shareId != 0 )
+				{
+					metrics_record(&xptClient->shareSendLatency, metrics_elapsedMicroseconds(packet->queueTime));
+					EnterCriticalSection(&xptClient->cs_shareSubmit);
+					xptInflightShare_t* inflight = xptClient->inflightShares + (packet->shareId & (XPT_INFLIGHT_SHARES-1));
+					if( inflight->shareId == packet->shareId )
+						inflight->sent = true;
+					LeaveCriticalSection(&xptClient->cs_shareSubmit);
+				}
+				xptClient->sendQueueOffset = 0;
+				head++;
+			}
+		}
+	}
+	EnterCriticalSection(&xptClient->cs_shareSubmit);
+	xptClient->sendQueueHead = head;
+	LeaveCriticalSection(&xptClient->cs_shareSubmit);
+	if( connectionError )
+	{
+		xptClient->disconnected = true;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Serialises the share packet and queues it for sending
  */
 void xptClient_sendShare(xptClient_t* xptClient, xptShareToSubmit_t* xptShareToSubmit)
 {
-	// build the packet
+	// build the packet in a local buffer, the shared sendBuffer belongs to the connection loop
+	uint8 packetData[XPT_SEND_PACKET_MAX];
+	xptPacketbuffer_t packetBuffer;
+	memset(&packetBuffer, 0x00, sizeof(xptPacketbuffer_t));
+	packetBuffer.buffer = packetData;
+	packetBuffer.bufferLimit = XPT_SEND_PACKET_MAX;
+	xptPacketbuffer_t* sendBuffer = &packetBuffer;
 	bool sendError = false;
-	xptPacketbuffer_beginWritePacket(xptClient->sendBuffer, XPT_OPC_C_SUBMIT_SHARE);
-	xptPacketbuffer_writeData(xptClient->sendBuffer, xptShareToSubmit->merkleRoot, 32, &sendError);		// merkleRoot
-	xptPacketbuffer_writeData(xptClient->sendBuffer, xptShareToSubmit->prevBlockHash, 32, &sendError);	// prevBlock
-	xptPacketbuffer_writeU32(xptClient->sendBuffer, &sendError, xptShareToSubmit->version);				// version
-	xptPacketbuffer_writeU32(xptClient->sendBuffer, &sendError, xptShareToSubmit->nTime);				// nTime
-	xptPacketbuffer_writeU32(xptClient->sendBuffer, &sendError, xptShareToSubmit->nonce);				// nNonce
-	xptPacketbuffer_writeU32(xptClient->sendBuffer, &sendError, xptShareToSubmit->nBits);				// nBits
+	xptPacketbuffer_beginWritePacket(sendBuffer, XPT_OPC_C_SUBMIT_SHARE);
+	xptPacketbuffer_writeData(sendBuffer, xptShareToSubmit->merkleRoot, 32, &sendError);		// merkleRoot
+	xptPacketbuffer_writeData(sendBuffer, xptShareToSubmit->prevBlockHash, 32, &sendError);	// prevBlock
+	xptPacketbuffer_writeU32(sendBuffer, &sendError, xptShareToSubmit->version);				// version
+	xptPacketbuffer_writeU32(sendBuffer, &sendError, xptShareToSubmit->nTime);				// nTime
+	xptPacketbuffer_writeU32(sendBuffer, &sendError, xptShareToSubmit->nonce);				// nNonce
+	xptPacketbuffer_writeU32(sendBuffer, &sendError, xptShareToSubmit->nBits);				// nBits
 	// algorithm specific
 	if( xptShareToSubmit->algorithm == ALGORITHM_PRIME )
 	{
-		xptPacketbuffer_writeU32(xptClient->sendBuffer, &sendError, xptShareToSubmit->sieveSize);			// sieveSize
-		xptPacketbuffer_writeU32(xptClient->sendBuffer, &sendError, xptShareToSubmit->sieveCandidate);		// sieveCandidate
+		xptPacketbuffer_writeU32(sendBuffer, &sendError, xptShareToSubmit->sieveSize);			// sieveSize
+		xptPacketbuffer_writeU32(sendBuffer, &sendError, xptShareToSubmit->sieveCandidate);		// sieveCandidate
 		// bnFixedMultiplier
-		xptPacketbuffer_writeU8(xptClient->sendBuffer, &sendError, xptShareToSubmit->fixedMultiplierSize);
-		xptPacketbuffer_writeData(xptClient->sendBuffer, xptShareToSubmit->fixedMultiplier, xptShareToSubmit->fixedMultiplierSize, &sendError);
+		xptPacketbuffer_writeU8(sendBuffer, &sendError, xptShareToSubmit->fixedMultiplierSize);
+		xptPacketbuffer_writeData(sendBuffer, xptShareToSubmit->fixedMultiplier, xptShareToSubmit->fixedMultiplierSize, &sendError);
 		// bnChainMultiplier
-		xptPacketbuffer_writeU8(xptClient->sendBuffer, &sendError, xptShareToSubmit->chainMultiplierSize);
-		xptPacketbuffer_writeData(xptClient->sendBuffer, xptShareToSubmit->chainMultiplier, xptShareToSubmit->chainMultiplierSize, &sendError);
+		xptPacketbuffer_writeU8(sendBuffer, &sendError, xptShareToSubmit->chainMultiplierSize);
+		xptPacketbuffer_writeData(sendBuffer, xptShareToSubmit->chainMultiplier, xptShareToSubmit->chainMultiplierSize, &sendError);
 	}
 	else if( xptShareToSubmit->algorithm == ALGORITHM_SHA256 || xptShareToSubmit->algorithm == ALGORITHM_SCRYPT || xptShareToSubmit->algorithm == ALGORITHM_METISCOIN )
 	{
 		// original merkleroot (used to identify work)
-		xptPacketbuffer_writeData(xptClient->sendBuffer, xptShareToSubmit->merkleRootOriginal, 32, &sendError);
+		xptPacketbuffer_writeData(sendBuffer, xptShareToSubmit->merkleRootOriginal, 32, &sendError);
 		// user extra nonce (up to 16 bytes)
-		xptPacketbuffer_writeU8(xptClient->sendBuffer, &sendError, xptShareToSubmit->userExtraNonceLength);
-		xptPacketbuffer_writeData(xptClient->sendBuffer, xptShareToSubmit->userExtraNonceData, xptShareToSubmit->userExtraNonceLength, &sendError);
+		xptPacketbuffer_writeU8(sendBuffer, &sendError, xptShareToSubmit->userExtraNonceLength);
+		xptPacketbuffer_writeData(sendBuffer, xptShareToSubmit->userExtraNonceData, xptShareToSubmit->userExtraNonceLength, &sendError);
 	}
 	else if( xptShareToSubmit->algorithm == ALGORITHM_PROTOSHARES )
 	{
 		// nBirthdayA
-		xptPacketbuffer_writeU32(xptClient->sendBuffer, &sendError, xptShareToSubmit->nBirthdayA);
+		xptPacketbuffer_writeU32(sendBuffer, &sendError, xptShareToSubmit->nBirthdayA);
 		// nBirthdayB
-		xptPacketbuffer_writeU32(xptClient->sendBuffer, &sendError, xptShareToSubmit->nBirthdayB);
+		xptPacketbuffer_writeU32(sendBuffer, &sendError, xptShareToSubmit->nBirthdayB);
 		// original merkleroot (used to identify work)
-		xptPacketbuffer_writeData(xptClient->sendBuffer, xptShareToSubmit->merkleRootOriginal, 32, &sendError);
+		xptPacketbuffer_writeData(sendBuffer, xptShareToSubmit->merkleRootOriginal, 32, &sendError);
 		// user extra nonce (up to 16 bytes)
-		xptPacketbuffer_writeU8(xptClient->sendBuffer, &sendError, xptShareToSubmit->userExtraNonceLength);
-		xptPacketbuffer_writeData(xptClient->sendBuffer, xptShareToSubmit->userExtraNonceData, xptShareToSubmit->userExtraNonceLength, &sendError);
+		xptPacketbuffer_writeU8(sendBuffer, &sendError, xptShareToSubmit->userExtraNonceLength);
+		xptPacketbuffer_writeData(sendBuffer, xptShareToSubmit->userExtraNonceData, xptShareToSubmit->userExtraNonceLength, &sendError);
 	}
-	// share id (server sends this back in shareAck, so we can identify share response)
-	xptPacketbuffer_writeU32(xptClient->sendBuffer, &sendError, 0);
+	// share id (server sends this back in shareAck, so we can identify share response), set when queued
+	xptPacketbuffer_writeU32(sendBuffer, &sendError, 0);
 	// finalize
-	xptPacketbuffer_finalizeWritePacket(xptClient->sendBuffer);
-	// send to client
-	send(xptClient->clientSocket, (const char*)(xptClient->sendBuffer->buffer), xptClient->sendBuffer->parserIndex, 0);
+	xptPacketbuffer_finalizeWritePacket(sendBuffer);
+	// queue for sending
+	xptClient_queuePacket(xptClient, sendBuffer, xptShareToSubmit);
 }
 
 /*
@@ -469,8 +727,8 @@ void xptClient_sendPing(xptClient_t* xptClient)
 	xptPacketbuffer_writeU64(xptClient->sendBuffer, &sendError, timestamp);
 	// finalize
 	xptPacketbuffer_finalizeWritePacket(xptClient->sendBuffer);
-	// send to client
-	send(xptClient->clientSocket, (const char*)(xptClient->sendBuffer->buffer), xptClient->sendBuffer->parserIndex, 0);
+	// queued behind pending shares so it can't split one of them
+	xptClient_queuePacket(xptClient, xptClient->sendBuffer, NULL);
 }
 
 /*
@@ -518,21 +776,17 @@ bool xptClient_process(xptClient_t* xptClient)
 {
 	if( xptClient == NULL )
 		return false;
-	// are there shares to submit?
-
-	EnterCriticalSection(&xptClient->cs_shareSubmit);
-	if( xptClient->list_shareSubmitQueue->objectCount > 0 )
+	// wait for the connection to be established
+	if( xptClient->connecting )
 	{
-		for(uint32 i=0; i<xptClient->list_shareSubmitQueue->objectCount; i++)
-		{
-			xptShareToSubmit_t* xptShareToSubmit = (xptShareToSubmit_t*)xptClient->list_shareSubmitQueue->objects[i];
-			xptClient_sendShare(xptClient, xptShareToSubmit);
-			free(xptShareToSubmit);
-		}
-		// clear list
-		xptClient->list_shareSubmitQueue->objectCount = 0;
+		if( xptClient_completeConnect(xptClient) == false )
+			return false;
+		if( xptClient->connecting )
+			return true;
 	}
-	LeaveCriticalSection(&xptClient->cs_shareSubmit);
+	// send queued shares
+	if( xptClient_flushSendQueue(xptClient) == false )
+		return false;
 	// check if we need to send ping
 	uint32 currentTime = (uint32)time(NULL);
 	if( xptClient->time_sendPing != 0 && currentTime >= xptClient->time_sendPing )
@@ -599,10 +853,10 @@ bool xptClient_process(xptClient_t* xptClient)
 			xptClient->recvSize = 0;
 			xptClient->opcode = 0;
 			// disconnect
-			if( xptClient->clientSocket != 0 )
+			if( xptClient->clientSocket != SOCKET_ERROR )
 			{
 				closesocket(xptClient->clientSocket);
-				xptClient->clientSocket = 0;
+				xptClient->clientSocket = SOCKET_ERROR;
 			}
 			xptClient->disconnected = true;
 			return false;
@@ -634,7 +888,105 @@ bool xptClient_isAuthenticated(xptClient_t* xptClient)
 
 void xptClient_foundShare(xptClient_t* xptClient, xptShareToSubmit_t* xptShareToSubmit)
 {
+	xptClient_sendShare(xptClient, xptShareToSubmit);
+}
+
+/*
+ * Counts a reject reason, reasons are sanitised so they can be printed and exported as they are
+ */
+static void xptClient_countRejectReason(xptClient_t* xptClient, char* rejectReason)
+{
+	char reason[64];
+	uint32 length = 0;
+	for(uint32 i=0; rejectReason[i] != '\0' && length < sizeof(reason)-1; i++)
+	{
+		char c = rejectReason[i];
+		reason[length++] = (isalnum((unsigned char)c) || c == ' ' || c == '-' || c == '.') ? c : '_';
+	}
+	reason[length] = '\0';
+	if( length == 0 )
+		strcpy(reason, "unknown");
+	for(uint32 i=0; i<xptClient->rejectReasonCount; i++)
+	{
+		if( strcmp(xptClient->rejectReasons[i].reason, reason) == 0 )
+		{
+			xptClient->rejectReasons[i].count++;
+			return;
+		}
+	}
+	if( xptClient->rejectReasonCount < XPT_REJECT_REASONS )
+	{
+		xptRejectReason_t* entry = xptClient->rejectReasons + xptClient->rejectReasonCount;
+		strcpy(entry->reason, reason);
+		entry->count = 1;
+		xptClient->rejectReasonCount++;
+	}
+	else
+		xptClient->rejectOtherCount++;
+}
+
+/*
+ * Matches a share ack to its in-flight share and updates the ack statistics
+ * Servers that don't echo the share id answer in submit order, those acks go to the oldest sent share
+ */
+void xptClient_resolveShareAck(xptClient_t* xptClient, bool hasShareId, uint32 shareId, uint32 shareErrorCode, char* rejectReason)
+{
+	uint64 ackTime = getTimeHighRes();
+	xptInflightShare_t share;
+	bool matched = false;
 	EnterCriticalSection(&xptClient->cs_shareSubmit);
-	simpleList_add(xptClient->list_shareSubmitQueue, xptShareToSubmit);
+	if( hasShareId == false )
+	{
+		// skip shares that were evicted or lost with an old connection
+		for(shareId=xptClient->nextAckId; shareId!=xptClient->nextShareId+1; shareId++)
+		{
+			xptInflightShare_t* inflight = xptClient->inflightShares + (shareId & (XPT_INFLIGHT_SHARES-1));
+			if( inflight->shareId == shareId && inflight->sent )
+				break;
+		}
+	}
+	xptInflightShare_t* inflight = xptClient->inflightShares + (shareId & (XPT_INFLIGHT_SHARES-1));
+	if( shareId != 0 && inflight->shareId == shareId )
+	{
+		share = *inflight;
+		inflight->shareId = 0;
+		if( hasShareId == false )
+			xptClient->nextAckId = shareId+1;
+		matched = true;
+	}
 	LeaveCriticalSection(&xptClient->cs_shareSubmit);
-}
\ No newline at end of file
+	if( matched )
+		metrics_record(&xptClient->shareAckLatency, metrics_ticksToMicroseconds(ackTime - share.submitTime));
+	else
+		xptClient->acksUnmatched++;
+	if( shareErrorCode == 0 )
+	{
+		xptClient->sharesAccepted++;
+		return;
+	}
+	xptClient->sharesRejected++;
+	xptClient_countRejectReason(xptClient, rejectReason);
+	// stale rejects are traced back to the age of the work and the work switch
+	char reasonLower[512];
+	uint32 i;
+	for(i=0; rejectReason[i] != '\0' && i < sizeof(reasonLower)-1; i++)
+		reasonLower[i] = tolower((unsigned char)rejectReason[i]);
+	reasonLower[i] = '\0';
+	bool stale = strstr(reasonLower, "stale") != NULL || (matched && share.outdated);
+	if( stale )
+	{
+		xptClient->staleRejects++;
+		if( matched )
+		{
+			metrics_record(&xptClient->staleWorkAge, share.workAge);
+			if( share.outdated )
+			{
+				xptClient->lateRejects++;
+				metrics_record(&xptClient->staleLateBy, share.lateBy);
+				printf("Stale share: work was %.1f s old, submitted %.0f ms after the block change\n", share.workAge / 1000000.0, share.lateBy / 1000.0);
+			}
+			else
+				printf("Stale share: work was %.1f s old\n", share.workAge / 1000000.0);
+		}
+	}
+}
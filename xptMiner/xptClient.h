@@ -1,5 +1,11 @@
 #define XPT_DEVELOPER_FEE_MAX_ENTRIES	(8)
 
+#define XPT_SEND_QUEUE_SIZE				(256)	// packets the outbound ring holds, power of two
+#define XPT_SEND_PACKET_MAX				(512)	// largest serialised share (primecoin with both multipliers)
+#define XPT_INFLIGHT_SHARES				(1024)	// submitted shares tracked until their ack, power of two
+#define XPT_REJECT_REASONS				(8)		// distinct reject reasons counted, the rest is summed up as "other"
+#define XPT_CONNECT_TIMEOUT				(10000)	// milliseconds until a connection attempt is given up
+
 typedef struct  
 {
 	uint8 algorithm;
@@ -23,8 +29,37 @@ typedef struct
 	uint8 merkleRootOriginal[32];
 	uint32 userExtraNonceLength;
 	uint8 userExtraNonceData[16];
+	// origin of the work, to trace stale rejects
+	uint32 blockHeight;
+	uint64 workTime; // getTimeHighRes() when the work arrived, 0 if unknown
 }xptShareToSubmit_t;
 
+// Submitted share waiting for its ack, slot (shareId & (XPT_INFLIGHT_SHARES-1))
+typedef struct  
+{
+	uint32 shareId; // 0 = free slot
+	bool sent; // completely handed to the socket, lost if the connection drops before the ack
+	bool outdated; // a newer block was already known when the share was submitted
+	uint64 submitTime; // getTimeHighRes() in xptClient_foundShare()
+	uint32 workAge; // microseconds from receiving the work until submitting the share
+	uint32 lateBy; // microseconds from receiving the newer block until submitting the share, if outdated
+}xptInflightShare_t;
+
+typedef struct  
+{
+	char reason[64];
+	uint32 count;
+}xptRejectReason_t;
+
+// Serialised packet waiting in the outbound queue
+typedef struct  
+{
+	uint32 size;
+	uint32 shareId; // 0 for packets that aren't shares, only shares are counted in the send latency
+	uint64 queueTime; // getTimeHighRes() when it was queued
+	uint8 data[XPT_SEND_PACKET_MAX];
+}xptOutboundPacket_t;
+
 typedef struct  
 {
 	uint16 devFee;
@@ -48,6 +83,8 @@ typedef struct
 	uint32 opcode;
 	// disconnect info
 	bool disconnected;
+	bool connecting; // TCP connect still in progress, the login is sent once it completes. Stays set if the attempt failed
+	uint32 connectTime; // getTimeMilliseconds() when the connection attempt was started
     bool gotLoginResponse;
     bool loginRejected;
 	// work data
@@ -55,9 +92,35 @@ typedef struct
 	xptBlockWorkInfo_t blockWorkInfo;
 	bool hasWorkData;
 	float earnedShareValue; // this value is sent by the server with each new block that is sent
-	// shares to submit
-	CRITICAL_SECTION cs_shareSubmit;
-	simpleList_t* list_shareSubmitQueue;
+	// outbound queue, filled by the miner threads (shares) and the connection loop (pings), sent by xptClient_process()
+	CRITICAL_SECTION cs_shareSubmit; // only guards the queue positions and the overflow list, never held during socket calls
+	xptOutboundPacket_t* sendQueue; // ring of XPT_SEND_QUEUE_SIZE packets, allocated once
+	volatile uint32 sendQueueHead; // next packet to send, only advanced by the connection loop
+	volatile uint32 sendQueueTail; // next free slot
+	uint32 sendQueueOffset; // bytes of the head packet already sent
+	simpleList_t* list_sendOverflow; // packets queued while the ring was full, moved into it as it drains
+	// outbound queue metrics
+	volatile uint32 sendQueueDepthMax;
+	volatile uint32 sendOverflowCount;
+	metricsHistogram_t shareSendLatency; // from xptClient_foundShare() until the socket accepted the whole share
+	// share acks, the in-flight table is guarded by cs_shareSubmit
+	uint32 nextShareId; // monotonically increasing, 0 is never used
+	uint32 nextAckId; // oldest share that can still be unacknowledged, acks without an id are matched in order
+	xptInflightShare_t inflightShares[XPT_INFLIGHT_SHARES];
+	volatile uint64 blockChangeTime; // getTimeHighRes() when the current block height arrived
+	volatile uint32 blockChangeHeight;
+	uint32 sharesAccepted;
+	uint32 sharesRejected;
+	uint32 sharesUnacknowledged; // sent but the connection dropped before the ack, or evicted from the in-flight table
+	uint32 acksUnmatched; // acks that matched no in-flight share
+	uint32 staleRejects; // rejected as stale or submitted on outdated work
+	uint32 lateRejects; // stale rejects submitted after the next block was already known, lost to the work switch
+	xptRejectReason_t rejectReasons[XPT_REJECT_REASONS];
+	uint32 rejectReasonCount;
+	uint32 rejectOtherCount;
+	metricsHistogram_t shareAckLatency; // from xptClient_foundShare() until the ack
+	metricsHistogram_t staleWorkAge; // age of the work of stale rejects
+	metricsHistogram_t staleLateBy; // how long after the block change late rejects were submitted
 	// timers
 	uint32 time_sendPing;
 	uint64 pingSum;
@@ -78,7 +141,9 @@ void xptClient_forceDisconnect(xptClient_t* xptClient);
 bool xptClient_process(xptClient_t* xptClient); // needs to be called in a loop
 bool xptClient_isDisconnected(xptClient_t* xptClient, char** reason);
 bool xptClient_isAuthenticated(xptClient_t* xptClient);
-void xptClient_foundShare(xptClient_t* xptClient, xptShareToSubmit_t* xptShareToSubmit);
+void xptClient_foundShare(xptClient_t* xptClient, xptShareToSubmit_t* xptShareToSubmit); // copies the share, never blocks on the network
+uint32 xptClient_getSendQueueDepth(xptClient_t* xptClient);
+void xptClient_resolveShareAck(xptClient_t* xptClient, bool hasShareId, uint32 shareId, uint32 shareErrorCode, char* rejectReason);
 
 // never send this directly
 void xptClient_sendWorkerLogin(xptClient_t* xptClient);
@@ -91,6 +91,12 @@ bool xptClient_processPacket_blockData1(xptClient_t* xptClient)
 		// The first hash in xptClient->blockWorkInfo.txHashes is reserved for the coinbase transaction
 	}
 	xptClient->blockWorkInfo.timeWork = time(NULL);
+	if( xptClient->blockWorkInfo.height != xptClient->blockChangeHeight )
+	{
+		// shares on older work submitted from now on are likely to be rejected as stale
+		xptClient->blockChangeTime = getTimeHighRes();
+		xptClient->blockChangeHeight = xptClient->blockWorkInfo.height;
+	}
 	xptClient->blockWorkInfo.timeBias = xptClient->blockWorkInfo.nTime - (uint32)time(NULL);
 	xptClient->hasWorkData = true;
 	// add general block info (primecoin new pow for xpt v4, removed in xpt v5)
@@ -171,6 +177,9 @@ bool xptClient_processPacket_shareAck(xptClient_t* xptClient)
 	float shareValue = xptPacketbuffer_readFloat(cpb, &readError);
 	if( readError )
 		return false;
+	// newer servers echo the share id, older ones answer in submit order
+	uint32 shareId = xptPacketbuffer_readU32(cpb, &readError);
+	bool hasShareId = (readError == false);
 	if( shareErrorCode == 0 )
 	{
 		time_t now = time(0);
@@ -187,6 +196,7 @@ bool xptClient_processPacket_shareAck(xptClient_t* xptClient)
 		if( rejectReason[0] != '\0' )
 			printf("Reason: %s\n", rejectReason);
 	}
+	xptClient_resolveShareAck(xptClient, hasShareId, shareId, shareErrorCode, rejectReason);
 	return true;
 }
 
@@ -1,8 +1,50 @@
 #include"global.h"
 #include "ticker.h"
 #include <iostream>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
+#define XPT_SERVER_EPOLL_EVENTS		(256)			// events fetched per epoll_wait() call
+#define XPT_SERVER_WAIT_MS			(250)			// block check interval when no socket is active
+#define XPT_SERVER_SEND_QUEUE_LIMIT	(4*1024*1024)	// clients that fall further behind are disconnected
+#define XPT_SERVER_SEND_SEGMENTS	(16)			// queue segments gathered per send call
 
+/*
+ * Returns true if the last socket operation failed only because the non-blocking socket was not ready
+ */
+static bool xptServer_wouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+/*
+ * Sets the socket as non-blocking
+ */
+static void xptServer_setNonBlocking(SOCKET s)
+{
+#ifdef _WIN32
+	unsigned int nonblocking=1;
+	unsigned int cbRet;
+	WSAIoctl(s, FIONBIO, &nonblocking, sizeof(nonblocking), NULL, 0, (LPDWORD)&cbRet, NULL, NULL);
+#else
+	int flags, err;
+	flags = fcntl(s, F_GETFL, 0);
+	flags |= O_NONBLOCK;
+	err = fcntl(s, F_SETFL, flags); //ignore errors for now..
+#endif
+}
 
 /*
  * Creates a new x.pushthrough server instance that listens on the specified port
@@ -24,10 +66,31 @@ xptServer_t* xptServer_create(uint16 port)
 		free(xptServer);
 		return NULL;
 	}
-	listen(s, 64);
+	listen(s, SOMAXCONN);
+	// accepting is done in batches until the backlog is empty
+	xptServer_setNonBlocking(s);
 	xptServer->acceptSocket = s;
+#ifdef __linux__
+	// the accept socket is level-triggered so connections left in the backlog (e.g. out of file descriptors) are retried
+	xptServer->epollFd = epoll_create1(0);
+	epoll_event acceptEvent;
+	memset(&acceptEvent, 0x00, sizeof(epoll_event));
+	acceptEvent.events = EPOLLIN;
+	acceptEvent.data.ptr = NULL; // NULL marks the accept socket
+	if( xptServer->epollFd < 0 || epoll_ctl(xptServer->epollFd, EPOLL_CTL_ADD, s, &acceptEvent) != 0 )
+	{
+		printf("xptServer_create(): Unable to set up epoll\n");
+		if( xptServer->epollFd >= 0 )
+			close(xptServer->epollFd);
+		closesocket(s);
+		free(xptServer);
+		return NULL;
+	}
+#endif
 	// init client list
 	xptServer->list_connections = simpleList_create(64);
+	xptServer->list_disconnected = simpleList_create(16);
+	xptServer->sendBuffer = xptPacketbuffer_create(64*1024);
 	// return server object
 	return xptServer;
 }
@@ -43,21 +106,50 @@ xptServerClient_t* xptServer_newClient(xptServer_t* xptServer, SOCKET s)
 	xptServerClient->clientSocket = s;
 	xptServerClient->packetbuffer = xptPacketbuffer_create(4*1024); // 4kb
 	xptServerClient->xptServer = xptServer;
-	// set socket as non-blocking
-#ifdef _WIN32
-	unsigned int nonblocking=1;
-	unsigned int cbRet;
-	WSAIoctl(s, FIONBIO, &nonblocking, sizeof(nonblocking), NULL, 0, (LPDWORD)&cbRet, NULL, NULL);
-#else
-	int flags, err;
-	flags = fcntl(s, F_GETFL, 0); 
-	flags |= O_NONBLOCK;
-	err = fcntl(s, F_SETFL, flags); //ignore errors for now..
+	xptServer_setNonBlocking(s);
+#ifdef __linux__
+	// edge-triggered, every event is handled until the socket reports EAGAIN
+	epoll_event clientEvent;
+	memset(&clientEvent, 0x00, sizeof(epoll_event));
+	clientEvent.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	clientEvent.data.ptr = xptServerClient;
+	if( epoll_ctl(xptServer->epollFd, EPOLL_CTL_ADD, s, &clientEvent) != 0 )
+	{
+		closesocket(s);
+		xptPacketbuffer_free(xptServerClient->packetbuffer);
+		free(xptServerClient);
+		return NULL;
+	}
 #endif
+	// register client
+	xptServerClient->listIndex = xptServer->list_connections->objectCount;
+	simpleList_add(xptServer->list_connections, xptServerClient);
 	// return client object
 	return xptServerClient;
 }
 
+/*
+ * Accepts all pending connections
+ */
+void xptServer_acceptClients(xptServer_t* xptServer)
+{
+	while( true )
+	{
+		SOCKET s = accept(xptServer->acceptSocket, 0, 0);
+#ifdef _WIN32
+		if( s == INVALID_SOCKET )
+#else
+		if( s < 0 )
+#endif
+		{
+			if( xptServer_wouldBlock() == false )
+				printf("xptServer_acceptClients(): accept() failed with error %d\n", WSAGetLastError());
+			break;
+		}
+		xptServer_newClient(xptServer, s);
+	}
+}
+
 /*
  * Called whenever we received a full packet from a client
  * Return false if the packet is invalid and the client should be disconnected
@@ -73,75 +165,334 @@ bool xptServer_processPacket(xptServer_t* xptServer, xptServerClient_t* xptServe
 }
 
 /*
- * Called whenever we received some bytes from a client
+ * Called whenever the client socket became readable
+ * Receives until the socket has no more data, as required by edge-triggered notifications
+ * Returns false if the client disconnected or sent an invalid packet
  */
 bool xptServer_receiveData(xptServer_t* xptServer, xptServerClient_t* xptServerClient)
 {
-	sint32 packetFullSize = 4; // the packet always has at least the size of the header
-	if( xptServerClient->recvSize > 0 )
-		packetFullSize += xptServerClient->recvSize;
-	sint32 bytesToReceive = (sint32)(packetFullSize - xptServerClient->recvIndex);
-	// packet buffer is always large enough at this point
-	sint32 r = recv(xptServerClient->clientSocket, (char*)(xptServerClient->packetbuffer->buffer+xptServerClient->recvIndex), bytesToReceive, 0);
-	if( r <= 0 )
+	while( xptServerClient->disconnected == false )
 	{
-		// receive error, client disconnected
-		return false;
+		sint32 packetFullSize = 4; // the packet always has at least the size of the header
+		if( xptServerClient->recvSize > 0 )
+			packetFullSize += xptServerClient->recvSize;
+		sint32 bytesToReceive = (sint32)(packetFullSize - xptServerClient->recvIndex);
+		// packet buffer is always large enough at this point
+		sint32 r = recv(xptServerClient->clientSocket, (char*)(xptServerClient->packetbuffer->buffer+xptServerClient->recvIndex), bytesToReceive, 0);
+		if( r <= 0 )
+		{
+			// receive error, is it a real error or just because of non blocking sockets?
+			if( r < 0 && xptServer_wouldBlock() )
+				return true;
+			// client disconnected
+			return false;
+		}
+		xptServerClient->recvIndex += r;
+		// header just received?
+		if( xptServerClient->recvIndex == packetFullSize && packetFullSize == 4 )
+		{
+			// process header
+			uint32 headerVal = *(uint32*)xptServerClient->packetbuffer->buffer;
+			uint32 opcode = (headerVal&0xFF);
+			uint32 packetDataSize = (headerVal>>8)&0xFFFFFF;
+			// validate header size
+			if( packetDataSize >= (1024*1024*2-4) )
+			{
+				// packets larger than 4mb are not allowed
+				printf("xptServer_receiveData(): Packet exceeds 2mb size limit\n");
+				return false;
+			}
+			xptServerClient->recvSize = packetDataSize;
+			xptServerClient->opcode = opcode;
+			// enlarge packetBuffer if too small
+			if( (xptServerClient->recvSize+4) > xptServerClient->packetbuffer->bufferLimit )
+			{
+				xptPacketbuffer_changeSizeLimit(xptServerClient->packetbuffer, (xptServerClient->recvSize+4));
+			}
+		}
+		// have we received the full packet?
+		if( xptServerClient->recvIndex >= (xptServerClient->recvSize+4) )
+		{
+			// process packet
+			xptServerClient->packetbuffer->bufferSize = (xptServerClient->recvSize+4);
+			if( xptServer_processPacket(xptServer, xptServerClient) == false )
+				return false;
+			xptServerClient->recvIndex = 0;
+			xptServerClient->recvSize = 0;
+			xptServerClient->opcode = 0;
+		}
+	}
+	return true;
+}
+
+/*
+ * Creates a shared buffer, the caller holds the first reference
+ */
+xptSharedBuffer_t* xptSharedBuffer_create(uint32 size)
+{
+	xptSharedBuffer_t* sharedBuffer = (xptSharedBuffer_t*)malloc(sizeof(xptSharedBuffer_t)+size);
+	sharedBuffer->refCount = 1;
+	sharedBuffer->size = size;
+	sharedBuffer->data = (uint8*)(sharedBuffer+1);
+	return sharedBuffer;
+}
+
+/*
+ * Drops a reference, the buffer is freed with the last one
+ */
+void xptSharedBuffer_release(xptSharedBuffer_t* sharedBuffer)
+{
+	sharedBuffer->refCount--;
+	if( sharedBuffer->refCount == 0 )
+		free(sharedBuffer);
+}
+
+/*
+ * Prints the latency histogram of the current block broadcast
+ */
+void xptServer_printBroadcastLatency(xptServer_t* xptServer)
+{
+	metricsHistogram_t* latency = &xptServer->broadcastLatency;
+	printf("Send %d blocks to %d workers, latency p50/p90/p99/max: %.1f/%.1f/%.1f/%.1f ms", xptServer->broadcastPayloads, xptServer->broadcastWorkers,
+		metrics_getPercentile(latency, 50) / 1000.0, metrics_getPercentile(latency, 90) / 1000.0,
+		metrics_getPercentile(latency, 99) / 1000.0, metrics_getPercentile(latency, 100) / 1000.0);
+	if( xptServer->broadcastDropped > 0 )
+		printf(", %d dropped", xptServer->broadcastDropped);
+	if( xptServer->broadcastPending > 0 )
+		printf(", %d still queued", xptServer->broadcastPending);
+	printf("\n");
+}
+
+/*
+ * Called when a queued segment was sent completely or dropped
+ */
+static void xptServer_segmentDone(xptServer_t* xptServer, xptSendSegment_t* segment, bool sent)
+{
+	if( segment->broadcastTime != 0 && segment->broadcastTime == xptServer->broadcastTime )
+	{
+		if( sent )
+			metrics_record(&xptServer->broadcastLatency, metrics_elapsedMicroseconds(segment->broadcastTime));
+		else
+			xptServer->broadcastDropped++;
+		xptServer->broadcastPending--;
+		// the histogram is complete once the last client got its data
+		if( xptServer->broadcastPending == 0 && xptServer->broadcastActive == false )
+			xptServer_printBroadcastLatency(xptServer);
 	}
-	xptServerClient->recvIndex += r;
-	// header just received?
-	if( xptServerClient->recvIndex == packetFullSize && packetFullSize == 4 )
+	xptSharedBuffer_release(segment->buffer);
+}
+
+/*
+ * Appends part of a shared buffer to the send queue of the client, the queue takes its own reference
+ * broadcastTime is set for the last segment of broadcast block data, 0 otherwise
+ * Nothing is sent until xptServer_flushSendQueue() is called
+ */
+void xptServer_queueData(xptServer_t* xptServer, xptServerClient_t* xptServerClient, xptSharedBuffer_t* sharedBuffer, uint32 offset, uint32 size, uint64 broadcastTime)
+{
+	if( xptServerClient->sendQueueCount == xptServerClient->sendQueueLimit )
 	{
-		// process header
-		uint32 headerVal = *(uint32*)xptServerClient->packetbuffer->buffer;
-		uint32 opcode = (headerVal&0xFF);
-		uint32 packetDataSize = (headerVal>>8)&0xFFFFFF;
-		// validate header size
-		if( packetDataSize >= (1024*1024*2-4) )
+		if( xptServerClient->sendQueueHead > 0 )
 		{
-			// packets larger than 4mb are not allowed
-			printf("xptServer_receiveData(): Packet exceeds 2mb size limit\n");
-			return false;
+			// reuse the space of segments already sent
+			xptServerClient->sendQueueCount -= xptServerClient->sendQueueHead;
+			memmove(xptServerClient->sendQueue, xptServerClient->sendQueue+xptServerClient->sendQueueHead, xptServerClient->sendQueueCount*sizeof(xptSendSegment_t));
+			xptServerClient->sendQueueHead = 0;
 		}
-		xptServerClient->recvSize = packetDataSize;
-		xptServerClient->opcode = opcode;
-		// enlarge packetBuffer if too small
-		if( (xptServerClient->recvSize+4) > xptServerClient->packetbuffer->bufferLimit )
+		else
 		{
-			xptPacketbuffer_changeSizeLimit(xptServerClient->packetbuffer, (xptServerClient->recvSize+4));
+			xptServerClient->sendQueueLimit = std::max(xptServerClient->sendQueueLimit*2, (uint32)8);
+			xptServerClient->sendQueue = (xptSendSegment_t*)realloc(xptServerClient->sendQueue, xptServerClient->sendQueueLimit*sizeof(xptSendSegment_t));
 		}
 	}
-	// have we received the full packet?
-	if( xptServerClient->recvIndex >= (xptServerClient->recvSize+4) )
+	xptSendSegment_t* segment = xptServerClient->sendQueue+xptServerClient->sendQueueCount;
+	segment->buffer = sharedBuffer;
+	segment->offset = offset;
+	segment->size = size;
+	segment->broadcastTime = broadcastTime;
+	sharedBuffer->refCount++;
+	xptServerClient->sendQueueCount++;
+	xptServerClient->sendQueueBytes += size;
+	if( broadcastTime != 0 )
+		xptServer->broadcastPending++;
+}
+
+/*
+ * Sends as much of the send queue as the socket accepts, up to XPT_SERVER_SEND_SEGMENTS segments per call of writev()
+ * Returns false on a socket error or if the client is too far behind
+ */
+bool xptServer_flushSendQueue(xptServer_t* xptServer, xptServerClient_t* xptServerClient)
+{
+	if( xptServerClient->disconnected )
+		return false;
+	while( xptServerClient->sendQueueHead < xptServerClient->sendQueueCount )
 	{
-		// process packet
-		if( xptServer_processPacket(xptServer, xptServerClient) == false )
+		// gather the queued segments
+		uint32 segmentCount = std::min(xptServerClient->sendQueueCount-xptServerClient->sendQueueHead, (uint32)XPT_SERVER_SEND_SEGMENTS);
+		xptSendSegment_t* segments = xptServerClient->sendQueue+xptServerClient->sendQueueHead;
+#ifdef _WIN32
+		WSABUF buffers[XPT_SERVER_SEND_SEGMENTS];
+		for(uint32 i=0; i<segmentCount; i++)
+		{
+			buffers[i].buf = (char*)(segments[i].buffer->data+segments[i].offset);
+			buffers[i].len = segments[i].size;
+		}
+		DWORD bytesSent = 0;
+		sint32 r = (WSASend(xptServerClient->clientSocket, buffers, segmentCount, &bytesSent, 0, NULL, NULL) == 0) ? (sint32)bytesSent : -1;
+#else
+		iovec buffers[XPT_SERVER_SEND_SEGMENTS];
+		for(uint32 i=0; i<segmentCount; i++)
+		{
+			buffers[i].iov_base = segments[i].buffer->data+segments[i].offset;
+			buffers[i].iov_len = segments[i].size;
+		}
+		// sendmsg() is writev() with flags, MSG_NOSIGNAL avoids SIGPIPE on closed connections
+		msghdr message;
+		memset(&message, 0x00, sizeof(msghdr));
+		message.msg_iov = buffers;
+		message.msg_iovlen = segmentCount;
+		sint32 r = (sint32)sendmsg(xptServerClient->clientSocket, &message, MSG_NOSIGNAL);
+#endif
+		if( r <= 0 )
+		{
+			if( r < 0 && xptServer_wouldBlock() )
+				break; // continued on the next writable notification
 			return false;
-		xptServerClient->recvIndex = 0;
-		xptServerClient->opcode = 0;
+		}
+		// consume sent segments
+		uint32 sent = (uint32)r;
+		xptServerClient->sendQueueBytes -= sent;
+		while( sent > 0 )
+		{
+			xptSendSegment_t* segment = xptServerClient->sendQueue+xptServerClient->sendQueueHead;
+			uint32 part = std::min(sent, segment->size);
+			segment->offset += part;
+			segment->size -= part;
+			sent -= part;
+			if( segment->size == 0 )
+			{
+				xptServer_segmentDone(xptServer, segment, true);
+				xptServerClient->sendQueueHead++;
+			}
+		}
+	}
+	if( xptServerClient->sendQueueHead == xptServerClient->sendQueueCount )
+	{
+		xptServerClient->sendQueueHead = 0;
+		xptServerClient->sendQueueCount = 0;
+	}
+	if( xptServerClient->sendQueueBytes > XPT_SERVER_SEND_QUEUE_LIMIT )
+	{
+		printf("xptServer_flushSendQueue(): Send queue limit exceeded for worker %s\n", xptServerClient->workerName);
+		return false;
 	}
 	return true;
 }
 
+/*
+ * Sends data to the client, whatever the socket does not accept right away is queued and sent once it becomes writable
+ * Returns false if the client is disconnected or too far behind, the caller should disconnect it
+ */
+bool xptServer_sendData(xptServer_t* xptServer, xptServerClient_t* xptServerClient, uint8* data, uint32 length)
+{
+	if( xptServerClient->disconnected )
+		return false;
+	uint32 sent = 0;
+	if( xptServerClient->sendQueueHead == xptServerClient->sendQueueCount )
+	{
+		// nothing queued, try to send directly
+		while( sent < length )
+		{
+			sint32 r = send(xptServerClient->clientSocket, (const char*)(data+sent), length-sent, MSG_NOSIGNAL);
+			if( r <= 0 )
+			{
+				if( r < 0 && xptServer_wouldBlock() )
+					break;
+				return false;
+			}
+			sent += r;
+		}
+		if( sent == length )
+			return true;
+	}
+	// queue a copy of the remaining data
+	xptSharedBuffer_t* remainder = xptSharedBuffer_create(length-sent);
+	memcpy(remainder->data, data+sent, length-sent);
+	xptServer_queueData(xptServer, xptServerClient, remainder, 0, remainder->size, 0);
+	xptSharedBuffer_release(remainder);
+	return xptServer_flushSendQueue(xptServer, xptServerClient);
+}
+
+/*
+ * Closes the client connection, the client object is deleted at the end of the current loop iteration
+ * Safe to call multiple times and from inside packet handlers
+ */
+void xptServer_disconnectClient(xptServer_t* xptServer, xptServerClient_t* xptServerClient)
+{
+	if( xptServerClient->disconnected )
+		return;
+	xptServerClient->disconnected = true;
+	// closing the socket also removes it from the epoll set
+	closesocket(xptServerClient->clientSocket);
+	xptServerClient->clientSocket = SOCKET_ERROR;
+	// drop unsent data, this also settles the broadcast statistics of the client
+	for(uint32 i=xptServerClient->sendQueueHead; i<xptServerClient->sendQueueCount; i++)
+		xptServer_segmentDone(xptServer, xptServerClient->sendQueue+i, false);
+	xptServerClient->sendQueueHead = 0;
+	xptServerClient->sendQueueCount = 0;
+	xptServerClient->sendQueueBytes = 0;
+	simpleList_add(xptServer->list_disconnected, xptServerClient);
+}
+
 /*
  * Deletes the client and frees the associated client data
- * Note that this method should never be called directly, if you want to disconnect a client - set xptServerClient->disconnected = true
+ * Note that this method should never be called directly, if you want to disconnect a client - use xptServer_disconnectClient()
  */
 void xptServer_deleteClient(xptServer_t* xptServer, xptServerClient_t* xptServerClient)
 {
 	if( xptServerClient->packetbuffer )
 		xptPacketbuffer_free(xptServerClient->packetbuffer);
+	if( xptServerClient->sendQueue )
+		free(xptServerClient->sendQueue);
 	free(xptServerClient);
 }
 
+/*
+ * Deletes all clients disconnected during the current loop iteration
+ * Each client knows its position in the connection list, so no list scan is needed
+ */
+void xptServer_deleteDisconnectedClients(xptServer_t* xptServer)
+{
+	simpleList_t* list = xptServer->list_connections;
+	for(uint32 i=0; i<xptServer->list_disconnected->objectCount; i++)
+	{
+		xptServerClient_t* client = (xptServerClient_t*)xptServer->list_disconnected->objects[i];
+		// move the last client into the free position
+		xptServerClient_t* lastClient = (xptServerClient_t*)list->objects[list->objectCount-1];
+		list->objects[client->listIndex] = lastClient;
+		lastClient->listIndex = client->listIndex;
+		list->objectCount--;
+		xptServer_deleteClient(xptServer, client);
+	}
+	xptServer->list_disconnected->objectCount = 0;
+}
+
 /*
  * Sends new block data to each client
+ * The block info is serialised once and shared by all send queues, only the merkle roots are written per client
  */
 void xptServer_sendNewBlockToAll(xptServer_t* xptServer, uint32 coinTypeIndex)
 {
-	uint64 time1 = getTimeMilliseconds();
-	sint32 workerCount = 0;
-	sint32 payloadCount = 0;
+	// a previous broadcast still waiting for slow clients is reported as it is
+	if( xptServer->broadcastPending > 0 )
+		xptServer_printBroadcastLatency(xptServer);
+	xptServer->broadcastTime = getTimeHighRes();
+	xptServer->broadcastActive = true;
+	xptServer->broadcastPending = 0;
+	xptServer->broadcastWorkers = 0;
+	xptServer->broadcastPayloads = 0;
+	xptServer->broadcastDropped = 0;
+	memset(&xptServer->broadcastLatency, 0x00, sizeof(metricsHistogram_t));
+	xptSharedBuffer_t* sharedBlockInfo = NULL;
 	for(uint32 i=0; i<xptServer->list_connections->objectCount; i++)
 	{
 		xptServerClient_t* xptServerClient = (xptServerClient_t*)xptServer->list_connections->objects[i];
@@ -150,12 +501,16 @@ void xptServer_sendNewBlockToAll(xptServer_t* xptServer, uint32 coinTypeIndex)
 		if( xptServerClient->coinTypeIndex != coinTypeIndex )
 			continue;
 		// send block data
-		xptServer_sendBlockData(xptServer, xptServerClient);
-		workerCount++;
-		payloadCount += xptServerClient->payloadNum;
+		xptServer->broadcastWorkers++;
+		xptServer->broadcastPayloads += xptServerClient->payloadNum;
+		if( xptServer_sendBlockData(xptServer, xptServerClient, &sharedBlockInfo) == false )
+			xptServer_disconnectClient(xptServer, xptServerClient);
 	}
-	uint32 time2 = getTimeMilliseconds() - time1;
-	printf("Send %d blocks to %d workers in %dms\n", payloadCount, workerCount, time2);
+	if( sharedBlockInfo )
+		xptSharedBuffer_release(sharedBlockInfo);
+	xptServer->broadcastActive = false;
+	if( xptServer->broadcastPending == 0 )
+		xptServer_printBroadcastLatency(xptServer);
 }
 
 /*
@@ -163,6 +518,8 @@ void xptServer_sendNewBlockToAll(xptServer_t* xptServer, uint32 coinTypeIndex)
  */
 void xptServer_checkForNewBlocks(xptServer_t* xptServer)
 {
+	if( xptServer->xptCallback_getBlockHeight == NULL )
+		return;
 	uint32 numberOfCoinTypes = 0;
 	uint32 blockHeightPerCoinType[32] = {0};
 	xptServer->xptCallback_getBlockHeight(xptServer, &numberOfCoinTypes, blockHeightPerCoinType);
@@ -177,94 +534,105 @@ void xptServer_checkForNewBlocks(xptServer_t* xptServer)
 	}
 }
 
+#ifdef __linux__
+
+/*
+ * Starts processing
+ * Only sockets with pending events are visited, the cost of a loop iteration does not grow with the number of idle clients
+ */
+void xptServer_startProcessing(xptServer_t* xptServer)
+{
+	epoll_event events[XPT_SERVER_EPOLL_EVENTS];
+	while( true )
+	{
+		sint32 eventCount = epoll_wait(xptServer->epollFd, events, XPT_SERVER_EPOLL_EVENTS, XPT_SERVER_WAIT_MS);
+		for(sint32 i=0; i<eventCount; i++)
+		{
+			xptServerClient_t* client = (xptServerClient_t*)events[i].data.ptr;
+			if( client == NULL )
+			{
+				xptServer_acceptClients(xptServer);
+				continue;
+			}
+			// clients are only deleted after the loop, a client disconnected earlier in this batch is still valid memory
+			if( client->disconnected )
+				continue;
+			if( events[i].events & EPOLLOUT )
+			{
+				if( xptServer_flushSendQueue(xptServer, client) == false )
+				{
+					xptServer_disconnectClient(xptServer, client);
+					continue;
+				}
+			}
+			// errors and hangups are reported by recv()
+			if( events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR) )
+			{
+				if( xptServer_receiveData(xptServer, client) == false )
+					xptServer_disconnectClient(xptServer, client);
+			}
+		}
+		// check for new blocks
+		xptServer_checkForNewBlocks(xptServer);
+		xptServer_deleteDisconnectedClients(xptServer);
+	}
+}
+
+#else
+
 /*
- * Starts processing 
+ * Starts processing
+ * select() fallback for platforms without epoll, limited to FD_SETSIZE sockets
  */
 void xptServer_startProcessing(xptServer_t* xptServer)
 {
-	fd_set fd;
+	fd_set fdRead;
+	fd_set fdWrite;
 	timeval sTimeout;
-	sTimeout.tv_sec = 0;
-	sTimeout.tv_usec = 250000;
-	//Sleep(1000); // 3 seconds pause to make sure other stuff has inited (there seems to be a crashbug somewhere?)
 	while( true )
 	{
-		FD_ZERO(&fd);
+		FD_ZERO(&fdRead);
+		FD_ZERO(&fdWrite);
 		// add server accept socket
-		FD_SET(xptServer->acceptSocket, &fd); // this line crashes?
+		FD_SET(xptServer->acceptSocket, &fdRead);
+		SOCKET maxSocket = xptServer->acceptSocket;
 		// add all connected sockets
 		for(uint32 i=0; i<xptServer->list_connections->objectCount; i++)
 		{
 			xptServerClient_t* client = (xptServerClient_t*)simpleList_get(xptServer->list_connections, i);
-			FD_SET(client->clientSocket, &fd);
+			FD_SET(client->clientSocket, &fdRead);
+			if( client->sendQueueHead < client->sendQueueCount )
+				FD_SET(client->clientSocket, &fdWrite);
+			maxSocket = std::max(maxSocket, client->clientSocket);
 		}
 		// check for socket events
-		sint32 r = select(0, &fd, 0, 0, &sTimeout); // wait one second
-		if( r )
+		sTimeout.tv_sec = 0;
+		sTimeout.tv_usec = XPT_SERVER_WAIT_MS*1000;
+		sint32 r = select((int)maxSocket+1, &fdRead, &fdWrite, 0, &sTimeout);
+		if( r > 0 )
 		{
-			// check for new connections
-			if( FD_ISSET(xptServer->acceptSocket, &fd) )
-			{
-				xptServer_newClient(xptServer, accept(xptServer->acceptSocket, 0, 0));
-				continue; // todo: this causes a bug without continue?
-			}
-			// check for client data received
+			// check for client data received and sent
 			for(uint32 i=0; i<xptServer->list_connections->objectCount; i++)
 			{
 				xptServerClient_t* client = (xptServerClient_t*)simpleList_get(xptServer->list_connections, i);
-				if( FD_ISSET(client->clientSocket, &fd) )
-				{
-					if( xptServer_receiveData(xptServer, client) == false )
-					{
-						// something went wrong inside of _receiveData()
-						// make sure the client gets disconnected
-						client->disconnected = true;
-						closesocket(client->clientSocket);
-						client->clientSocket = 0;
-					}
-				}
 				if( client->disconnected )
+					continue;
+				if( FD_ISSET(client->clientSocket, &fdWrite) && xptServer_flushSendQueue(xptServer, client) == false )
 				{
-					// close socket if not already done
-					if( client->clientSocket != 0 )
-					{
-						closesocket(client->clientSocket);
-						client->clientSocket = 0;
-					}
-					// delete client
-					xptServer_deleteClient(xptServer, client);
-					// remove from list
-					xptServer->list_connections->objects[i] = xptServer->list_connections->objects[xptServer->list_connections->objectCount-1];
-					xptServer->list_connections->objectCount--;
-					i--;
+					xptServer_disconnectClient(xptServer, client);
+					continue;
 				}
+				if( FD_ISSET(client->clientSocket, &fdRead) && xptServer_receiveData(xptServer, client) == false )
+					xptServer_disconnectClient(xptServer, client);
 			}
+			// check for new connections
+			if( FD_ISSET(xptServer->acceptSocket, &fdRead) )
+				xptServer_acceptClients(xptServer);
 		}
-		else
-			Sleep(1);
 		// check for new blocks
 		xptServer_checkForNewBlocks(xptServer);
-
-
-		// check all clients for connection blocking
-		// other stuff
-		//client->connectionOpenedTimer = GetTickCount();
-		//uint32 connectionTimeout = 35*1000;
-		//uint32 currentTimeoutTimer = GetTickCount();
-		//for(uint32 i=0; i<jrs->list_connections->objectCount; i++)
-		//{
-		//	xptServerClient_t* client = (xptServerClient_t*)simpleList_get(jrs->list_connections, i);
-		//	if( currentTimeoutTimer > (client->connectionOpenedTimer+connectionTimeout) )
-		//	{
-		//		// delete client
-		//		jsonRpc_deleteClient(client);
-		//		// remove from list
-		//		jrs->list_connections->objects[i] = jrs->list_connections->objects[jrs->list_connections->objectCount-1];
-		//		jrs->list_connections->objectCount--;
-		//		i--;
-		//	}
-		//}
-
-
+		xptServer_deleteDisconnectedClients(xptServer);
 	}
-}
\ No newline at end of file
+}
+
+#endif
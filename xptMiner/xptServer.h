@@ -14,6 +14,24 @@ typedef struct
 	uint32 seed;
 }xptWorkData_t;
 
+// Reference counted send data, shared by the send queues of all clients that get the same bytes
+// Only used by the server thread, so the count is not atomic
+typedef struct  
+{
+	uint32 refCount;
+	uint32 size;
+	uint8* data;
+}xptSharedBuffer_t;
+
+// Part of a shared buffer waiting in a client send queue
+typedef struct  
+{
+	xptSharedBuffer_t* buffer;
+	uint32 offset;
+	uint32 size;
+	uint64 broadcastTime; // set on the last segment of broadcast block data, see xptServer_t
+}xptSendSegment_t;
+
 typedef struct  
 {
 	uint32 height;
@@ -50,7 +68,19 @@ typedef struct _xptServer_t
 	int acceptSocket;
 #endif
 	simpleList_t* list_connections;
+	simpleList_t* list_disconnected; // clients closed during the current loop iteration, deleted at its end
+#ifdef __linux__
+	int epollFd;
+#endif
 	xptPacketbuffer_t* sendBuffer; // shared buffer for sending data
+	// latency of the current block broadcast, from the block check until a client's socket accepted all of its block data
+	uint64 broadcastTime; // getTimeHighRes() at the start of the broadcast
+	bool broadcastActive; // the broadcast loop is still queueing block data
+	uint32 broadcastPending; // clients whose block data is still queued
+	uint32 broadcastWorkers;
+	uint32 broadcastPayloads;
+	uint32 broadcastDropped; // clients that disconnected before their block data was sent
+	metricsHistogram_t broadcastLatency;
 	// last known block height (for new block detection)
 	uint32 coinTypeBlockHeight[32];
 	// callbacks
@@ -67,6 +97,7 @@ typedef struct
 	int clientSocket;
 #endif
 	bool disconnected;
+	uint32 listIndex; // position in xptServer->list_connections
 	// recv buffer
 	xptPacketbuffer_t* packetbuffer;
 	uint32 recvIndex;
@@ -80,6 +111,12 @@ typedef struct
 	uint32 userId;
 	uint32 coinTypeIndex;
 	uint32 payloadNum;
+	// send queue, holds what the socket did not accept yet
+	xptSendSegment_t* sendQueue;
+	uint32 sendQueueHead; // first unsent segment
+	uint32 sendQueueCount;
+	uint32 sendQueueLimit;
+	uint32 sendQueueBytes;
 
 	//uint32 size;
 	//// http auth
@@ -126,11 +163,21 @@ typedef struct
 xptServer_t* xptServer_create(uint16 port);
 void xptServer_startProcessing(xptServer_t* xptServer);
 
+// shared send buffers
+xptSharedBuffer_t* xptSharedBuffer_create(uint32 size);
+void xptSharedBuffer_release(xptSharedBuffer_t* sharedBuffer);
+
+// client connection
+bool xptServer_sendData(xptServer_t* xptServer, xptServerClient_t* xptServerClient, uint8* data, uint32 length);
+void xptServer_queueData(xptServer_t* xptServer, xptServerClient_t* xptServerClient, xptSharedBuffer_t* sharedBuffer, uint32 offset, uint32 size, uint64 broadcastTime);
+bool xptServer_flushSendQueue(xptServer_t* xptServer, xptServerClient_t* xptServerClient);
+void xptServer_disconnectClient(xptServer_t* xptServer, xptServerClient_t* xptServerClient);
+
 // private packet handlers
 bool xptServer_processPacket_authRequest(xptServer_t* xptServer, xptServerClient_t* xptServerClient);
 
 // public packet methods
-bool xptServer_sendBlockData(xptServer_t* xptServer, xptServerClient_t* xptServerClient);
+bool xptServer_sendBlockData(xptServer_t* xptServer, xptServerClient_t* xptServerClient, xptSharedBuffer_t** sharedBlockInfo);
 
 // packetbuffer
 xptPacketbuffer_t* xptPacketbuffer_create(uint32 initialSize);
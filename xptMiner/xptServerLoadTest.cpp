@@ -0,0 +1,163 @@
+#include"global.h"
+#include "ticker.h"
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Load generator for xptServer, not part of the miner
+//   xptserver-loadtest server <port>
+//   xptserver-loadtest client <host> <port> <connections> <seconds>
+// The server announces a new block every few seconds and prints the broadcast latency, the client
+// side opens the given number of xptClient connections and reports how many are alive and got work.
+// xptClient waits for the connect with select(), so one client process stays below FD_SETSIZE
+// sockets, start several of them for more load.
+
+#define LOADTEST_BLOCK_INTERVAL_MS	(5000)
+#define LOADTEST_PAYLOAD_NUM		(4)
+#define LOADTEST_REPORT_MS			(2000)
+#define LOADTEST_MAX_CONNECTIONS	(FD_SETSIZE-32)	// leaves room for the descriptors opened before the sockets
+
+// referenced by xptClient
+volatile uint32 invalidShareCount = 0;
+char* minerVersionString = (char*)"xptServerLoadTest";
+
+static uint32 loadTest_height = 1;
+static uint64 loadTest_lastBlockTime = 0;
+
+/*
+ * Raises the open file limit so thousands of sockets fit into one process
+ */
+static void loadTest_raiseFileLimit()
+{
+#ifndef _WIN32
+	struct rlimit limit;
+	if( getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max )
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+#endif
+}
+
+/*
+ * Server callback, also advances the block height every LOADTEST_BLOCK_INTERVAL_MS
+ */
+static void loadTest_getBlockHeight(xptServer_t* xptServer, uint32* coinTypeNum, uint32* blockHeightPerCoinType)
+{
+	// xptServer_processPacket_authRequest() does not log anybody in yet, accept every connection
+	// so that the block broadcasts reach them
+	for(uint32 i=0; i<xptServer->list_connections->objectCount; i++)
+	{
+		xptServerClient_t* xptServerClient = (xptServerClient_t*)xptServer->list_connections->objects[i];
+		xptServerClient->clientState = XPT_CLIENT_STATE_LOGGED_IN;
+		xptServerClient->payloadNum = LOADTEST_PAYLOAD_NUM;
+	}
+	uint64 currentTime = getTimeMilliseconds();
+	if( currentTime - loadTest_lastBlockTime > LOADTEST_BLOCK_INTERVAL_MS )
+	{
+		loadTest_height++;
+		loadTest_lastBlockTime = currentTime;
+	}
+	*coinTypeNum = 1;
+	blockHeightPerCoinType[0] = loadTest_height;
+}
+
+/*
+ * Server callback, fills in dummy work that is only distinct per payload
+ */
+static bool loadTest_generateWork(xptServer_t* /* xptServer */, uint32 numOfWorkEntries, uint32 /* coinTypeIndex */, xptBlockWorkInfo_t* xptBlockWorkInfo, xptWorkData_t* xptWorkData)
+{
+	xptBlockWorkInfo->height = loadTest_height;
+	xptBlockWorkInfo->nBits = 0x1d00ffff;
+	xptBlockWorkInfo->nTime = (uint32)time(NULL);
+	for(uint32 i=0; i<numOfWorkEntries; i++)
+	{
+		memset(xptWorkData[i].merkleRoot, i, 32);
+		xptWorkData[i].seed = i;
+	}
+	return true;
+}
+
+static int loadTest_runServer(uint16 port)
+{
+	xptServer_t* xptServer = xptServer_create(port);
+	if( xptServer == NULL )
+	{
+		printf("Unable to open port %d\n", port);
+		return 1;
+	}
+	xptServer->xptCallback_getBlockHeight = loadTest_getBlockHeight;
+	xptServer->xptCallback_generateWork = loadTest_generateWork;
+	printf("Listening on port %d, new block every %d ms\n", port, LOADTEST_BLOCK_INTERVAL_MS);
+	xptServer_startProcessing(xptServer);
+	return 0;
+}
+
+static int loadTest_runClients(char* host, uint16 port, uint32 connectionCount, uint32 duration)
+{
+	if( connectionCount > LOADTEST_MAX_CONNECTIONS )
+	{
+		printf("At most %d connections per client process\n", LOADTEST_MAX_CONNECTIONS);
+		return 1;
+	}
+	generalRequestTarget_t requestTarget;
+	memset(&requestTarget, 0x00, sizeof(generalRequestTarget_t));
+	requestTarget.ip = host;
+	requestTarget.port = port;
+	requestTarget.authUser = (char*)"loadtest";
+	requestTarget.authPass = (char*)"x";
+	std::vector<xptClient_t*> clients;
+	for(uint32 i=0; i<connectionCount; i++)
+	{
+		xptClient_t* xptClient = xptClient_create();
+		if( xptClient_connect(xptClient, &requestTarget) == false )
+		{
+			printf("Connection %d failed\n", i);
+			xptClient_free(xptClient);
+			break;
+		}
+		clients.push_back(xptClient);
+	}
+	printf("Connected %d clients\n", (uint32)clients.size());
+	uint64 endTime = getTimeMilliseconds() + (uint64)duration * 1000;
+	uint64 lastReportTime = 0;
+	while( getTimeMilliseconds() < endTime )
+	{
+		uint32 aliveCount = 0;
+		uint32 workCount = 0;
+		for(uint32 i=0; i<clients.size(); i++)
+		{
+			xptClient_process(clients[i]);
+			if( clients[i]->disconnected == false )
+				aliveCount++;
+			if( clients[i]->blockWorkInfo.height != 0 )
+				workCount++;
+		}
+		if( getTimeMilliseconds() - lastReportTime >= LOADTEST_REPORT_MS )
+		{
+			lastReportTime = getTimeMilliseconds();
+			printf("Alive: %d with work: %d\n", aliveCount, workCount);
+			fflush(stdout);
+		}
+		Sleep(20);
+	}
+	for(uint32 i=0; i<clients.size(); i++)
+		xptClient_free(clients[i]);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+#ifdef _WIN32
+	WSADATA wsa;
+	WSAStartup(MAKEWORD(2,2),&wsa);
+#endif
+	loadTest_raiseFileLimit();
+	if( argc == 3 && strcmp(argv[1], "server") == 0 )
+		return loadTest_runServer((uint16)atoi(argv[2]));
+	if( argc == 6 && strcmp(argv[1], "client") == 0 )
+		return loadTest_runClients(argv[2], (uint16)atoi(argv[3]), (uint32)atoi(argv[4]), (uint32)atoi(argv[5]));
+	printf("Usage: %s server <port>\n", argv[0]);
+	printf("       %s client <host> <port> <connections> <seconds>\n", argv[0]);
+	return 1;
+}
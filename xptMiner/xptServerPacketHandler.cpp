@@ -15,14 +15,15 @@ bool xptServer_sendAuthResponse(xptServer_t* xptServer, xptServerClient_t* xptSe
 	// finalize
 	xptPacketbuffer_finalizeWritePacket(xptServer->sendBuffer);
 	// send to client
-	send(xptServerClient->clientSocket, (const char*)(xptServer->sendBuffer->buffer), xptServer->sendBuffer->parserIndex, 0);
-	return true;
+	return xptServer_sendData(xptServer, xptServerClient, xptServer->sendBuffer->buffer, xptServer->sendBuffer->parserIndex);
 }
 
 /*
  * Generates the block data and sends it to the client
+ * The block info part of the packet is the same for every client of a broadcast, pass sharedBlockInfo to serialise it only once:
+ * it is created on the first call and has to be released by the caller afterwards. NULL sends to a single client.
  */
-bool xptServer_sendBlockData(xptServer_t* xptServer, xptServerClient_t* xptServerClient)
+bool xptServer_sendBlockData(xptServer_t* xptServer, xptServerClient_t* xptServerClient, xptSharedBuffer_t** sharedBlockInfo)
 {
 	// we need several callbacks to the main work manager:
 	if( xptServerClient->payloadNum < 1 || xptServerClient->payloadNum > 128 )
@@ -38,26 +39,40 @@ bool xptServer_sendBlockData(xptServer_t* xptServer, xptServerClient_t* xptServe
 		printf("xptServer_sendBlockData(): Unable to generate work data for worker %s\n", xptServerClient->workerName);
 		return false;
 	}
-	// build the packet
 	bool sendError = false;
-	xptPacketbuffer_beginWritePacket(xptServer->sendBuffer, XPT_OPC_S_WORKDATA1);
-	// add general block info
-	xptPacketbuffer_writeU32(xptServer->sendBuffer, &sendError, blockWorkInfo.height);				// block height
-	xptPacketbuffer_writeU32(xptServer->sendBuffer, &sendError, blockWorkInfo.nBits);				// nBits
-	xptPacketbuffer_writeU32(xptServer->sendBuffer, &sendError, blockWorkInfo.nBitsShare);			// nBitsRecommended / nBitsShare
-	xptPacketbuffer_writeU32(xptServer->sendBuffer, &sendError, blockWorkInfo.nTime);				// nTimestamp
-	xptPacketbuffer_writeData(xptServer->sendBuffer, blockWorkInfo.prevBlockHash, 32, &sendError);	// prevBlockHash
-	xptPacketbuffer_writeU32(xptServer->sendBuffer, &sendError, xptServerClient->payloadNum);		// payload num
+	xptSharedBuffer_t* blockInfo = sharedBlockInfo ? *sharedBlockInfo : NULL;
+	if( blockInfo == NULL )
+	{
+		// general block info, without the packet header
+		xptPacketbuffer_beginWritePacket(xptServer->sendBuffer, XPT_OPC_S_WORKDATA1);
+		xptPacketbuffer_writeU32(xptServer->sendBuffer, &sendError, blockWorkInfo.height);				// block height
+		xptPacketbuffer_writeU32(xptServer->sendBuffer, &sendError, blockWorkInfo.nBits);				// nBits
+		xptPacketbuffer_writeU32(xptServer->sendBuffer, &sendError, blockWorkInfo.nBitsShare);			// nBitsRecommended / nBitsShare
+		xptPacketbuffer_writeU32(xptServer->sendBuffer, &sendError, blockWorkInfo.nTime);				// nTimestamp
+		xptPacketbuffer_writeData(xptServer->sendBuffer, blockWorkInfo.prevBlockHash, 32, &sendError);	// prevBlockHash
+		blockInfo = xptSharedBuffer_create(xptServer->sendBuffer->parserIndex-4);
+		memcpy(blockInfo->data, xptServer->sendBuffer->buffer+4, blockInfo->size);
+		if( sharedBlockInfo )
+			*sharedBlockInfo = blockInfo;
+	}
+	// client part: packet header in front of the block info, payload num and merkle roots behind it
+	uint32 payloadSize = 4 + xptServerClient->payloadNum*32;
+	xptSharedBuffer_t* clientData = xptSharedBuffer_create(4 + payloadSize);
+	*(uint32*)clientData->data = (XPT_OPC_S_WORKDATA1&0xFF) | (((blockInfo->size+payloadSize)<<8)&0xFFFFFF00);
+	*(uint32*)(clientData->data+4) = xptServerClient->payloadNum;										// payload num
 	for(uint32 i=0; i<xptServerClient->payloadNum; i++)
 	{
 		// add merkle root for each work data entry
-		xptPacketbuffer_writeData(xptServer->sendBuffer, workData[i].merkleRoot, 32, &sendError);
+		memcpy(clientData->data+8+i*32, workData[i].merkleRoot, 32);
 	}
-	// finalize
-	xptPacketbuffer_finalizeWritePacket(xptServer->sendBuffer);
-	// send to client
-	send(xptServerClient->clientSocket, (const char*)(xptServer->sendBuffer->buffer), xptServer->sendBuffer->parserIndex, 0);
-	return true;
+	// queue the pieces and send them with one gathering write
+	xptServer_queueData(xptServer, xptServerClient, clientData, 0, 4, 0);
+	xptServer_queueData(xptServer, xptServerClient, blockInfo, 0, blockInfo->size, 0);
+	xptServer_queueData(xptServer, xptServerClient, clientData, 4, payloadSize, sharedBlockInfo ? xptServer->broadcastTime : 0);
+	xptSharedBuffer_release(clientData);
+	if( sharedBlockInfo == NULL )
+		xptSharedBuffer_release(blockInfo);
+	return xptServer_flushSendQueue(xptServer, xptServerClient);
 }
 
 /*